@@ -11,6 +11,7 @@
 #include "sr_if.h"
 #include "sr_protocol.h"
 #include "sr_utils.h"
+#include "sr_slowpath.h"
 
 /* 
   This function gets called every second. For each request sent out, we keep
@@ -19,37 +20,78 @@
 */
 void sr_arpcache_sweepreqs(struct sr_instance *sr) { 
     /* Fill this in */
-    struct sr_arpreq *req;
+    struct sr_arpreq *req, *next;
 
-    for (req = sr->cache.requests; req != NULL; req = req->next) {
+    /* sr_handle_arpreq may destroy req, so grab next first */
+    for (req = sr->cache.requests; req != NULL; req = next) {
+        next = req->next;
         sr_handle_arpreq(sr,req);
     }
 }
 
 /* You should not need to touch the rest of this code. */
 
-/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
-    pthread_mutex_lock(&(cache->lock));
-    
-    struct sr_arpentry *entry = NULL, *copy = NULL;
-    
+/* Entries are read without the cache lock. Writers (who still serialize on
+   cache->lock) bump the entry's sequence counter to an odd value before
+   touching it and back to even afterwards; readers retry if they saw an odd
+   counter or if it changed underneath them. */
+static void sr_arpentry_write_begin(struct sr_arpentry *entry) {
+    __atomic_store_n(&(entry->seq), entry->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sr_arpentry_write_end(struct sr_arpentry *entry) {
+    __atomic_store_n(&(entry->seq), entry->seq + 1, __ATOMIC_RELEASE);
+}
+
+int sr_arpcache_find_slot(struct sr_arpcache *cache, uint32_t ip,
+                          struct sr_arpentry *out) {
     int i;
     for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
+        struct sr_arpentry *entry = &(cache->entries[i]);
+        unsigned int seq;
+        
+        /* Cheap unsynchronized filter first; only a candidate match pays for
+           a validated snapshot. */
+        if (!(*(volatile int *)&entry->valid) || 
+            *(volatile uint32_t *)&entry->ip != ip) {
+            continue;
+        }
+        
+        do {
+            seq = __atomic_load_n(&(entry->seq), __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                continue;
+            }
+            memcpy(out, (const void *)entry, sizeof(struct sr_arpentry));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) || 
+                 seq != __atomic_load_n(&(entry->seq), __ATOMIC_RELAXED));
+        
+        if (out->valid && out->ip == ip) {
+            return i;
         }
     }
     
+    return -1;
+}
+
+int sr_arpcache_find(struct sr_arpcache *cache, uint32_t ip,
+                     struct sr_arpentry *out) {
+    return sr_arpcache_find_slot(cache, ip, out) >= 0;
+}
+
+/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
+   You must free the returned structure if it is not NULL. */
+struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
+    struct sr_arpentry entry, *copy = NULL;
+    
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
-    if (entry) {
+    if (sr_arpcache_find(cache, ip, &entry)) {
         copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
-        memcpy(copy, entry, sizeof(struct sr_arpentry));
+        memcpy(copy, &entry, sizeof(struct sr_arpentry));
     }
-        
-    pthread_mutex_unlock(&(cache->lock));
     
     return copy;
 }
@@ -64,7 +106,7 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet,           /* borrowed */
                                        unsigned int packet_len,
-                                       char *iface)
+                                       int ifindex)
 {
     pthread_mutex_lock(&(cache->lock));
     
@@ -84,14 +126,13 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
     }
     
     /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface) {
+    if (packet && packet_len && ifindex >= 0) {
         struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
         
         new_pkt->buf = (uint8_t *)malloc(packet_len);
         memcpy(new_pkt->buf, packet, packet_len);
         new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
+        new_pkt->ifindex = ifindex;
         new_pkt->next = req->packets;
         req->packets = new_pkt;
     }
@@ -136,10 +177,12 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
     }
     
     if (i != SR_ARPCACHE_SZ) {
+        sr_arpentry_write_begin(&(cache->entries[i]));
         memcpy(cache->entries[i].mac, mac, 6);
         cache->entries[i].ip = ip;
         cache->entries[i].added = time(NULL);
         cache->entries[i].valid = 1;
+        sr_arpentry_write_end(&(cache->entries[i]));
     }
     /*sr_arpcache_dump(cache);*/
     pthread_mutex_unlock(&(cache->lock));
@@ -176,8 +219,6 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
             nxt = pkt->next;
             if (pkt->buf)
                 free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
             free(pkt);
         }
         
@@ -240,7 +281,9 @@ void *sr_arpcache_timeout(void *sr_ptr) {
         int i;    
         for (i = 0; i < SR_ARPCACHE_SZ; i++) {
             if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
+                sr_arpentry_write_begin(&(cache->entries[i]));
                 cache->entries[i].valid = 0;
+                sr_arpentry_write_end(&(cache->entries[i]));
             }
         }
         
@@ -257,41 +300,26 @@ void sr_handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req){
     struct sr_packet *packet;
     if (req->times_sent >= 5) {
         for (packet = req->packets; packet != NULL; packet = packet->next) {
-            sr_send_icmp(sr, packet->buf, packet->len, 3, 1, 0);
+            sr_slowpath_icmp(sr, packet->buf, packet->len, 3, 1, 0);
         }
         sr_arpreq_destroy(&sr->cache, req);
     } 
     else if (req->sent == 0 || difftime(curtime, req->sent) >= 1.0){
-        uint8_t *out = calloc(1,sizeof(sr_ethernet_hdr_t)+sizeof(sr_arp_hdr_t));
-        sr_ethernet_hdr_t *ethHeader = (sr_ethernet_hdr_t *)out;
-        sr_arp_hdr_t *arpHeader = (sr_arp_hdr_t *)(out+sizeof(sr_ethernet_hdr_t));
-        
-        /* set ARPHeader to request */
-        arpHeader->ar_hrd = htons(0x0001); 
-        arpHeader->ar_pro = htons(0x800); 
-        arpHeader->ar_op = htons(0x0001);
-        arpHeader->ar_hln = 0x0006; 
-        arpHeader->ar_pln = 0x0004;
-        memset(arpHeader->ar_tha, 255, 6);
-        arpHeader->ar_tip = req->ip;/*ENDIANESS*/
-        /* set Ethernet Header */
-        ethHeader->ether_type = htons(0x0806);
-        memset(ethHeader->ether_dhost, 255,6);
-    
-        /* get outgoing interface and send the request */
-        struct sr_if* if_walker;
-        if_walker = sr_get_interface(sr, req->packets->iface);
-        if (if_walker){
-            arpHeader->ar_sip = if_walker->ip;
-            memcpy(arpHeader->ar_sha, if_walker->addr, 6);
-            memcpy(ethHeader->ether_shost, if_walker->addr, 6);
-            sr_send_packet (sr 
-                            ,out
-                            ,sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)
-                            ,if_walker->name);
-        }
+        sr_slowpath_arpreq(sr, req->ip, req->packets->ifindex);
         req->sent = curtime;
         req->times_sent++;
-        free(out);
     }
-}
\ No newline at end of file
+}
+
+void sr_send_arp_request(struct sr_instance *sr, uint32_t ip, int ifindex){
+    uint8_t out[SIZE_ETH+SIZE_ARP];
+    sr_arp_hdr_t *arpHeader = (sr_arp_hdr_t *)(out+SIZE_ETH);
+    struct sr_if* iface = sr_get_interface_by_index(sr, ifindex);
+
+    /* the interface's who-has, with only the target left to fill in */
+    if (iface){
+        memcpy(out, iface->tmpl.arp_req, SIZE_ETH+SIZE_ARP);
+        arpHeader->ar_tip = ip;
+        sr_send_packet(sr, out, SIZE_ETH+SIZE_ARP, iface->name);
+    }
+}
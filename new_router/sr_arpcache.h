@@ -77,7 +77,7 @@
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    int ifindex;                /* The outgoing interface, sr_if.index */
     struct sr_packet *next;
 };
 
@@ -86,6 +86,8 @@ struct sr_arpentry {
     uint32_t ip;                /* IP addr in network byte order */
     time_t added;         
     int valid;
+    unsigned int seq;           /* Seqlock counter, odd while a writer is
+                                   updating this entry */
 };
 
 struct sr_arpreq {
@@ -110,6 +112,18 @@ struct sr_arpcache {
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
+/* Lock-free version of sr_arpcache_lookup for the forwarding path. Copies a
+   consistent snapshot of the entry into *out and returns 1 on a hit, 0 on a
+   miss. Never blocks on cache->lock; a miss may be spurious while a writer is
+   mid-update, so callers should re-check under the lock before queueing. */
+int sr_arpcache_find(struct sr_arpcache *cache, uint32_t ip,
+                     struct sr_arpentry *out);
+
+/* sr_arpcache_find that returns the index of the entry it hit, or -1. The
+   entry's seq in *out changes whenever the entry does. */
+int sr_arpcache_find_slot(struct sr_arpcache *cache, uint32_t ip,
+                          struct sr_arpentry *out);
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
    that corresponds to this ARP request. The packet argument should not be
@@ -121,7 +135,7 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
                          unsigned int packet_len,
-                         char *iface);
+                         int ifindex);
 
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
@@ -138,9 +152,14 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache);
 
-/* Sends ARP requests out and drops those without responses */
+/* Sends ARP requests out and drops those without responses. Both the request
+   and the ICMP host unreachables are handed to the slow path, so this is safe
+   to call with cache->lock held. */
 void sr_handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req);
 
+/* Builds and sends a broadcast ARP request for ip out of interface ifindex. */
+void sr_send_arp_request(struct sr_instance *sr, uint32_t ip, int ifindex);
+
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
    a destructor, and a cleanup thread times out cache entries every 15
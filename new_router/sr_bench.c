@@ -0,0 +1,1863 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_bench.c
+ *
+ * Description:
+ *
+ * In-process benchmark. Builds a router instance with two interfaces
+ * (eth1 inside, eth2 outside), a routing table and a warm ARP cache, points
+ * the VNS socket at /dev/null and feeds synthetic frames straight into the
+ * packet handlers, so no VNS server or mininet is needed.
+ *
+ *   make bench && ./sr_bench [-n] [-p packets] [-f flows] [-w workers] [test]
+ *
+ *   -n   run in NAT mode (default: router mode)
+ *
+ * Tests:
+ *   scaling   inline handling, then the pipeline with 1..workers workers
+ *   syn       SYN storm: new connections/sec through the NAT handler, and
+ *             the legacy insert/update/rewrite sequence against
+ *             sr_nat_translate_outbound (always NAT mode, -p SYNs)
+ *   peers     one internal host/port talking to -f servers, P2P style
+ *             (always NAT mode)
+ *   flood     -f established flows, then -p SYNs from new flows against
+ *             a 4096 mapping / 4096 connection limit (always NAT mode)
+ *   scan      -p unsolicited inbound SYNs to unmapped ports, then the
+ *             pending-SYN table draining (always NAT mode, takes ~8s)
+ *   noise     -p inbound ACKs to unmapped ports with -f flows open
+ *             (always NAT mode)
+ *   churn     -p short flows: handshake, one ACK each way, then FIN both
+ *             ways (every 4th reset from outside instead), and the table
+ *             after the TIME_WAIT hold (always NAT mode, takes ~7s)
+ *   pool      -p SYNs from new flows with one external address, then a
+ *             pool of four, then the pool paired (always NAT mode)
+ *   udp       -p datagrams each way over -f UDP flows, every 8th flow
+ *             without a checksum, through the handlers and through the
+ *             translate calls with the checksums verified (always NAT mode)
+ *   hog       one internal host opening -p new ports in a loop while the
+ *             other hosts open a new flow every 64 packets, against a
+ *             16384 mapping limit (always NAT mode)
+ *   det       -p datagrams each way over -f UDP flows and -p SYNs from new
+ *             flows, from ordinary source ports, with the pool of four
+ *             stateful and then deterministic over the inside /24, and in
+ *             deterministic mode a SYN+ACK back for -f of the SYNs
+ *             (always NAT mode)
+ *   route     -p packets to -f destinations behind the default route,
+ *             with the destination cache and without (always router mode)
+ *   estab     -p ACKs each way over -f established TCP flows, with the
+ *             flow cache and without, and the cached rewrite checked
+ *             against the slow path (always NAT mode)
+ *   ping      -p echo requests to the router, through it and through it
+ *             with TTL 1, with heap allocations per packet (always router
+ *             mode)
+ *   icmp      -p packets with TTL 1 from -f inside hosts, and the time
+ *             exceeded errors the rate limit lets through (always router
+ *             mode)
+ *   options   TCP, UDP and ICMP frames with IP options (ip_hl 6..15)
+ *             and Ethernet padding, routed, expired, and out through the
+ *             NAT and back, with the checksums and the quoted header of
+ *             the errors checked (router and NAT mode)
+ *   burst     -p packets in bursts of 1, 8, 32 and 64 through
+ *             sr_handleburst, against single frames, to -f destinations in
+ *             router mode and over -f established flows in NAT mode
+ *   layout    bytes per mapping for -f connections, and cache misses per
+ *             outbound lookup (perf_event_open, when permitted)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_utils.h"
+#include "sr_protocol.h"
+#include "vnscommand.h"
+
+#define BENCH_INT_NET  "10.0.1.0"
+#define BENCH_INT_IP   "10.0.1.1"
+#define BENCH_INT_GW   "10.0.1.100"
+#define BENCH_EXT_IP   "172.64.3.1"
+#define BENCH_EXT_GW   "172.64.3.254"
+#define BENCH_SERVER   "93.184.216.34"
+
+static unsigned char bench_int_mac[6] = {0x02,0x00,0x00,0x00,0x01,0x01};
+static unsigned char bench_ext_mac[6] = {0x02,0x00,0x00,0x00,0x02,0x01};
+static unsigned char bench_gw_mac[6]  = {0x02,0x00,0x00,0x00,0x09,0x09};
+
+/* sr_vns_comm.o calls back into sr_main.c, which we don't link */
+int sr_verify_routing_table(struct sr_instance* sr)
+{
+    return 0;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t bench_ip(const char *s)
+{
+    struct in_addr a;
+    inet_aton(s, &a);
+    return a.s_addr;
+}
+
+/* NAT limits for the next bench_instance; 0 keeps the defaults */
+static unsigned int bench_max_mappings = 0;
+static unsigned int bench_max_conns = 0;
+static const char *bench_pool_spec = NULL;
+static int bench_paired = 0;
+static const char *bench_det_prefix = NULL;
+
+/* Count heap allocations in the whole process by interposing on glibc's
+   allocator, for tests that must show a path doesn't allocate */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+static unsigned long bench_allocs = 0;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+/* A fresh instance per run: the threads sr_init starts never exit, so
+   instances are never freed. */
+static struct sr_instance *bench_instance(unsigned short mode)
+{
+    struct sr_instance *sr = calloc(1, sizeof(struct sr_instance));
+    struct in_addr dest, gw, mask;
+
+    sr->sockfd = open("/dev/null", O_WRONLY);
+
+    sr_add_interface(sr, "eth1");
+    sr_set_ether_addr(sr, bench_int_mac);
+    sr_set_ether_ip(sr, bench_ip(BENCH_INT_IP));
+    sr_add_interface(sr, "eth2");
+    sr_set_ether_addr(sr, bench_ext_mac);
+    sr_set_ether_ip(sr, bench_ip(BENCH_EXT_IP));
+
+    dest.s_addr = bench_ip(BENCH_INT_NET);
+    gw.s_addr = bench_ip(BENCH_INT_GW);
+    mask.s_addr = bench_ip("255.255.255.0");
+    sr_add_rt_entry(sr, dest, gw, mask, "eth1");
+    dest.s_addr = 0;
+    gw.s_addr = bench_ip(BENCH_EXT_GW);
+    mask.s_addr = 0;
+    sr_add_rt_entry(sr, dest, gw, mask, "eth2");
+
+    sr->nat.max_mappings = bench_max_mappings;
+    sr->nat.max_conns = bench_max_conns;
+    if (bench_pool_spec != NULL) {
+        sr_nat_parse_pool(&(sr->nat), bench_pool_spec);
+    }
+    sr->nat.paired = bench_paired;
+    if (bench_det_prefix != NULL) {
+        sr_nat_set_deterministic(&(sr->nat), bench_det_prefix);
+    }
+    if (sr_init(sr, mode, 60, 7440, 300, 300) != 0) {
+        exit(1);
+    }
+
+    sr_arpcache_insert(&(sr->cache), bench_gw_mac, bench_ip(BENCH_INT_GW));
+    sr_arpcache_insert(&(sr->cache), bench_gw_mac, bench_ip(BENCH_EXT_GW));
+    return sr;
+}
+
+/* Build an outbound TCP segment from internal host flow f to the server */
+static unsigned int bench_tcp_frame(uint8_t *buf, unsigned int f, int syn)
+{
+    sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)buf;
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+
+    memset(buf, 0, len);
+    memcpy(eth->ether_dhost, bench_int_mac, 6);
+    memcpy(eth->ether_shost, bench_gw_mac, 6);
+    eth->ether_type = htons(ethertype_ip);
+
+    ip->ip_v = 4;
+    ip->ip_hl = 5;
+    ip->ip_len = htons(SIZE_IP+SIZE_TCP);
+    ip->ip_ttl = 64;
+    ip->ip_p = 6;
+    ip->ip_src = htonl(ntohl(bench_ip(BENCH_INT_NET)) + 2 + (f % 250));
+    ip->ip_dst = bench_ip(BENCH_SERVER);
+    ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+
+    tcp->tcp_src = htons(10000 + (f / 250) % 50000);
+    tcp->tcp_dst = htons(80);
+    tcp->tcp_seq = htonl(f);
+    tcp->tcp_off = 5;
+    tcp->syn = syn;
+    tcp->ack = !syn;
+    tcp->tcp_wdw = htons(65535);
+    tcp->tcp_sum = sr_tcp_cksum(buf+SIZE_ETH, len-SIZE_ETH);
+    return len;
+}
+
+/* Run npackets round-robin over nflows through sr, inline when workers is 0
+   and through the pipeline otherwise. Returns packets per second. */
+static double bench_run(unsigned short mode, int workers,
+                        unsigned long npackets, unsigned int nflows)
+{
+    struct sr_instance *sr = bench_instance(mode);
+    uint8_t **frames = malloc(nflows * sizeof(uint8_t *));
+    unsigned int *lens = malloc(nflows * sizeof(unsigned int));
+    unsigned long i, done;
+    double start, end;
+    int w;
+
+    if (workers > 0) {
+        sr_pipeline_init(sr, workers, NULL, 0);
+    }
+
+    /* open every flow first so the timed loop measures steady state */
+    for (i = 0; i < nflows; i++) {
+        frames[i] = malloc(IP_MAXPACKET);
+        lens[i] = bench_tcp_frame(frames[i], i, 1);
+        sr_handlepacket(sr, frames[i], lens[i], "eth1");
+        lens[i] = bench_tcp_frame(frames[i], i, 0);
+    }
+
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        unsigned int f = i % nflows;
+        if (workers > 0) {
+            sr_pipeline_dispatch(sr, frames[f], lens[f], "eth1");
+        } else {
+            sr_handlepacket(sr, frames[f], lens[f], "eth1");
+        }
+    }
+    if (workers > 0) {
+        do {
+            done = 0;
+            for (w = 0; w < workers; w++) {
+                done += __atomic_load_n(&(sr->pipeline.workers[w].packets),
+                                        __ATOMIC_ACQUIRE);
+            }
+            if (done < npackets) {
+                sched_yield();
+            }
+        } while (done < npackets);
+    }
+    while (__atomic_load_n(&(sr->tx.ring.head), __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&(sr->tx.ring.tail), __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    end = bench_now();
+
+    for (i = 0; i < nflows; i++) {
+        free(frames[i]);
+    }
+    free(frames);
+    free(lens);
+    return npackets / (end - start);
+}
+
+/* Prebuild n SYNs, each opening a new mapping. Capped so the busiest
+   shard doesn't run out of ports. */
+#define BENCH_MAX_SYNS 48000
+#define BENCH_SYN_STRIDE 64
+
+static uint8_t *bench_syn_frames(unsigned long n)
+{
+    uint8_t *frames = malloc(n * BENCH_SYN_STRIDE);
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        bench_tcp_frame(frames + i * BENCH_SYN_STRIDE, i, 1);
+    }
+    return frames;
+}
+
+/* Parse the frame the way sr_handlepacket would, then translate it */
+static int bench_nat_out(struct sr_nat *nat, uint8_t *frame, unsigned int len)
+{
+    struct sr_meta meta;
+
+    if (sr_parse(frame, len, &meta) != 0) {
+        return -1;
+    }
+    return sr_nat_translate_outbound(nat, frame, &meta);
+}
+
+static int bench_nat_in(struct sr_nat *nat, uint8_t *frame, unsigned int len)
+{
+    struct sr_meta meta;
+
+    if (sr_parse(frame, len, &meta) != 0) {
+        return -1;
+    }
+    return sr_nat_translate_inbound(nat, frame, &meta);
+}
+
+/* The pre-fusion outbound path: insert, update, full rewrite */
+static void bench_legacy_outbound(struct sr_nat *nat, uint8_t *frame,
+                                  unsigned int len, uint32_t ip_ext)
+{
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(frame+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(frame+SIZE_ETH+SIZE_IP);
+    struct sr_nat_mapping *map;
+    struct sr_nat_connection *con;
+    struct sr_meta meta;
+
+    map = sr_nat_insert_mapping(nat, ip->ip_src, tcp->tcp_src, nat_mapping_tcp);
+    if (map == NULL) {
+        return;
+    }
+    sr_parse(frame, len, &meta);
+    con = sr_nat_update_connection(nat, frame, &meta, 1);
+    if (con != NULL) {
+        free(con);
+    }
+    ip->ip_src = ip_ext;
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    tcp->tcp_src = htons(map->aux_ext);
+    tcp->tcp_sum = sr_tcp_cksum(frame+SIZE_ETH, len-SIZE_ETH);
+    sr_free_mapping(map);
+}
+
+static void bench_syn(unsigned long n)
+{
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    uint32_t ip_ext = bench_ip(BENCH_EXT_IP);
+    struct sr_instance *sr;
+    uint8_t *frames, *buf;
+    unsigned long i, bad = 0;
+    double start, legacy, fused;
+
+    if (n > BENCH_MAX_SYNS) {
+        n = BENCH_MAX_SYNS;
+    }
+    printf("syn: %lu new connections\n", n);
+
+    sr = bench_instance(1);
+    frames = bench_syn_frames(n);
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        sr_handlepacket(sr, frames + i * BENCH_SYN_STRIDE, len, "eth1");
+    }
+    printf("%-10s %12.1f kconn/s\n", "handler", n / (bench_now() - start) / 1000);
+    free(frames);
+
+    sr = bench_instance(1);
+    frames = bench_syn_frames(n);
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        bench_legacy_outbound(&(sr->nat), frames + i * BENCH_SYN_STRIDE, len, ip_ext);
+    }
+    legacy = n / (bench_now() - start);
+    printf("%-10s %12.1f kconn/s\n", "legacy", legacy / 1000);
+    free(frames);
+
+    sr = bench_instance(1);
+    frames = bench_syn_frames(n);
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        bench_nat_out(&(sr->nat), frames + i * BENCH_SYN_STRIDE, len);
+    }
+    fused = n / (bench_now() - start);
+    printf("%-10s %12.1f kconn/s %8.2fx\n", "fused", fused / 1000, fused / legacy);
+
+    /* the incremental checksums must match a full recompute */
+    for (i = 0; i < n; i++) {
+        buf = frames + i * BENCH_SYN_STRIDE + SIZE_ETH;
+        if (sr_tcp_cksum(buf, len - SIZE_ETH) != ((sr_tcp_hdr_t *)(buf+SIZE_IP))->tcp_sum ||
+            cksum(buf, SIZE_IP) != 0xffff) {
+            bad++;
+        }
+    }
+    printf("%-10s %12lu\n", "bad cksum", bad);
+    free(frames);
+}
+
+/* Flow f of a single internal socket: same source, server f */
+static unsigned int bench_peer_frame(uint8_t *buf, unsigned int f, int syn)
+{
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    unsigned int len = bench_tcp_frame(buf, 0, syn);
+
+    ip->ip_dst = htonl(ntohl(bench_ip(BENCH_SERVER)) + f / 4);
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    tcp->tcp_dst = htons(6881 + f % 4);
+    tcp->tcp_sum = sr_tcp_cksum(buf+SIZE_ETH, len-SIZE_ETH);
+    return len;
+}
+
+static void bench_peers(unsigned long npackets, unsigned int npeers)
+{
+    struct sr_instance *sr = bench_instance(1);
+    uint8_t *frames = malloc(npeers * BENCH_SYN_STRIDE);
+    uint8_t buf[BENCH_SYN_STRIDE];
+    unsigned int len = 0;
+    unsigned long i;
+    double start;
+
+    for (i = 0; i < npeers; i++) {
+        len = bench_peer_frame(buf, i, 1);
+        sr_handlepacket(sr, buf, len, "eth1");
+        bench_peer_frame(frames + i * BENCH_SYN_STRIDE, i, 0);
+    }
+
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        /* the handler rewrites in place, so translate a scratch copy */
+        memcpy(buf, frames + (i % npeers) * BENCH_SYN_STRIDE, len);
+        sr_handlepacket(sr, buf, len, "eth1");
+    }
+    printf("peers: %u connections on one mapping, %lu packets: %.1f kpps\n",
+           npeers, npackets, npackets / (bench_now() - start) / 1000);
+    free(frames);
+}
+
+/* Resident bytes, from /proc/self/statm */
+static long bench_rss(void)
+{
+    long size = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &size, &rss) != 2) {
+            rss = 0;
+        }
+        fclose(f);
+    }
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+/* Hardware cache miss counter for this thread, or -1 */
+static int bench_perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void bench_layout(unsigned long npackets, unsigned int nflows)
+{
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    struct sr_instance *sr = bench_instance(1);
+    uint8_t *frames;
+    uint8_t buf[BENCH_SYN_STRIDE];
+    unsigned long i, f;
+    long rss, misses = 0;
+    double start, elapsed;
+    int fd;
+
+    if (nflows > BENCH_MAX_SYNS) {
+        nflows = BENCH_MAX_SYNS;
+    }
+    frames = bench_syn_frames(nflows);
+
+    rss = bench_rss();
+    for (i = 0; i < nflows; i++) {
+        memcpy(buf, frames + i * BENCH_SYN_STRIDE, len);
+        bench_nat_out(&(sr->nat), buf, len);
+    }
+    rss = bench_rss() - rss;
+    for (i = 0; i < nflows; i++) {
+        bench_tcp_frame(frames + i * BENCH_SYN_STRIDE, i, 0);
+    }
+
+    printf("layout: %u mappings, sizeof mapping %lu, connection %lu\n", nflows,
+           (unsigned long)sizeof(struct sr_nat_mapping),
+           (unsigned long)sizeof(struct sr_nat_connection));
+    printf("%-16s %10.1f\n", "bytes/mapping", (double)rss / nflows);
+
+    fd = bench_perf_open();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        /* stride through the flows so consecutive lookups share nothing */
+        f = (i * 7919) % nflows;
+        memcpy(buf, frames + f * BENCH_SYN_STRIDE, len);
+        bench_nat_out(&(sr->nat), buf, len);
+    }
+    elapsed = bench_now() - start;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(fd);
+    }
+    printf("%-16s %10.1f\n", "ns/lookup", elapsed * 1e9 / npackets);
+    if (fd >= 0 && misses >= 0) {
+        printf("%-16s %10.1f\n", "misses/lookup", (double)misses / npackets);
+    } else {
+        printf("%-16s %10s\n", "misses/lookup", "n/a");
+    }
+    free(frames);
+}
+
+/* Turn outbound TCP segment frame into the server's reply to it, sent to
+   external port aux_ext */
+static void bench_tcp_reply(uint8_t *buf, uint16_t aux_ext, int syn)
+{
+    sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)buf;
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    uint32_t server = ip->ip_dst;
+    uint16_t port = tcp->tcp_dst;
+
+    memcpy(eth->ether_dhost, bench_ext_mac, 6);
+    ip->ip_dst = bench_ip(BENCH_EXT_IP);
+    ip->ip_src = server;
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    tcp->tcp_src = port;
+    tcp->tcp_dst = htons(aux_ext);
+    tcp->syn = syn;
+    tcp->ack = 1;
+    tcp->tcp_sum = sr_tcp_cksum(buf+SIZE_ETH, SIZE_IP+SIZE_TCP);
+}
+
+/* Full handshake plus one ACK each way for flow f. Returns 0 on success. */
+static int bench_establish(struct sr_instance *sr, unsigned int f)
+{
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    struct sr_nat_mapping *map;
+    unsigned int len;
+    uint16_t aux_ext;
+
+    len = bench_tcp_frame(buf, f, 1);
+    sr_handlepacket(sr, buf, len, "eth1");
+    bench_tcp_frame(buf, f, 1);
+    map = sr_nat_lookup_internal(&(sr->nat), ip->ip_src, tcp->tcp_src, nat_mapping_tcp);
+    if (map == NULL) {
+        return -1;
+    }
+    aux_ext = map->aux_ext;
+    sr_free_mapping(map);
+
+    bench_tcp_reply(buf, aux_ext, 1);
+    sr_handlepacket(sr, buf, len, "eth2");
+    len = bench_tcp_frame(buf, f, 0);
+    sr_handlepacket(sr, buf, len, "eth1");
+    bench_tcp_frame(buf, f, 0);
+    bench_tcp_reply(buf, aux_ext, 0);
+    sr_handlepacket(sr, buf, len, "eth2");
+    return 0;
+}
+
+static void bench_flood(unsigned long nsyns, unsigned int nestab)
+{
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    struct sr_instance *sr;
+    struct sr_nat_mapping *map;
+    unsigned long i, alive = 0;
+    unsigned int len;
+    long rss;
+    double start;
+
+    bench_max_mappings = 4096;
+    bench_max_conns = 4096;
+    sr = bench_instance(1);
+    bench_max_mappings = bench_max_conns = 0;
+
+    for (i = 0; i < nestab; i++) {
+        bench_establish(sr, i);
+    }
+    printf("flood: %u established flows, %lu SYNs from new flows\n", nestab, nsyns);
+    sr_nat_print_stats(&(sr->nat), stdout);
+
+    rss = bench_rss();
+    start = bench_now();
+    for (i = 0; i < nsyns; i++) {
+        /* new flows beyond the established ones, cycling past 12M */
+        len = bench_tcp_frame(buf, nestab + i % 12000000, 1);
+        sr_handlepacket(sr, buf, len, "eth1");
+    }
+    printf("%-16s %10.1f kSYN/s\n", "flood rate", nsyns / (bench_now() - start) / 1000);
+    printf("%-16s %10ld KB\n", "rss growth", (bench_rss() - rss) / 1024);
+    sr_nat_print_stats(&(sr->nat), stdout);
+
+    for (i = 0; i < nestab; i++) {
+        bench_tcp_frame(buf, i, 0);
+        map = sr_nat_lookup_internal(&(sr->nat), ip->ip_src, tcp->tcp_src, nat_mapping_tcp);
+        if (map != NULL) {
+            alive++;
+            sr_free_mapping(map);
+        }
+    }
+    printf("%-16s %10lu/%u\n", "established left", alive, nestab);
+}
+
+static void bench_scan(unsigned long nsyns)
+{
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    struct sr_instance *sr = bench_instance(1);
+    unsigned long i;
+    unsigned int len;
+    long rss;
+    double start;
+
+    printf("scan: %lu SYNs to unmapped external ports\n", nsyns);
+    rss = bench_rss();
+    start = bench_now();
+    for (i = 0; i < nsyns; i++) {
+        len = bench_tcp_frame(buf, i, 1);
+        bench_tcp_reply(buf, 1024 + i % 64000, 1);
+        ip->ip_src = htonl(ntohl(ip->ip_src) + (i / 64000));
+        ip->ip_sum = 0;
+        ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+        tcp->ack = 0;
+        tcp->tcp_sum = sr_tcp_cksum(buf+SIZE_ETH, len-SIZE_ETH);
+        sr_handlepacket(sr, buf, len, "eth2");
+    }
+    printf("%-16s %10.1f kSYN/s\n", "scan rate", nsyns / (bench_now() - start) / 1000);
+    printf("%-16s %10ld KB\n", "rss growth", (bench_rss() - rss) / 1024);
+    sr_nat_print_stats(&(sr->nat), stdout);
+
+    sleep(SR_NAT_PENDING_HOLD + 2);
+    printf("after %ds:\n", SR_NAT_PENDING_HOLD + 2);
+    sr_nat_print_stats(&(sr->nat), stdout);
+}
+
+/* Ports in the middle of each shard's range; shards allocate from the
+   bottom, so these stay free while a shard has under 2000 mappings */
+#define BENCH_UNMAPPED(i) (SR_NAT_TCP_MIN + ((i) % SR_NAT_SHARDS) * 4032 + \
+                           2000 + ((i) / SR_NAT_SHARDS) % 1024)
+
+static void bench_noise(unsigned long npackets, unsigned int nflows)
+{
+    uint8_t *frames;
+    uint8_t buf[BENCH_SYN_STRIDE];
+    struct sr_instance *sr = bench_instance(1);
+    uint32_t ip_ext = bench_ip(BENCH_EXT_IP);
+    unsigned long i;
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    unsigned long hits = 0;
+    double start;
+
+    for (i = 0; i < nflows; i++) {
+        bench_establish(sr, i);
+    }
+    /* ACKs from the internet to ports nobody mapped */
+    frames = malloc(1024 * BENCH_SYN_STRIDE);
+    for (i = 0; i < 1024; i++) {
+        bench_tcp_frame(frames + i * BENCH_SYN_STRIDE, i, 0);
+        bench_tcp_reply(frames + i * BENCH_SYN_STRIDE, BENCH_UNMAPPED(i), 0);
+    }
+
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        memcpy(buf, frames + (i % 1024) * BENCH_SYN_STRIDE, len);
+        sr_handlepacket(sr, buf, len, "eth2");
+    }
+    printf("noise: %lu unsolicited ACKs, %u flows open: %.1f kpps\n",
+           npackets, nflows, npackets / (bench_now() - start) / 1000);
+    free(frames);
+
+    start = bench_now();
+    for (i = 0; i < npackets * 10; i++) {
+        hits += sr_nat_maybe_external(&(sr->nat), ip_ext, BENCH_UNMAPPED(i), nat_mapping_tcp);
+    }
+    printf("%-16s %10.1f ns (%lu false positives)\n", "filter check",
+           (bench_now() - start) * 1e9 / (npackets * 10), hits);
+}
+
+/* Set flags on a TCP frame built by bench_tcp_frame / bench_tcp_reply */
+static void bench_tcp_flags(uint8_t *buf, int fin, int rst, int ack)
+{
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+
+    tcp->syn = 0;
+    tcp->fin = fin;
+    tcp->rst = rst;
+    tcp->ack = ack;
+    tcp->tcp_sum = sr_tcp_cksum(buf+SIZE_ETH, SIZE_IP+SIZE_TCP);
+}
+
+/* Close established flow f: FIN out, FIN+ACK back, last ACK out, or a RST
+   from the server when reset is set */
+static void bench_close(struct sr_instance *sr, unsigned int f, int reset)
+{
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    struct sr_nat_mapping *map;
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    uint16_t aux_ext;
+
+    bench_tcp_frame(buf, f, 0);
+    map = sr_nat_lookup_internal(&(sr->nat), ip->ip_src, tcp->tcp_src, nat_mapping_tcp);
+    if (map == NULL) {
+        return;
+    }
+    aux_ext = map->aux_ext;
+    sr_free_mapping(map);
+
+    if (reset) {
+        bench_tcp_reply(buf, aux_ext, 0);
+        bench_tcp_flags(buf, 0, 1, 0);
+        sr_handlepacket(sr, buf, len, "eth2");
+        return;
+    }
+    bench_tcp_flags(buf, 1, 0, 1);
+    sr_handlepacket(sr, buf, len, "eth1");
+    bench_tcp_frame(buf, f, 0);
+    bench_tcp_reply(buf, aux_ext, 0);
+    bench_tcp_flags(buf, 1, 0, 1);
+    sr_handlepacket(sr, buf, len, "eth2");
+    bench_tcp_frame(buf, f, 0);
+    sr_handlepacket(sr, buf, len, "eth1");
+}
+
+static void bench_churn(unsigned long nflows)
+{
+    struct sr_instance *sr = bench_instance(1);
+    unsigned long i;
+    double start;
+
+    printf("churn: %lu short flows, every 4th reset by the server\n", nflows);
+    start = bench_now();
+    for (i = 0; i < nflows; i++) {
+        bench_establish(sr, i);
+        bench_close(sr, i, i % 4 == 3);
+    }
+    printf("%-16s %10.1f kflows/s\n", "rate", nflows / (bench_now() - start) / 1000);
+    sr_nat_print_stats(&(sr->nat), stdout);
+
+    sleep(SR_NAT_TCP_TIME_WAIT + 2);
+    printf("after %ds:\n", SR_NAT_TCP_TIME_WAIT + 2);
+    sr_nat_print_stats(&(sr->nat), stdout);
+}
+
+#define BENCH_POOL "172.64.3.1,172.64.3.2,172.64.3.3,172.64.3.4"
+
+/* Open nsyns flows; check the inbound key of every 16th and, when paired,
+   that each host kept one address */
+static void bench_pool_run(const char *name, const char *pool, int paired,
+                           unsigned long nsyns)
+{
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    uint32_t host_ext[250];
+    struct sr_instance *sr;
+    struct sr_nat_mapping *map, *back;
+    unsigned long i, opened = 0, bad = 0, split = 0;
+    unsigned int len = 0;
+    double start;
+
+    bench_pool_spec = pool;
+    bench_paired = paired;
+    sr = bench_instance(1);
+    bench_pool_spec = NULL;
+    bench_paired = 0;
+
+    start = bench_now();
+    for (i = 0; i < nsyns; i++) {
+        len = bench_tcp_frame(buf, i, 1);
+        opened += (bench_nat_out(&(sr->nat), buf, len) == 0);
+    }
+    printf("%-8s %10.1f kSYN/s %8lu opened", name, nsyns / (bench_now() - start) / 1000, opened);
+
+    memset(host_ext, 0, sizeof(host_ext));
+    for (i = 0; i < nsyns; i += 16) {
+        bench_tcp_frame(buf, i, 1);
+        map = sr_nat_lookup_internal(&(sr->nat), ip->ip_src, tcp->tcp_src, nat_mapping_tcp);
+        if (map == NULL) {
+            continue;
+        }
+        back = sr_nat_lookup_external(&(sr->nat), map->ip_ext, map->aux_ext, nat_mapping_tcp);
+        if (back == NULL || back->ip_int != ip->ip_src || back->aux_int != tcp->tcp_src) {
+            bad++;
+        }
+        if (host_ext[i % 250] != 0 && host_ext[i % 250] != map->ip_ext) {
+            split++;
+        }
+        host_ext[i % 250] = map->ip_ext;
+        sr_free_mapping(back);
+        sr_free_mapping(map);
+    }
+    printf(" %6lu bad inbound keys %6lu hosts on >1 address\n", bad, split);
+    sr_nat_print_stats(&(sr->nat), stdout);
+}
+
+static void bench_pool(unsigned long nsyns)
+{
+    printf("pool: %lu SYNs from new flows over 250 hosts\n", nsyns);
+    bench_pool_run("single", NULL, 0, nsyns);
+    bench_pool_run("pool", BENCH_POOL, 0, nsyns);
+    bench_pool_run("paired", BENCH_POOL, 1, nsyns);
+}
+
+/* Build an outbound UDP datagram with 32 bytes of payload from internal
+   host flow f to the server. Flows with f % 8 == 7 carry no checksum. */
+#define BENCH_UDP_PAYLOAD 32
+#define BENCH_UDP_STRIDE  128
+
+static uint16_t bench_udp_cksum(uint8_t *ipbuf)
+{
+    uint8_t tmp[SIZE_PTCP+SIZE_UDP+BENCH_UDP_PAYLOAD];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)ipbuf;
+    sr_tcp_pseudo_hdr_t *pseudo = (sr_tcp_pseudo_hdr_t *)tmp;
+    sr_udp_hdr_t *udp;
+    uint16_t sum;
+
+    pseudo->ip_src = ip->ip_src;
+    pseudo->ip_dst = ip->ip_dst;
+    pseudo->reserved = 0;
+    pseudo->ip_p = ip_protocol_udp;
+    pseudo->len = htons(SIZE_UDP+BENCH_UDP_PAYLOAD);
+    memcpy(tmp+SIZE_PTCP, ipbuf+SIZE_IP, SIZE_UDP+BENCH_UDP_PAYLOAD);
+    udp = (sr_udp_hdr_t *)(tmp+SIZE_PTCP);
+    udp->udp_sum = 0;
+    sum = cksum(tmp, sizeof(tmp));
+    return sum;
+}
+
+static unsigned int bench_udp_frame(uint8_t *buf, unsigned int f)
+{
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_udp_hdr_t *udp = (sr_udp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_UDP+BENCH_UDP_PAYLOAD;
+
+    /* the TCP frame gives the ethernet and ip headers */
+    bench_tcp_frame(buf, f, 0);
+    memset(buf+SIZE_ETH+SIZE_IP, 0x5a, SIZE_UDP+BENCH_UDP_PAYLOAD);
+    ip->ip_len = htons(SIZE_IP+SIZE_UDP+BENCH_UDP_PAYLOAD);
+    ip->ip_p = ip_protocol_udp;
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    udp->udp_src = htons(10000 + (f / 250) % 50000);
+    udp->udp_dst = htons(53);
+    udp->udp_len = htons(SIZE_UDP+BENCH_UDP_PAYLOAD);
+    udp->udp_sum = (f % 8 == 7) ? 0 : bench_udp_cksum(buf+SIZE_ETH);
+    return len;
+}
+
+/* Turn an outbound datagram into the server's reply to external port aux_ext */
+static void bench_udp_reply(uint8_t *buf, uint16_t aux_ext)
+{
+    sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)buf;
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_udp_hdr_t *udp = (sr_udp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    uint32_t server = ip->ip_dst;
+    uint16_t port = udp->udp_dst;
+    int nosum = (udp->udp_sum == 0);
+
+    memcpy(eth->ether_dhost, bench_ext_mac, 6);
+    ip->ip_dst = bench_ip(BENCH_EXT_IP);
+    ip->ip_src = server;
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    udp->udp_dst = htons(aux_ext);
+    udp->udp_src = port;
+    udp->udp_sum = nosum ? 0 : bench_udp_cksum(buf+SIZE_ETH);
+}
+
+/* 0 if ipbuf's UDP checksum is right (or absent and expected absent) */
+static int bench_udp_bad(uint8_t *ipbuf, int nosum)
+{
+    sr_udp_hdr_t *udp = (sr_udp_hdr_t *)(ipbuf+SIZE_IP);
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)ipbuf;
+    uint16_t ip_sum = ip->ip_sum;
+    int bad;
+
+    if (nosum) {
+        bad = (udp->udp_sum != 0);
+    } else {
+        bad = (udp->udp_sum != bench_udp_cksum(ipbuf));
+    }
+    ip->ip_sum = 0;
+    bad |= (cksum((uint8_t *)ip, SIZE_IP) != ip_sum);
+    ip->ip_sum = ip_sum;
+    return bad;
+}
+
+static void bench_udp(unsigned long npackets, unsigned int nflows)
+{
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_UDP+BENCH_UDP_PAYLOAD;
+    struct sr_instance *sr = bench_instance(1);
+    uint8_t *out = malloc((size_t)nflows * BENCH_UDP_STRIDE * 2);
+    uint8_t *in = out + (size_t)nflows * BENCH_UDP_STRIDE;
+    uint8_t buf[BENCH_UDP_STRIDE * 2];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_udp_hdr_t *udp = (sr_udp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    struct sr_nat_mapping *map;
+    unsigned long i, bad = 0;
+    unsigned int f;
+    double start;
+
+    /* open the mappings, then keep the replies */
+    for (f = 0; f < nflows; f++) {
+        bench_udp_frame(out + f * BENCH_UDP_STRIDE, f);
+        bench_udp_frame(buf, f);
+        sr_handlepacket(sr, buf, len, "eth1");
+        bench_udp_frame(buf, f);
+        map = sr_nat_lookup_internal(&(sr->nat), ip->ip_src, udp->udp_src, nat_mapping_udp);
+        if (map == NULL) {
+            printf("udp: flow %u has no mapping\n", f);
+            return;
+        }
+        bench_udp_reply(buf, map->aux_ext);
+        memcpy(in + f * BENCH_UDP_STRIDE, buf, len);
+        sr_free_mapping(map);
+    }
+
+    printf("udp: %lu datagrams each way over %u flows\n", npackets, nflows);
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        memcpy(buf, out + (i % nflows) * BENCH_UDP_STRIDE, len);
+        sr_handlepacket(sr, buf, len, "eth1");
+    }
+    printf("%-16s %10.1f kpps\n", "outbound", npackets / (bench_now() - start) / 1000);
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        memcpy(buf, in + (i % nflows) * BENCH_UDP_STRIDE, len);
+        sr_handlepacket(sr, buf, len, "eth2");
+    }
+    printf("%-16s %10.1f kpps\n", "inbound", npackets / (bench_now() - start) / 1000);
+
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        f = i % nflows;
+        memcpy(buf, out + f * BENCH_UDP_STRIDE, len);
+        bench_nat_out(&(sr->nat), buf, len);
+        memcpy(buf + BENCH_UDP_STRIDE, in + f * BENCH_UDP_STRIDE, len);
+        bench_nat_in(&(sr->nat), buf+BENCH_UDP_STRIDE, len);
+    }
+    printf("%-16s %10.1f ns/datagram\n", "translate",
+           (bench_now() - start) * 1e9 / (npackets * 2));
+
+    for (f = 0; f < nflows; f++) {
+        memcpy(buf, out + f * BENCH_UDP_STRIDE, len);
+        bench_nat_out(&(sr->nat), buf, len);
+        bad += bench_udp_bad(buf+SIZE_ETH, f % 8 == 7);
+        memcpy(buf, in + f * BENCH_UDP_STRIDE, len);
+        bench_nat_in(&(sr->nat), buf, len);
+        bad += bench_udp_bad(buf+SIZE_ETH, f % 8 == 7);
+    }
+    printf("%-16s %10lu\n", "bad cksum", bad);
+    sr_nat_print_stats(&(sr->nat), stdout);
+    free(out);
+}
+
+#define BENCH_HOG_IP "10.0.1.253"
+
+static void bench_hog(unsigned long nsyns)
+{
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    struct sr_instance *sr;
+    struct sr_nat_mapping *map;
+    unsigned long i, quiet = 0, alive = 0;
+    unsigned int len;
+    double start;
+
+    bench_max_mappings = 16384;
+    sr = bench_instance(1);
+    bench_max_mappings = 0;
+
+    printf("hog: %lu SYNs from new ports on %s, a new flow from another "
+           "host every 64\n", nsyns, BENCH_HOG_IP);
+    start = bench_now();
+    for (i = 0; i < nsyns; i++) {
+        if (i % 64 == 0) {
+            len = bench_tcp_frame(buf, quiet++, 1);
+        } else {
+            len = bench_tcp_frame(buf, i, 1);
+            ip->ip_src = bench_ip(BENCH_HOG_IP);
+            ip->ip_sum = 0;
+            ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+            tcp->tcp_src = htons(1024 + i % 64000);
+            tcp->tcp_sum = sr_tcp_cksum(buf+SIZE_ETH, len-SIZE_ETH);
+        }
+        sr_handlepacket(sr, buf, len, "eth1");
+    }
+    printf("%-16s %10.1f kSYN/s\n", "rate", nsyns / (bench_now() - start) / 1000);
+
+    for (i = 0; i < quiet; i++) {
+        bench_tcp_frame(buf, i, 0);
+        map = sr_nat_lookup_internal(&(sr->nat), ip->ip_src, tcp->tcp_src, nat_mapping_tcp);
+        if (map != NULL) {
+            alive++;
+            sr_free_mapping(map);
+        }
+    }
+    printf("%-16s %10lu/%lu\n", "other flows", alive, quiet);
+    sr_nat_print_stats(&(sr->nat), stdout);
+}
+
+#define BENCH_DET_PREFIX "10.0.1.0/24"
+
+/* 0 if the SYN+ACK to outbound SYN frame f, sent back to wherever sr
+   translated the SYN, reaches f's own host and port with a good sum */
+static int bench_det_tcp_bad(struct sr_instance *sr, unsigned int f)
+{
+    uint8_t orig[BENCH_SYN_STRIDE], buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    unsigned int len = bench_tcp_frame(orig, f, 1);
+    uint32_t ip_ext;
+    uint16_t aux_ext, sum;
+
+    memcpy(buf, orig, len);
+    if (bench_nat_out(&(sr->nat), buf, len) != 0) {
+        return 1;
+    }
+    ip_ext = ip->ip_src;
+    aux_ext = ntohs(tcp->tcp_src);
+    memcpy(buf, orig, len);
+    bench_tcp_reply(buf, aux_ext, 1);
+    ip->ip_dst = ip_ext;
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    tcp->tcp_sum = sr_tcp_cksum(buf+SIZE_ETH, len-SIZE_ETH);
+    if (bench_nat_in(&(sr->nat), buf, len) != 0 ||
+        memcmp(&(ip->ip_dst), orig + SIZE_ETH + 12, 4) != 0 ||
+        memcmp(&(tcp->tcp_dst), orig + SIZE_ETH + SIZE_IP, 2) != 0) {
+        return 1;
+    }
+    sum = tcp->tcp_sum;
+    return sum != sr_tcp_cksum(buf+SIZE_ETH, len-SIZE_ETH) ||
+           cksum((uint8_t *)ip, SIZE_IP) != 0xffff;
+}
+
+static void bench_det_run(const char *name, const char *prefix,
+                          unsigned long npackets, unsigned int nflows)
+{
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_UDP+BENCH_UDP_PAYLOAD;
+    uint8_t *out = malloc((size_t)nflows * BENCH_UDP_STRIDE * 2);
+    uint8_t *in = out + (size_t)nflows * BENCH_UDP_STRIDE;
+    uint8_t buf[BENCH_UDP_STRIDE * 2];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_udp_hdr_t *udp = (sr_udp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    struct sr_instance *sr;
+    unsigned long i, bad = 0, opened = 0;
+    unsigned int f, tlen;
+    uint32_t ip_ext;
+    uint16_t aux_ext;
+    double start, udp_ns, syn_rate;
+
+    bench_pool_spec = BENCH_POOL;
+    bench_det_prefix = prefix;
+    sr = bench_instance(1);
+    bench_pool_spec = NULL;
+    bench_det_prefix = NULL;
+
+    /* one datagram out per flow gives the external key for the reply */
+    for (f = 0; f < nflows; f++) {
+        bench_udp_frame(out + f * BENCH_UDP_STRIDE, f);
+        memcpy(buf, out + f * BENCH_UDP_STRIDE, len);
+        if (bench_nat_out(&(sr->nat), buf, len) != 0) {
+            printf("det: flow %u not translated\n", f);
+            free(out);
+            return;
+        }
+        ip_ext = ip->ip_src;
+        aux_ext = ntohs(udp->udp_src);
+        memcpy(buf, out + f * BENCH_UDP_STRIDE, len);
+        bench_udp_reply(buf, aux_ext);
+        ip->ip_dst = ip_ext;
+        ip->ip_sum = 0;
+        ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+        if (udp->udp_sum != 0) {
+            udp->udp_sum = bench_udp_cksum(buf+SIZE_ETH);
+        }
+        memcpy(in + f * BENCH_UDP_STRIDE, buf, len);
+    }
+
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        f = i % nflows;
+        memcpy(buf, out + f * BENCH_UDP_STRIDE, len);
+        bench_nat_out(&(sr->nat), buf, len);
+        memcpy(buf + BENCH_UDP_STRIDE, in + f * BENCH_UDP_STRIDE, len);
+        bench_nat_in(&(sr->nat), buf+BENCH_UDP_STRIDE, len);
+    }
+    udp_ns = (bench_now() - start) * 1e9 / (npackets * 2);
+
+    /* replies must reach the flow's own host and port, with good sums */
+    for (f = 0; f < nflows; f++) {
+        memcpy(buf, in + f * BENCH_UDP_STRIDE, len);
+        if (bench_nat_in(&(sr->nat), buf, len) != 0 ||
+            memcmp(&(ip->ip_dst), out + f * BENCH_UDP_STRIDE + SIZE_ETH + 12, 4) != 0 ||
+            memcmp(&(udp->udp_dst), out + f * BENCH_UDP_STRIDE + SIZE_ETH + SIZE_IP, 2) != 0) {
+            bad++;
+            continue;
+        }
+        bad += bench_udp_bad(buf+SIZE_ETH, f % 8 == 7);
+    }
+
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        tlen = bench_tcp_frame(buf, i, 1);
+        opened += (bench_nat_out(&(sr->nat), buf, tlen) == 0);
+    }
+    syn_rate = npackets / (bench_now() - start) / 1000;
+    /* stateful inbound TCP goes through the handler, not translate */
+    for (f = 0; prefix != NULL && f < nflows; f++) {
+        bad += bench_det_tcp_bad(sr, f);
+    }
+    printf("%-8s %8.1f ns/datagram %6lu bad %10.1f kSYN/s %8lu opened\n", name, udp_ns,
+           bad, syn_rate, opened);
+    sr_nat_print_stats(&(sr->nat), stdout);
+    free(out);
+}
+
+static void bench_det(unsigned long npackets, unsigned int nflows)
+{
+    printf("det: %lu datagrams each way over %u UDP flows, then %lu SYNs "
+           "from new flows\n",
+           npackets, nflows, npackets);
+    bench_det_run("stateful", NULL, npackets, nflows);
+    bench_det_run("det", BENCH_DET_PREFIX, npackets, nflows);
+}
+
+/* Run npackets from eth1 to ndests servers behind the default route in
+   router mode, with the destination cache and without it */
+static void bench_route(unsigned long npackets, unsigned int ndests)
+{
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    uint8_t *frames = malloc((size_t)ndests * BENCH_SYN_STRIDE);
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip;
+    struct sr_instance *sr;
+    struct sr_dcache_entry *entries;
+    unsigned long i;
+    unsigned int d;
+    double start;
+    int pass;
+
+    for (d = 0; d < ndests; d++) {
+        bench_tcp_frame(frames + d * BENCH_SYN_STRIDE, d, 0);
+        ip = (sr_ip_hdr_t *)(frames + d * BENCH_SYN_STRIDE + SIZE_ETH);
+        ip->ip_dst = htonl(ntohl(bench_ip(BENCH_SERVER)) + d);
+        ip->ip_sum = 0;
+        ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    }
+
+    printf("route: %lu packets from eth1 to %u destinations, router mode\n",
+           npackets, ndests);
+    for (pass = 0; pass < 2; pass++) {
+        sr = bench_instance(0);
+        entries = sr->dcache.entries;
+        if (pass == 1) {
+            sr->dcache.entries = NULL;
+        }
+        start = bench_now();
+        for (i = 0; i < npackets; i++) {
+            memcpy(buf, frames + (i % ndests) * BENCH_SYN_STRIDE, len);
+            sr_handlepacket(sr, buf, len, "eth1");
+        }
+        printf("%-10s %10.1f kpps %10lu hits %8lu misses\n", pass ? "uncached" : "cached",
+               npackets / (bench_now() - start) / 1000,
+               __atomic_load_n(&(sr->dcache.hits), __ATOMIC_RELAXED),
+               __atomic_load_n(&(sr->dcache.misses), __ATOMIC_RELAXED));
+        sr->dcache.entries = entries;
+    }
+    free(frames);
+}
+
+/* 0 if the IP and TCP checksums of the frame in buf are right */
+static int bench_tcp_bad(uint8_t *buf, unsigned int len)
+{
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    uint16_t ip_sum = ip->ip_sum;
+    int bad;
+
+    bad = (tcp->tcp_sum != sr_tcp_cksum(buf+SIZE_ETH, len-SIZE_ETH));
+    ip->ip_sum = 0;
+    bad |= (cksum((uint8_t *)ip, SIZE_IP) != ip_sum);
+    ip->ip_sum = ip_sum;
+    return bad;
+}
+
+/* Check the cached rewrite of every flow in sr: outbound it must match
+   translate_outbound plus the TTL, and both directions must leave good
+   checksums */
+static void bench_estab_check(struct sr_instance *sr, uint8_t *out, uint8_t *in,
+                              unsigned int nflows)
+{
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    uint8_t buf[BENCH_SYN_STRIDE], slow[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *slow_ip = (sr_ip_hdr_t *)(slow+SIZE_ETH);
+    unsigned long bad = 0, differ = 0, missed = 0;
+    struct sr_meta meta;
+    unsigned int f;
+
+    for (f = 0; f < nflows; f++) {
+        memcpy(buf, out + f * BENCH_SYN_STRIDE, len);
+        memcpy(slow, buf, len);
+        sr_parse(buf, len, &meta);
+        if (!sr_nat_flow_forward(sr, buf, len, &meta, sr_get_interface(sr, "eth1"))) {
+            missed++; /* evicted by a colliding flow */
+            continue;
+        }
+        bad += bench_tcp_bad(buf, len);
+        bench_nat_out(&(sr->nat), slow, len);
+        slow_ip->ip_ttl--;
+        slow_ip->ip_sum = 0;
+        slow_ip->ip_sum = cksum((uint8_t *)slow_ip, SIZE_IP);
+        differ += (memcmp(buf+SIZE_ETH, slow+SIZE_ETH, len-SIZE_ETH) != 0);
+
+        memcpy(buf, in + f * BENCH_SYN_STRIDE, len);
+        sr_parse(buf, len, &meta);
+        if (!sr_nat_flow_forward(sr, buf, len, &meta, sr_get_interface(sr, "eth2"))) {
+            missed++;
+            continue;
+        }
+        bad += bench_tcp_bad(buf, len);
+    }
+    printf("%-10s %10lu bad, %lu differ from the slow path, %lu not cached\n",
+           "rewrite", bad, differ, missed);
+}
+
+/* -p ACKs each way over -f established flows through the handlers, with
+   the flow cache and without it, then the cached rewrite checked against
+   the slow one */
+static void bench_estab(unsigned long npackets, unsigned int nflows)
+{
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    uint8_t *out = malloc((size_t)nflows * BENCH_SYN_STRIDE * 2);
+    uint8_t *in = out + (size_t)nflows * BENCH_SYN_STRIDE;
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)(buf+SIZE_ETH+SIZE_IP);
+    struct sr_instance *sr;
+    struct sr_nat_mapping *map;
+    struct sr_nat_flow *flows;
+    unsigned long i;
+    unsigned int f;
+    double start, kpps[2];
+    int pass;
+
+    printf("estab: %lu ACKs each way over %u established flows\n", npackets, nflows);
+    printf("%-10s %10s %10s %10s %10s\n", "", "out kpps", "in kpps", "hits", "misses");
+    for (pass = 0; pass < 2; pass++) {
+        sr = bench_instance(1);
+        for (f = 0; f < nflows; f++) {
+            if (bench_establish(sr, f) != 0) {
+                printf("estab: flow %u not established\n", f);
+                return;
+            }
+            bench_tcp_frame(out + f * BENCH_SYN_STRIDE, f, 0);
+            bench_tcp_frame(buf, f, 0);
+            map = sr_nat_lookup_internal(&(sr->nat), ip->ip_src, tcp->tcp_src,
+                                         nat_mapping_tcp);
+            bench_tcp_reply(buf, map->aux_ext, 0);
+            memcpy(in + f * BENCH_SYN_STRIDE, buf, len);
+            sr_free_mapping(map);
+        }
+        flows = sr->nat.flows;
+        if (pass == 1) {
+            sr->nat.flows = NULL;
+        }
+        start = bench_now();
+        for (i = 0; i < npackets; i++) {
+            memcpy(buf, out + (i % nflows) * BENCH_SYN_STRIDE, len);
+            sr_handlepacket(sr, buf, len, "eth1");
+        }
+        kpps[0] = npackets / (bench_now() - start) / 1000;
+        start = bench_now();
+        for (i = 0; i < npackets; i++) {
+            memcpy(buf, in + (i % nflows) * BENCH_SYN_STRIDE, len);
+            sr_handlepacket(sr, buf, len, "eth2");
+        }
+        kpps[1] = npackets / (bench_now() - start) / 1000;
+        printf("%-10s %10.1f %10.1f %10lu %10lu\n", pass ? "uncached" : "cached",
+               kpps[0], kpps[1], sr->nat.flow_hits, sr->nat.flow_misses);
+        if (pass == 0) {
+            bench_estab_check(sr, out, in, nflows);
+        }
+        sr->nat.flows = flows;
+    }
+    free(out);
+}
+
+/* Wait until the slow-path and TX queues are empty */
+static void bench_drain(struct sr_instance *sr)
+{
+    while (__atomic_load_n(&(sr->slowpath.ring.head), __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&(sr->slowpath.ring.tail), __ATOMIC_ACQUIRE) ||
+           __atomic_load_n(&(sr->tx.ring.head), __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&(sr->tx.ring.tail), __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+#define BENCH_PING_ICMP 36  /* echo header and 28 bytes of data */
+
+/* -p echo requests from an inside host to the router, through it, and
+   through it with TTL 1 (time exceeded), in router mode */
+static void bench_ping(unsigned long npackets)
+{
+    const char *names[3] = {"to router", "through", "ttl expired"};
+    unsigned int len = SIZE_ETH+SIZE_IP+BENCH_PING_ICMP;
+    uint8_t frame[BENCH_SYN_STRIDE * 2], buf[BENCH_SYN_STRIDE * 2];
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(frame+SIZE_ETH);
+    sr_icmp_t8_hdr_t *icmp = (sr_icmp_t8_hdr_t *)(frame+SIZE_ETH+SIZE_IP);
+    struct sr_instance *sr = bench_instance(0);
+    unsigned long i, allocs;
+    double start, elapsed;
+    int test;
+
+    printf("ping: %lu echo requests of %u bytes, router mode\n", npackets, len);
+    printf("%-12s %10s %12s\n", "", "kpps", "allocs/pkt");
+    for (test = 0; test < 3; test++) {
+        /* the TCP frame gives the ethernet and ip headers */
+        bench_tcp_frame(frame, 3, 0);
+        memset(frame+SIZE_ETH+SIZE_IP, 0x5a, BENCH_PING_ICMP);
+        ip->ip_len = htons(SIZE_IP+BENCH_PING_ICMP);
+        ip->ip_p = ip_protocol_icmp;
+        ip->ip_dst = bench_ip(test == 0 ? BENCH_INT_IP : BENCH_SERVER);
+        ip->ip_ttl = (test == 2) ? 1 : 64;
+        ip->ip_sum = 0;
+        ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+        icmp->icmp_type = 8;
+        icmp->icmp_code = 0;
+        icmp->icmp_id = htons(0x4242);
+        icmp->icmp_sum = 0;
+        icmp->icmp_sum = cksum((uint8_t *)icmp, BENCH_PING_ICMP);
+
+        /* warm up the pools and caches */
+        for (i = 0; i < 64; i++) {
+            memcpy(buf, frame, len);
+            sr_handlepacket(sr, buf, len, "eth1");
+        }
+        bench_drain(sr);
+
+        allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+        start = bench_now();
+        for (i = 0; i < npackets; i++) {
+            memcpy(buf, frame, len);
+            sr_handlepacket(sr, buf, len, "eth1");
+        }
+        bench_drain(sr);
+        elapsed = bench_now() - start;
+        allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - allocs;
+        printf("%-12s %10.1f %12.2f\n", names[test], npackets / elapsed / 1000,
+               (double)allocs / npackets);
+    }
+    printf("%-12s %10lu dropped\n", "slow path", sr->slowpath.dropped);
+}
+
+/* -p packets with TTL 1 through the router from -f inside hosts, as a
+   traceroute burst or a flood would send them, with the errors the rate
+   limit let through (router mode) */
+static void bench_icmp(unsigned long npackets, unsigned int nsources)
+{
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    uint8_t *frames = malloc((size_t)nsources * BENCH_SYN_STRIDE);
+    uint8_t buf[BENCH_SYN_STRIDE];
+    sr_ip_hdr_t *ip;
+    struct sr_instance *sr = bench_instance(0);
+    unsigned long i, msgs;
+    unsigned int f;
+    double start, elapsed;
+
+    for (f = 0; f < nsources; f++) {
+        bench_tcp_frame(frames + f * BENCH_SYN_STRIDE, f, 0);
+        ip = (sr_ip_hdr_t *)(frames + f * BENCH_SYN_STRIDE + SIZE_ETH);
+        ip->ip_ttl = 1;
+        ip->ip_sum = 0;
+        ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    }
+
+    msgs = sr->tx.msgs;
+    start = bench_now();
+    for (i = 0; i < npackets; i++) {
+        memcpy(buf, frames + (i % nsources) * BENCH_SYN_STRIDE, len);
+        sr_handlepacket(sr, buf, len, "eth1");
+    }
+    bench_drain(sr);
+    elapsed = bench_now() - start;
+    printf("icmp: %lu expiring packets from %u sources in %.3fs: %.1f kpps, "
+           "%lu errors sent, %lu dropped by the slow path\n",
+           npackets, nsources, elapsed, npackets / elapsed / 1000,
+           sr->tx.msgs - msgs, sr->slowpath.dropped);
+    sr_icmplim_print(&(sr->slowpath.limit), stdout);
+    free(frames);
+}
+
+#define BENCH_OPT_DATA 12  /* transport payload of the option frames */
+
+/* Build a frame from src to dst whose IP header is ihl words long (the
+   options all NOPs), followed by pad bytes of Ethernet padding. TCP
+   carries the flags in tcp_flags (1 SYN, 2 ACK), ICMP is an echo of type
+   icmp_type with id sport. Returns the frame length, padding included. */
+static unsigned int bench_opt_frame(uint8_t *buf, const unsigned char *dmac,
+                                    uint32_t src, uint32_t dst, uint8_t proto,
+                                    unsigned int ihl, unsigned int pad,
+                                    uint16_t sport, uint16_t dport, int tcp_flags,
+                                    uint8_t icmp_type)
+{
+    sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)buf;
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+    uint8_t *l4 = buf + SIZE_ETH + ihl * 4;
+    sr_tcp_hdr_t *tcp = (sr_tcp_hdr_t *)l4;
+    sr_udp_hdr_t *udp = (sr_udp_hdr_t *)l4;
+    sr_icmp_t8_hdr_t *icmp = (sr_icmp_t8_hdr_t *)l4;
+    unsigned int l4_len;
+
+    l4_len = (proto == ip_protocol_tcp ? SIZE_TCP :
+              proto == ip_protocol_udp ? SIZE_UDP : sizeof(sr_icmp_t8_hdr_t));
+    l4_len += BENCH_OPT_DATA;
+    memset(buf, 0, SIZE_ETH + ihl * 4 + l4_len);
+    memcpy(eth->ether_dhost, dmac, 6);
+    memcpy(eth->ether_shost, bench_gw_mac, 6);
+    eth->ether_type = htons(ethertype_ip);
+
+    ip->ip_v = 4;
+    ip->ip_hl = ihl;
+    ip->ip_len = htons(ihl * 4 + l4_len);
+    ip->ip_ttl = 64;
+    ip->ip_p = proto;
+    ip->ip_src = src;
+    ip->ip_dst = dst;
+    memset(buf + SIZE_ETH + SIZE_IP, 0x01, ihl * 4 - SIZE_IP);
+    memset(l4 + l4_len - BENCH_OPT_DATA, 0x5a, BENCH_OPT_DATA);
+
+    if (proto == ip_protocol_tcp) {
+        tcp->tcp_src = sport;
+        tcp->tcp_dst = dport;
+        tcp->tcp_seq = htonl(ihl);
+        tcp->tcp_ack = htonl((tcp_flags & 2) ? 1 : 0);
+        tcp->tcp_off = 5;
+        tcp->syn = (tcp_flags & 1) != 0;
+        tcp->ack = (tcp_flags & 2) != 0;
+        tcp->tcp_wdw = htons(65535);
+        tcp->tcp_sum = sr_l4_cksum(ip, l4, l4_len, offsetof(sr_tcp_hdr_t, tcp_sum));
+    } else if (proto == ip_protocol_udp) {
+        udp->udp_src = sport;
+        udp->udp_dst = dport;
+        udp->udp_len = htons(l4_len);
+        udp->udp_sum = sr_l4_cksum(ip, l4, l4_len, offsetof(sr_udp_hdr_t, udp_sum));
+    } else {
+        icmp->icmp_type = icmp_type;
+        icmp->icmp_id = sport;
+        icmp->icmp_seq = htons(ihl);
+        icmp->icmp_sum = cksum(l4, l4_len);
+    }
+    ip->ip_sum = cksum((uint8_t *)ip, ihl * 4);
+
+    memset(l4 + l4_len, 0xee, pad);
+    return SIZE_ETH + ihl * 4 + l4_len + pad;
+}
+
+/* Read the next frame sr sent to the capture socket fd into buf. Returns
+   its length, or 0 if none came within the receive timeout. */
+static unsigned int bench_capture(int fd, uint8_t *buf, unsigned int size)
+{
+    c_packet_header hdr;
+    unsigned int len;
+
+    if (recv(fd, &hdr, sizeof(hdr), MSG_WAITALL) != (ssize_t)sizeof(hdr)) {
+        return 0;
+    }
+    len = ntohl(hdr.mLen) - sizeof(hdr);
+    if (len > size || recv(fd, buf, len, MSG_WAITALL) != (ssize_t)len) {
+        return 0;
+    }
+    return len;
+}
+
+/* Wait for sr's queues to empty and throw away whatever it sent to fd,
+   so a frame a failed check left unread can't be taken for the next */
+static void bench_capture_flush(struct sr_instance *sr, int fd)
+{
+    uint8_t buf[256];
+
+    bench_drain(sr);
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+/* Point sr's VNS socket at a socketpair and return the end frames sent
+   through sr can be read back from */
+static int bench_capture_open(struct sr_instance *sr)
+{
+    struct timeval tv = {1, 0};
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    close(sr->sockfd);
+    sr->sockfd = sv[0];
+    return sv[1];
+}
+
+/* 1 unless the captured frame in buf parses, with good IP and transport
+   checksums, as proto with an ihl word IP header carrying the same
+   options as sent */
+static int bench_opt_bad(uint8_t *buf, unsigned int len, struct sr_meta *meta,
+                         uint8_t proto, unsigned int ihl)
+{
+    uint8_t opts[60];
+
+    if (len == 0 || sr_parse(buf, len, meta) != 0 ||
+        meta->proto != proto || meta->l4 - meta->l3 != ihl * 4 ||
+        !sr_meta_l4_ok(buf, meta)) {
+        return 1;
+    }
+    memset(opts, 0x01, ihl * 4 - SIZE_IP);
+    return memcmp(buf + meta->l3 + SIZE_IP, opts, ihl * 4 - SIZE_IP) != 0;
+}
+
+/* TCP, UDP and ICMP frames with 4..40 bytes of IP options and 1..8 bytes
+   of Ethernet padding: forwarded, expired (checking the time exceeded
+   error quotes the header and 8 bytes) in router mode, and out through
+   the NAT and the reply back in, counting frames that come out wrong */
+static void bench_options(void)
+{
+    const char *names[3] = {"tcp", "udp", "icmp"};
+    const uint8_t protos[3] = {ip_protocol_tcp, ip_protocol_udp, ip_protocol_icmp};
+    unsigned long bad[3][4];
+    uint8_t frame[256], out[256];
+    struct sr_instance *sr = bench_instance(0);
+    struct sr_instance *nat = bench_instance(1);
+    int sr_fd = bench_capture_open(sr), nat_fd = bench_capture_open(nat);
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(frame+SIZE_ETH);
+    sr_ip_hdr_t *out_ip = (sr_ip_hdr_t *)(out+SIZE_ETH);
+    sr_icmp_t8_hdr_t *err;
+    struct sr_meta meta;
+    uint32_t host, server = bench_ip(BENCH_SERVER), ext = bench_ip(BENCH_EXT_IP);
+    uint16_t sport, aux;
+    unsigned int p, ihl, pad, len, n, quote;
+
+    memset(bad, 0, sizeof(bad));
+    for (p = 0; p < 3; p++) {
+        for (ihl = 6; ihl <= 15; ihl++) {
+            /* a host of its own per frame keeps the error rate limit out */
+            host = htonl(ntohl(bench_ip(BENCH_INT_NET)) + 2 + p * 16 + ihl);
+            sport = htons(20000 + ihl);
+            pad = 1 + (ihl + p) % 8;
+            bench_capture_flush(sr, sr_fd);
+            bench_capture_flush(nat, nat_fd);
+
+            /* routed: TTL down, options and transport checksum intact */
+            len = bench_opt_frame(frame, bench_int_mac, host, server, protos[p],
+                                  ihl, pad, sport, htons(80), 1, 8);
+            sr_handlepacket(sr, frame, len, "eth1");
+            n = bench_capture(sr_fd, out, sizeof(out));
+            bad[p][0] += bench_opt_bad(out, n, &meta, protos[p], ihl) ||
+                         out_ip->ip_ttl != 63;
+
+            /* expired: the error quotes the header, options and all, and
+               the first 8 bytes of the transport header */
+            len = bench_opt_frame(frame, bench_int_mac, host, server, protos[p],
+                                  ihl, pad, sport, htons(80), 1, 8);
+            ip->ip_ttl = 1;
+            ip->ip_sum = 0;
+            ip->ip_sum = cksum((uint8_t *)ip, ihl * 4);
+            sr_handlepacket(sr, frame, len, "eth1");
+            n = bench_capture(sr_fd, out, sizeof(out));
+            quote = ihl * 4 + 8;
+            err = (sr_icmp_t8_hdr_t *)(out + SIZE_ETH + SIZE_IP);
+            bad[p][1] += n == 0 || sr_parse(out, n, &meta) != 0 ||
+                         meta.proto != ip_protocol_icmp ||
+                         !sr_meta_l4_ok(out, &meta) ||
+                         err->icmp_type != 11 ||
+                         meta.end - meta.l4 != 8 + quote ||
+                         memcmp(out + meta.l4 + 8, frame + SIZE_ETH, quote) != 0;
+
+            /* out through the NAT: source rewritten, checksums fixed up
+               past the options */
+            len = bench_opt_frame(frame, bench_int_mac, host, server, protos[p],
+                                  ihl, pad, sport, htons(80), 1, 8);
+            sr_handlepacket(nat, frame, len, "eth1");
+            n = bench_capture(nat_fd, out, sizeof(out));
+            aux = 0;
+            if (bench_opt_bad(out, n, &meta, protos[p], ihl) ||
+                meta.src != ext) {
+                bad[p][2]++;
+            } else {
+                aux = meta.sport;
+            }
+
+            /* and the reply back in to the host and its own port or id */
+            if (aux == 0) {
+                bad[p][3]++;
+                continue;
+            }
+            if (protos[p] == ip_protocol_icmp) {
+                len = bench_opt_frame(frame, bench_ext_mac, server, ext,
+                                      protos[p], ihl, pad, aux, 0, 0, 0);
+            } else {
+                len = bench_opt_frame(frame, bench_ext_mac, server, ext,
+                                      protos[p], ihl, pad, htons(80), aux, 3, 0);
+            }
+            sr_handlepacket(nat, frame, len, "eth2");
+            n = bench_capture(nat_fd, out, sizeof(out));
+            bad[p][3] += bench_opt_bad(out, n, &meta, protos[p], ihl) ||
+                         meta.dst != host ||
+                         (protos[p] == ip_protocol_icmp ? meta.sport : meta.dport)
+                             != sport;
+        }
+    }
+
+    printf("options: ip_hl 6..15 with 1..8 bytes of padding, 10 frames "
+           "per protocol and path\n");
+    printf("%-6s %10s %10s %10s %10s\n", "", "routed", "expired", "nat out",
+           "nat in");
+    for (p = 0; p < 3; p++) {
+        printf("%-6s %6lu bad %6lu bad %6lu bad %6lu bad\n", names[p],
+               bad[p][0], bad[p][1], bad[p][2], bad[p][3]);
+    }
+    close(sr_fd);
+    close(nat_fd);
+}
+
+/* Feed npackets round-robin over the nframes frames at frames through sr
+   in bursts of burst (0: one sr_handlepacket call per frame), wait for the
+   TX queue to drain and print the rate and messages per write */
+static void bench_burst_run(struct sr_instance *sr, uint8_t *frames,
+                            unsigned int len, unsigned int nframes,
+                            unsigned long npackets, int burst, char *iface)
+{
+    struct sr_rx_frame rx[SR_RX_BURST];
+    unsigned long i, msgs, writes;
+    unsigned int f = 0;
+    double start, kpps;
+    char name[16];
+    int j, n;
+
+    bench_drain(sr);
+    msgs = sr->tx.msgs;
+    writes = sr->tx.writes;
+    start = bench_now();
+    for (i = 0; i < npackets; i += n) {
+        n = (burst == 0) ? 1 : burst;
+        if ((unsigned long)n > npackets - i) {
+            n = npackets - i;
+        }
+        for (j = 0; j < n; j++) {
+            rx[j].buf = frames + f * BENCH_SYN_STRIDE;
+            rx[j].len = len;
+            rx[j].iface = iface;
+            rx[j].parsed = 0;
+            f = (f + 1 == nframes) ? 0 : f + 1;
+        }
+        if (burst == 0) {
+            sr_handlepacket(sr, rx[0].buf, rx[0].len, rx[0].iface);
+        } else {
+            sr_handleburst(sr, rx, n);
+        }
+    }
+    bench_drain(sr);
+    kpps = npackets / (bench_now() - start) / 1000;
+    msgs = sr->tx.msgs - msgs;
+    writes = sr->tx.writes - writes;
+    if (burst == 0) {
+        strcpy(name, "single");
+    } else {
+        sprintf(name, "burst %d", burst);
+    }
+    printf("%-10s %10.1f kpps %10.1f msgs/write\n", name, kpps,
+           writes ? (double)msgs / writes : 0.0);
+}
+
+/* -p packets through sr_handleburst in bursts of 1, 8, 32 and 64, to -f
+   destinations in router mode and over -f established flows in NAT mode,
+   against one sr_handlepacket call per frame */
+static void bench_burst(unsigned long npackets, unsigned int nflows)
+{
+    static const int bursts[] = {0, 1, 8, 32, 64};
+    unsigned int len = SIZE_ETH+SIZE_IP+SIZE_TCP;
+    uint8_t *frames = malloc((size_t)nflows * BENCH_SYN_STRIDE);
+    struct sr_instance *sr;
+    sr_ip_hdr_t *ip;
+    unsigned int f;
+    int b;
+
+    for (f = 0; f < nflows; f++) {
+        bench_tcp_frame(frames + f * BENCH_SYN_STRIDE, f, 0);
+        ip = (sr_ip_hdr_t *)(frames + f * BENCH_SYN_STRIDE + SIZE_ETH);
+        ip->ip_dst = htonl(ntohl(bench_ip(BENCH_SERVER)) + f);
+        ip->ip_sum = 0;
+        ip->ip_sum = cksum((uint8_t *)ip, SIZE_IP);
+    }
+    printf("burst: %lu packets from eth1 to %u destinations, router mode\n",
+           npackets, nflows);
+    for (b = 0; b < (int)(sizeof(bursts) / sizeof(bursts[0])); b++) {
+        /* fresh each time: the warm ARP entries only live 15s */
+        sr = bench_instance(0);
+        for (f = 0; f < nflows; f++) {
+            sr_handlepacket(sr, frames + f * BENCH_SYN_STRIDE, len, "eth1");
+        }
+        bench_burst_run(sr, frames, len, nflows, npackets, bursts[b], "eth1");
+    }
+
+    printf("burst: %lu ACKs over %u established flows, NAT mode\n",
+           npackets, nflows);
+    for (b = 0; b < (int)(sizeof(bursts) / sizeof(bursts[0])); b++) {
+        sr = bench_instance(1);
+        for (f = 0; f < nflows; f++) {
+            if (bench_establish(sr, f) != 0) {
+                printf("burst: flow %u not established\n", f);
+                free(frames);
+                return;
+            }
+            bench_tcp_frame(frames + f * BENCH_SYN_STRIDE, f, 0);
+            sr_handlepacket(sr, frames + f * BENCH_SYN_STRIDE, len, "eth1");
+        }
+        bench_burst_run(sr, frames, len, nflows, npackets, bursts[b], "eth1");
+    }
+    free(frames);
+}
+
+static void bench_scaling(unsigned short mode, int max_workers,
+                          unsigned long npackets, unsigned int nflows)
+{
+    int w;
+    double pps, base;
+
+    printf("scaling: %s mode, %lu packets over %u flows, %ld cpus online\n",
+           mode ? "nat" : "router", npackets, nflows, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %12s %8s\n", "workers", "kpps", "speedup");
+    base = bench_run(mode, 0, npackets, nflows);
+    printf("%-8s %12.1f %8.2f\n", "inline", base / 1000, 1.0);
+    for (w = 1; w <= max_workers; w++) {
+        pps = bench_run(mode, w, npackets, nflows);
+        printf("%-8d %12.1f %8.2f\n", w, pps / 1000, pps / base);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    unsigned short mode = 0;
+    unsigned long npackets = 100000;
+    unsigned int nflows = 1024;
+    int workers = 4;
+    const char *test = "scaling";
+
+    while ((c = getopt(argc, argv, "np:f:w:")) != EOF) {
+        switch (c) {
+            case 'n':
+                mode = 1;
+                break;
+            case 'p':
+                npackets = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                nflows = atoi(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n] [-p packets] [-f flows] "
+                        "[-w workers] [scaling|syn|peers|flood|scan|noise|churn|pool|udp|hog|det|route|estab|ping|icmp|options|burst|layout]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        test = argv[optind];
+    }
+    if (nflows == 0) {
+        nflows = 1;
+    }
+
+    /* the data path logs every packet to stderr */
+    if (freopen("/dev/null", "w", stderr) == NULL) {
+        perror("freopen");
+    }
+
+    if (strcmp(test, "scaling") == 0) {
+        bench_scaling(mode, workers, npackets, nflows);
+    } else if (strcmp(test, "syn") == 0) {
+        bench_syn(npackets);
+    } else if (strcmp(test, "peers") == 0) {
+        bench_peers(npackets, nflows);
+    } else if (strcmp(test, "flood") == 0) {
+        bench_flood(npackets, nflows);
+    } else if (strcmp(test, "scan") == 0) {
+        bench_scan(npackets);
+    } else if (strcmp(test, "noise") == 0) {
+        bench_noise(npackets, nflows);
+    } else if (strcmp(test, "churn") == 0) {
+        bench_churn(npackets);
+    } else if (strcmp(test, "pool") == 0) {
+        bench_pool(npackets);
+    } else if (strcmp(test, "udp") == 0) {
+        bench_udp(npackets, nflows);
+    } else if (strcmp(test, "hog") == 0) {
+        bench_hog(npackets);
+    } else if (strcmp(test, "det") == 0) {
+        bench_det(npackets, nflows);
+    } else if (strcmp(test, "route") == 0) {
+        bench_route(npackets, nflows);
+    } else if (strcmp(test, "estab") == 0) {
+        bench_estab(npackets, nflows);
+    } else if (strcmp(test, "ping") == 0) {
+        bench_ping(npackets);
+    } else if (strcmp(test, "icmp") == 0) {
+        bench_icmp(npackets, nflows);
+    } else if (strcmp(test, "options") == 0) {
+        bench_options();
+    } else if (strcmp(test, "burst") == 0) {
+        bench_burst(npackets, nflows);
+    } else if (strcmp(test, "layout") == 0) {
+        bench_layout(npackets, nflows);
+    } else {
+        printf("unknown test %s\n", test);
+        return 1;
+    }
+    return 0;
+}
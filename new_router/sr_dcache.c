@@ -0,0 +1,129 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_dcache.c
+ *
+ * Description:
+ *
+ * Destination cache for router mode, see sr_dcache.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_dcache.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_arpcache.h"
+#include "sr_utils.h"
+
+int sr_dcache_init(struct sr_dcache *dc)
+{
+    dc->entries = (struct sr_dcache_entry *)calloc(SR_DCACHE_SLOTS,
+                                                   sizeof(struct sr_dcache_entry));
+    dc->hits = dc->misses = 0;
+    return dc->entries == NULL ? -1 : 0;
+} /* -- sr_dcache_init -- */
+
+void sr_dcache_invalidate(struct sr_dcache *dc)
+{
+    __atomic_add_fetch(&(dc->rt_gen), 1, __ATOMIC_RELEASE);
+} /* -- sr_dcache_invalidate -- */
+
+int sr_dcache_forward(struct sr_instance *sr, uint8_t *packet, unsigned int len)
+{
+    struct sr_dcache *dc = &(sr->dcache);
+    sr_ip_hdr_t *ip_header = (sr_ip_hdr_t *)(packet+SIZE_ETH);
+    struct sr_dcache_entry *entry, snap;
+    struct sr_if *iface;
+    unsigned int seq;
+    uint16_t old, new;
+
+    if (dc->entries == NULL) {
+        return 0;
+    }
+    entry = &(dc->entries[sr_ip_hash(ip_header->ip_dst, SR_DCACHE_BITS)]);
+    seq = __atomic_load_n(&(entry->seq), __ATOMIC_ACQUIRE);
+    if ((seq & 1) || *(volatile uint32_t *)&entry->ip != ip_header->ip_dst) {
+        __atomic_fetch_add(&(dc->misses), 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    memcpy(&snap, entry, sizeof(snap));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (seq != __atomic_load_n(&(entry->seq), __ATOMIC_RELAXED) ||
+        snap.ip != ip_header->ip_dst ||
+        snap.rt_gen != __atomic_load_n(&(dc->rt_gen), __ATOMIC_ACQUIRE) ||
+        snap.arp_seq != __atomic_load_n(&(sr->cache.entries[snap.arp_slot].seq),
+                                        __ATOMIC_ACQUIRE) ||
+        (iface = sr_get_interface_by_index(sr, snap.ifindex)) == NULL) {
+        __atomic_fetch_add(&(dc->misses), 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_fetch_add(&(dc->hits), 1, __ATOMIC_RELAXED);
+
+    memcpy(packet, snap.eth, SIZE_ETH);
+    /* TTL shares a checksum word with the protocol */
+    memcpy(&old, &(ip_header->ip_ttl), 2);
+    ip_header->ip_ttl--;
+    memcpy(&new, &(ip_header->ip_ttl), 2);
+    ip_header->ip_sum = cksum_update16(ip_header->ip_sum, old, new);
+    sr_send_packet(sr, packet, len, iface->name);
+    return 1;
+} /* -- sr_dcache_forward -- */
+
+void sr_dcache_fill(struct sr_dcache *dc, uint32_t ip, struct sr_rt *rt,
+                    struct sr_if *iface, int arp_slot,
+                    const struct sr_arpentry *arp)
+{
+    struct sr_dcache_entry *entry;
+    sr_ethernet_hdr_t *eth;
+    unsigned int seq;
+
+    if (dc->entries == NULL || ip == 0) {
+        return;
+    }
+    entry = &(dc->entries[sr_ip_hash(ip, SR_DCACHE_BITS)]);
+    seq = __atomic_load_n(&(entry->seq), __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&(entry->seq), &seq, seq + 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return; /* another thread is filling this slot */
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    entry->ip = ip;
+    entry->rt_gen = __atomic_load_n(&(dc->rt_gen), __ATOMIC_ACQUIRE);
+    entry->arp_slot = arp_slot;
+    entry->arp_seq = arp->seq;
+    entry->ifindex = iface->index;
+    entry->rt = rt;
+    memcpy(entry->eth, iface->tmpl.eth, SIZE_ETH);
+    eth = (sr_ethernet_hdr_t *)entry->eth;
+    memcpy(eth->ether_dhost, arp->mac, ETHER_ADDR_LEN);
+
+    __atomic_store_n(&(entry->seq), seq + 2, __ATOMIC_RELEASE);
+} /* -- sr_dcache_fill -- */
+
+const struct sr_dcache_entry *sr_dcache_prefetch(struct sr_dcache *dc,
+                                                 uint32_t ip)
+{
+    const struct sr_dcache_entry *entry;
+
+    if (dc->entries == NULL) {
+        return NULL;
+    }
+    entry = &(dc->entries[sr_ip_hash(ip, SR_DCACHE_BITS)]);
+    __builtin_prefetch(entry);
+    return entry;
+} /* -- sr_dcache_prefetch -- */
+
+void sr_dcache_prefetch_next(struct sr_instance *sr,
+                             const struct sr_dcache_entry *entry)
+{
+    /* a racy read, but only a hint: forward checks the slot properly */
+    int slot = *(volatile int *)&(entry->arp_slot);
+
+    if (slot >= 0 && slot < SR_ARPCACHE_SZ) {
+        __builtin_prefetch(&(sr->cache.entries[slot]));
+    }
+} /* -- sr_dcache_prefetch_next -- */
@@ -0,0 +1,84 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_dcache.h
+ *
+ * Description:
+ *
+ * Destination cache for router mode. A direct-mapped table keyed by
+ * destination IP remembers the outcome of the slow forwarding path: the
+ * route, the egress interface and the finished Ethernet header. A hit
+ * forwards with one probe, a 14-byte copy and the TTL update.
+ *
+ * Entries are never invalidated explicitly. Each one records the routing
+ * table generation (bumped by sr_add_rt_entry) and the ARP slot and its
+ * sequence number when it was filled; the ARP seqlock bumps the sequence
+ * on every change to the slot, so a replaced or expired neighbour shows
+ * up as a mismatch and the packet takes the slow path, which refills.
+ * Entries are themselves seqlocked, so workers can read and fill them
+ * concurrently without a lock; a filler that loses the race just skips.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_DCACHE_H
+#define SR_DCACHE_H
+
+#include <stdint.h>
+
+#include "sr_protocol.h"
+#include "sr_ring.h"
+
+#define SR_DCACHE_BITS  12
+#define SR_DCACHE_SLOTS (1 << SR_DCACHE_BITS)
+
+struct sr_instance;
+struct sr_rt;
+struct sr_if;
+struct sr_arpentry;
+
+struct sr_dcache_entry {
+    unsigned int seq;           /* odd while a writer is filling it */
+    uint32_t ip;                /* destination, network order; 0 empty */
+    unsigned int rt_gen;        /* sr_dcache.rt_gen when filled */
+    int arp_slot;               /* ARP cache entry the MAC came from */
+    unsigned int arp_seq;       /* and its sequence number then */
+    int ifindex;                /* egress interface */
+    struct sr_rt *rt;           /* route taken (routes are never freed) */
+    uint8_t eth[SIZE_ETH];      /* dst MAC, src MAC, ethertype */
+};
+
+/* entries and rt_gen are read by every worker on every packet (and rt_gen
+   by the NAT flow cache too), so they get a line of their own, away from
+   the counters every worker writes */
+struct sr_dcache {
+    char pad0[SR_CACHE_LINE];
+    struct sr_dcache_entry *entries;
+    unsigned int rt_gen;
+    char pad1[SR_CACHE_LINE];
+    unsigned long hits, misses; /* relaxed atomics */
+    char pad2[SR_CACHE_LINE];
+};
+
+/* Returns 0 on success */
+int  sr_dcache_init(struct sr_dcache *dc);
+
+/* The routing table changed: every entry is stale */
+void sr_dcache_invalidate(struct sr_dcache *dc);
+
+/* Forward packet (a checked IP datagram, TTL > 1, not for us) from the
+   cache. Returns 1 if it was sent, 0 on a miss. */
+int  sr_dcache_forward(struct sr_instance *sr, uint8_t *packet,
+                       unsigned int len);
+
+/* Remember how a packet to ip was just forwarded: via rt out of iface to
+   the neighbour in ARP slot arp_slot, whose snapshot is entry */
+void sr_dcache_fill(struct sr_dcache *dc, uint32_t ip, struct sr_rt *rt,
+                    struct sr_if *iface, int arp_slot,
+                    const struct sr_arpentry *entry);
+
+/* For bursts: start loading the entry a packet to ip would probe and
+   return it; later, once it has arrived, start on the ARP entry it names */
+const struct sr_dcache_entry *sr_dcache_prefetch(struct sr_dcache *dc,
+                                                 uint32_t ip);
+void sr_dcache_prefetch_next(struct sr_instance *sr,
+                             const struct sr_dcache_entry *entry);
+
+#endif /* -- SR_DCACHE_H -- */
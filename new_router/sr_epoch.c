@@ -0,0 +1,193 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.c
+ *
+ * Description:
+ *
+ * Epoch based deferred reclamation, see sr_epoch.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_epoch.h"
+
+/* The domains this thread reads, most recently entered first. Its
+   address tags the slots the thread owns. */
+struct sr_epoch_reader {
+    struct sr_epoch *ep;
+    struct sr_epoch_slot *slot;
+};
+
+static __thread struct sr_epoch_reader sr_epoch_readers[SR_EPOCH_THREAD_DOMAINS];
+static pthread_key_t sr_epoch_key;
+static pthread_once_t sr_epoch_key_once = PTHREAD_ONCE_INIT;
+
+int sr_epoch_init(struct sr_epoch *ep)
+{
+    memset(ep, 0, sizeof(struct sr_epoch));
+    ep->global = 1;
+    return pthread_mutex_init(&(ep->lock), NULL);
+} /* -- sr_epoch_init -- */
+
+static struct sr_epoch_slot *sr_epoch_claim(struct sr_epoch *ep, void *owner)
+{
+    void *none;
+    int i;
+
+    for (i = 0; i < SR_EPOCH_MAX_READERS; i++) {
+        none = NULL;
+        if (__atomic_compare_exchange_n(&(ep->slots[i].owner), &none, owner, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return &(ep->slots[i]);
+        }
+    }
+    return NULL;
+} /* -- sr_epoch_claim -- */
+
+/* Give a slot back, unless its domain was reinitialized under us */
+static void sr_epoch_release(struct sr_epoch_slot *slot, void *owner)
+{
+    __atomic_store_n(&(slot->epoch), 0, __ATOMIC_RELEASE);
+    __atomic_compare_exchange_n(&(slot->owner), &owner, NULL, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+} /* -- sr_epoch_release -- */
+
+static void sr_epoch_thread_exit(void *readers)
+{
+    struct sr_epoch_reader *r = (struct sr_epoch_reader *)readers;
+    int i;
+
+    for (i = 0; i < SR_EPOCH_THREAD_DOMAINS; i++) {
+        if (r[i].slot != NULL) {
+            sr_epoch_release(r[i].slot, readers);
+        }
+        r[i].ep = NULL;
+        r[i].slot = NULL;
+    }
+} /* -- sr_epoch_thread_exit -- */
+
+static void sr_epoch_key_init(void)
+{
+    pthread_key_create(&sr_epoch_key, sr_epoch_thread_exit);
+} /* -- sr_epoch_key_init -- */
+
+/* Slow path of sr_epoch_enter: find this thread's slot in ep, or claim
+   one, and move it to the front */
+static struct sr_epoch_slot *sr_epoch_lookup(struct sr_epoch *ep)
+{
+    struct sr_epoch_reader *r = sr_epoch_readers;
+    struct sr_epoch_reader found = { NULL, NULL };
+    int i, n = SR_EPOCH_THREAD_DOMAINS - 1;
+
+    for (i = 0; i < SR_EPOCH_THREAD_DOMAINS; i++) {
+        if (r[i].ep == ep) {
+            n = i;
+            if (__atomic_load_n(&(r[i].slot->owner), __ATOMIC_RELAXED) == r) {
+                found = r[i];
+            }
+            break;
+        }
+    }
+    if (found.slot == NULL) {
+        /* not held (or lost to sr_epoch_init): claim one, making room by
+           giving back the least recently entered domain */
+        if (n == SR_EPOCH_THREAD_DOMAINS - 1 && r[n].ep != ep && r[n].slot != NULL) {
+            sr_epoch_release(r[n].slot, r);
+        }
+        found.ep = ep;
+        found.slot = sr_epoch_claim(ep, r);
+        assert(found.slot);
+        pthread_once(&sr_epoch_key_once, sr_epoch_key_init);
+        pthread_setspecific(sr_epoch_key, r);
+    }
+    memmove(&(r[1]), &(r[0]), n * sizeof(struct sr_epoch_reader));
+    r[0] = found;
+    return found.slot;
+} /* -- sr_epoch_lookup -- */
+
+struct sr_epoch_slot *sr_epoch_enter(struct sr_epoch *ep)
+{
+    struct sr_epoch_slot *slot = sr_epoch_readers[0].slot;
+
+    if (sr_epoch_readers[0].ep != ep ||
+        __atomic_load_n(&(slot->owner), __ATOMIC_RELAXED) != sr_epoch_readers) {
+        slot = sr_epoch_lookup(ep);
+    }
+
+    /* Announce the epoch before any protected load can be performed */
+    __atomic_store_n(&(slot->epoch), 
+                     __atomic_load_n(&(ep->global), __ATOMIC_SEQ_CST),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return slot;
+} /* -- sr_epoch_enter -- */
+
+void sr_epoch_exit(struct sr_epoch_slot *slot)
+{
+    __atomic_store_n(&(slot->epoch), 0, __ATOMIC_RELEASE);
+} /* -- sr_epoch_exit -- */
+
+void sr_epoch_retire(struct sr_epoch *ep, void *ptr, void (*fn)(void *))
+{
+    struct sr_epoch_retired *r = 
+        (struct sr_epoch_retired *)malloc(sizeof(struct sr_epoch_retired));
+
+    assert(r);
+    r->ptr = ptr;
+    r->fn = fn;
+    /* The caller unlinked ptr with a release store, which a later load
+       may pass. Read after the unlink is visible, the stamp is one that
+       any reader still able to reach ptr has announced or been passed
+       by; read before, a reader announcing the next epoch could still
+       find ptr and have it freed under it. Pairs with the fences in
+       sr_epoch_enter and sr_epoch_reclaim. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    r->epoch = __atomic_load_n(&(ep->global), __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&(ep->lock));
+    r->next = ep->retired;
+    ep->retired = r;
+    ep->pending++;
+    pthread_mutex_unlock(&(ep->lock));
+} /* -- sr_epoch_retire -- */
+
+unsigned long sr_epoch_reclaim(struct sr_epoch *ep)
+{
+    struct sr_epoch_retired *r, *next, **link, *ready = NULL;
+    unsigned long oldest, e, freed = 0;
+    int i;
+
+    oldest = __atomic_add_fetch(&(ep->global), 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < SR_EPOCH_MAX_READERS; i++) {
+        e = __atomic_load_n(&(ep->slots[i].epoch), __ATOMIC_ACQUIRE);
+        if (e != 0 && e < oldest) {
+            oldest = e;
+        }
+    }
+
+    /* Anything retired before the oldest active epoch is unreachable */
+    pthread_mutex_lock(&(ep->lock));
+    link = &(ep->retired);
+    while ((r = *link) != NULL) {
+        if (r->epoch < oldest) {
+            *link = r->next;
+            r->next = ready;
+            ready = r;
+            ep->pending--;
+        } else {
+            link = &(r->next);
+        }
+    }
+    pthread_mutex_unlock(&(ep->lock));
+
+    for (r = ready; r != NULL; r = next) {
+        next = r->next;
+        r->fn(r->ptr);
+        free(r);
+        freed++;
+    }
+    return freed;
+} /* -- sr_epoch_reclaim -- */
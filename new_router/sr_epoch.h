@@ -0,0 +1,68 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.h
+ *
+ * Description:
+ *
+ * Epoch based deferred reclamation (a small user-space RCU). Readers wrap
+ * lock-free traversals in sr_epoch_enter/exit, which only publishes the
+ * epoch they started in. Writers still serialize among themselves, unlink
+ * an object with SR_RCU_STORE and hand it to sr_epoch_retire instead of
+ * freeing it. sr_epoch_reclaim (run periodically) advances the epoch and
+ * frees everything retired before the oldest epoch a reader is still in.
+ *
+ * A thread claims a reader slot in a domain the first time it reads and
+ * keeps it for SR_EPOCH_THREAD_DOMAINS domains at once, giving back the
+ * one it entered least recently past that. A pthread key destructor gives
+ * all of them back when the thread exits.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_EPOCH_H
+#define SR_EPOCH_H
+
+#include <pthread.h>
+
+#include "sr_ring.h"
+
+#define SR_EPOCH_MAX_READERS   128
+#define SR_EPOCH_THREAD_DOMAINS 4
+
+/* Pointer loads/stores for structures read under an epoch */
+#define SR_RCU_LOAD(p)     __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define SR_RCU_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+struct sr_epoch_slot {
+    unsigned long epoch;        /* 0 when the owning thread is quiescent */
+    void *owner;                /* claiming thread's reader set, NULL if free */
+    char pad[SR_CACHE_LINE];
+};
+
+struct sr_epoch_retired {
+    void *ptr;
+    void (*fn)(void *);
+    unsigned long epoch;
+    struct sr_epoch_retired *next;
+};
+
+struct sr_epoch {
+    unsigned long global;
+    struct sr_epoch_slot slots[SR_EPOCH_MAX_READERS];
+    struct sr_epoch_retired *retired;
+    unsigned long pending;      /* objects waiting to be freed */
+    pthread_mutex_t lock;       /* protects retired */
+};
+
+int  sr_epoch_init(struct sr_epoch *ep);
+
+/* Reader side. Calls may not nest. */
+struct sr_epoch_slot *sr_epoch_enter(struct sr_epoch *ep);
+void sr_epoch_exit(struct sr_epoch_slot *slot);
+
+/* Writer side: ptr is already unreachable for new readers; call fn(ptr)
+   once every reader that might still hold it has left. */
+void sr_epoch_retire(struct sr_epoch *ep, void *ptr, void (*fn)(void *));
+
+/* Free what is safe to free. Returns the number of objects freed. */
+unsigned long sr_epoch_reclaim(struct sr_epoch *ep);
+
+#endif /* -- SR_EPOCH_H -- */
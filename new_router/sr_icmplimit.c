@@ -0,0 +1,122 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_icmplimit.c
+ *
+ * Description:
+ *
+ * ICMP error rate limiting, see sr_icmplimit.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "sr_icmplimit.h"
+#include "sr_utils.h"
+
+/* Per destination errors/s and burst, by class */
+static const unsigned int sr_icmplim_dest_rate[SR_ICMPLIM_CLASSES] = {10, 20, 5};
+static const unsigned int sr_icmplim_dest_burst[SR_ICMPLIM_CLASSES] = {10, 20, 5};
+
+static const char *sr_icmplim_names[SR_ICMPLIM_CLASSES] = {
+    "unreachable", "time exceeded", "other"
+};
+
+static uint32_t sr_icmplim_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Add elapsed ms worth of tokens at rate/s (a thousandth per ms each),
+   capped at burst */
+static uint32_t sr_icmplim_refill(uint32_t tokens, uint32_t elapsed,
+                                  unsigned int rate, unsigned int burst)
+{
+    uint64_t t = (uint64_t)tokens + (uint64_t)elapsed * rate;
+
+    return (t > (uint64_t)burst * 1000) ? burst * 1000 : (uint32_t)t;
+}
+
+int sr_icmplim_init(struct sr_icmplim *lim)
+{
+    int c;
+
+    if (lim->rate == 0) {
+        lim->rate = SR_ICMPLIM_RATE;
+    }
+    if (lim->burst == 0) {
+        lim->burst = SR_ICMPLIM_BURST;
+    }
+    for (c = 0; c < SR_ICMPLIM_CLASSES; c++) {
+        if (lim->dest_rate[c] == 0) {
+            lim->dest_rate[c] = sr_icmplim_dest_rate[c];
+        }
+        if (lim->dest_burst[c] == 0) {
+            lim->dest_burst[c] = sr_icmplim_dest_burst[c];
+        }
+    }
+    memset(lim->dests, 0, sizeof(lim->dests));
+    lim->stamp = sr_icmplim_now();
+    lim->tokens = lim->burst * 1000;
+    lim->sent = lim->suppressed = 0;
+    memset(lim->suppressed_dest, 0, sizeof(lim->suppressed_dest));
+    return pthread_mutex_init(&(lim->lock), NULL);
+} /* -- sr_icmplim_init -- */
+
+int sr_icmplim_allow(struct sr_icmplim *lim, uint32_t dst, uint8_t type)
+{
+    struct sr_icmplim_dest *dest = &(lim->dests[sr_ip_hash(dst, SR_ICMPLIM_BITS)]);
+    int c = (type == 3) ? SR_ICMPLIM_UNREACH :
+            (type == 11) ? SR_ICMPLIM_TIMXCEED : SR_ICMPLIM_OTHER;
+    uint32_t now = sr_icmplim_now();
+    int i, ok = 0;
+
+    pthread_mutex_lock(&(lim->lock));
+    lim->tokens = sr_icmplim_refill(lim->tokens, now - lim->stamp,
+                                    lim->rate, lim->burst);
+    lim->stamp = now;
+    if (dest->ip != dst) {
+        dest->ip = dst;
+        for (i = 0; i < SR_ICMPLIM_CLASSES; i++) {
+            dest->tokens[i] = lim->dest_burst[i] * 1000;
+        }
+    } else {
+        for (i = 0; i < SR_ICMPLIM_CLASSES; i++) {
+            dest->tokens[i] = sr_icmplim_refill(dest->tokens[i], now - dest->stamp,
+                                                lim->dest_rate[i], lim->dest_burst[i]);
+        }
+    }
+    dest->stamp = now;
+
+    /* only spend tokens when both buckets have one */
+    if (dest->tokens[c] < 1000) {
+        lim->suppressed_dest[c]++;
+    } else if (lim->tokens < 1000) {
+        lim->suppressed++;
+    } else {
+        lim->tokens -= 1000;
+        dest->tokens[c] -= 1000;
+        lim->sent++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&(lim->lock));
+    return ok;
+} /* -- sr_icmplim_allow -- */
+
+void sr_icmplim_print(struct sr_icmplim *lim, FILE *out)
+{
+    int c;
+
+    pthread_mutex_lock(&(lim->lock));
+    fprintf(out, "ICMP errors: %lu sent, %lu suppressed over %u/s\n",
+            lim->sent, lim->suppressed, lim->rate);
+    for (c = 0; c < SR_ICMPLIM_CLASSES; c++) {
+        fprintf(out, "ICMP errors:   %-14s %8lu suppressed over %u/s per destination\n",
+                sr_icmplim_names[c], lim->suppressed_dest[c], lim->dest_rate[c]);
+    }
+    pthread_mutex_unlock(&(lim->lock));
+} /* -- sr_icmplim_print -- */
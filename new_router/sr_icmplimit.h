@@ -0,0 +1,66 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_icmplimit.h
+ *
+ * Description:
+ *
+ * ICMP error rate limiting (RFC 1812 4.3.2.8). Every error must take a
+ * token from a global bucket and from its destination's bucket for the
+ * error's class; destinations live in a small direct-mapped table, and a
+ * new one takes over its slot with full buckets, so a flood from spoofed
+ * sources is held by the global bucket alone. Tokens are counted in
+ * thousandths and refilled from a millisecond clock, so low rates still
+ * refill smoothly. The check runs before the error is queued for the slow
+ * path, so suppressed errors cost a hash probe and nothing else.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ICMPLIMIT_H
+#define SR_ICMPLIMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SR_ICMPLIM_BITS  10
+#define SR_ICMPLIM_SLOTS (1 << SR_ICMPLIM_BITS)  /* destinations */
+
+/* Error classes, each limited separately per destination */
+#define SR_ICMPLIM_UNREACH  0  /* type 3 */
+#define SR_ICMPLIM_TIMXCEED 1  /* type 11 */
+#define SR_ICMPLIM_OTHER    2
+#define SR_ICMPLIM_CLASSES  3
+
+#define SR_ICMPLIM_RATE  1000  /* default errors/s and burst, all told */
+#define SR_ICMPLIM_BURST 50
+
+struct sr_icmplim_dest {
+    uint32_t ip;                /* network order; 0 empty */
+    uint32_t stamp;             /* ms clock at the last refill */
+    uint32_t tokens[SR_ICMPLIM_CLASSES];
+};
+
+struct sr_icmplim {
+    /* set before init; 0 picks defaults */
+    unsigned int rate, burst;
+    unsigned int dest_rate[SR_ICMPLIM_CLASSES], dest_burst[SR_ICMPLIM_CLASSES];
+
+    pthread_mutex_t lock;
+    uint32_t stamp;
+    uint32_t tokens;
+    struct sr_icmplim_dest dests[SR_ICMPLIM_SLOTS];
+
+    unsigned long sent;
+    unsigned long suppressed;   /* by the global bucket */
+    unsigned long suppressed_dest[SR_ICMPLIM_CLASSES];
+};
+
+/* Returns 0 on success */
+int  sr_icmplim_init(struct sr_icmplim *lim);
+
+/* Take the tokens for an error of type to dst (network order). Returns 1
+   if it may be sent, 0 if it is suppressed. */
+int  sr_icmplim_allow(struct sr_icmplim *lim, uint32_t dst, uint8_t type);
+
+void sr_icmplim_print(struct sr_icmplim *lim, FILE *out);
+
+#endif /* -- SR_ICMPLIMIT_H -- */
@@ -26,6 +26,76 @@
 #include "sr_router.h"
 #include "sr_utils.h"
 
+/* Slot hashes for sr_instance.if_names and if_ips */
+static unsigned int sr_if_name_hash(const char* name)
+{
+    uint32_t h = 2166136261U;
+    int i;
+
+    for(i = 0; i < sr_IFACE_NAMELEN && name[i] != '\0'; i++)
+    { h = (h ^ (unsigned char)name[i]) * 16777619U; }
+    return h & (SR_IF_SLOTS - 1);
+}
+
+/* Rebuild if_ips from the list; addresses change only during setup */
+static void sr_if_index_ips(struct sr_instance* sr)
+{
+    struct sr_if* if_walker;
+    unsigned int h;
+
+    memset(sr->if_ips, 0, sizeof(sr->if_ips));
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        if(if_walker->ip == 0 || sr_get_interface_from_ip(sr, if_walker->ip))
+        { continue; }
+        for(h = sr_ip_hash(if_walker->ip, SR_IF_BITS); sr->if_ips[h];
+            h = (h + 1) & (SR_IF_SLOTS - 1));
+        sr->if_ips[h] = if_walker;
+    }
+} /* -- sr_if_index_ips -- */
+
+/* Rebuild iface's frame templates from its current MAC and IP */
+static void sr_if_build_tmpl(struct sr_if* iface)
+{
+    struct sr_if_tmpl* tmpl = &(iface->tmpl);
+    sr_ethernet_hdr_t* eth;
+    sr_arp_hdr_t* arp;
+    sr_ip_hdr_t* ip;
+
+    memset(tmpl, 0, sizeof(struct sr_if_tmpl));
+    eth = (sr_ethernet_hdr_t*)tmpl->eth;
+    memcpy(eth->ether_shost, iface->addr, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_ip);
+
+    eth = (sr_ethernet_hdr_t*)tmpl->arp_req;
+    memset(eth->ether_dhost, 0xff, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, iface->addr, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_arp);
+    arp = (sr_arp_hdr_t*)(tmpl->arp_req+SIZE_ETH);
+    arp->ar_hrd = htons(arp_hrd_ethernet);
+    arp->ar_pro = htons(ethertype_ip);
+    arp->ar_hln = ETHER_ADDR_LEN;
+    arp->ar_pln = 4;
+    arp->ar_op = htons(arp_op_request);
+    memcpy(arp->ar_sha, iface->addr, ETHER_ADDR_LEN);
+    arp->ar_sip = iface->ip;
+    memset(arp->ar_tha, 0xff, ETHER_ADDR_LEN);
+
+    memcpy(tmpl->arp_rep, tmpl->arp_req, SIZE_ETH+SIZE_ARP);
+    arp = (sr_arp_hdr_t*)(tmpl->arp_rep+SIZE_ETH);
+    arp->ar_op = htons(arp_op_reply);
+
+    memcpy(tmpl->icmp_err, tmpl->eth, SIZE_ETH);
+    ip = (sr_ip_hdr_t*)(tmpl->icmp_err+SIZE_ETH);
+    ip->ip_v = 4;
+    ip->ip_hl = 5;
+    ip->ip_off = htons(IP_DF);
+    ip->ip_ttl = INIT_TTL;
+    ip->ip_p = ip_protocol_icmp;
+    tmpl->icmp_ip_sum = cksum_partial(ip, SIZE_IP);
+    ip->ip_src = iface->ip;
+} /* -- sr_if_build_tmpl -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_get_interface
  * Scope: Global
@@ -38,23 +108,38 @@
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 {
     struct sr_if* if_walker = 0;
+    unsigned int h;
 
     /* -- REQUIRES -- */
     assert(name);
     assert(sr);
 
-    if_walker = sr->if_list;
-
-    while(if_walker)
+    for(h = sr_if_name_hash(name); (if_walker = sr->if_names[h]) != 0;
+        h = (h + 1) & (SR_IF_SLOTS - 1))
     {
        if(!strncmp(if_walker->name,name,sr_IFACE_NAMELEN))
         { return if_walker; }
-        if_walker = if_walker->next;
     }
 
     return 0;
 } /* -- sr_get_interface -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_interface_by_index
+ * Scope: Global
+ *
+ * Given an interface index return the interface record or 0 if it
+ * doesn't exist.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface_by_index(struct sr_instance* sr, int index)
+{
+    if(index < 0 || index >= (int)sr->nifs)
+    { return 0; }
+    return sr->if_index[index];
+} /* -- sr_get_interface_by_index -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_add_interface(..)
  * Scope: Global
@@ -66,18 +151,26 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 void sr_add_interface(struct sr_instance* sr, const char* name)
 {
     struct sr_if* if_walker = 0;
+    struct sr_if* iface = 0;
+    unsigned int h;
 
     /* -- REQUIRES -- */
     assert(name);
     assert(sr);
+    assert(sr->nifs < SR_IF_MAX);
+
+    iface = (struct sr_if*)calloc(1, sizeof(struct sr_if));
+    assert(iface);
+    strncpy(iface->name,name,sr_IFACE_NAMELEN);
+    iface->index = sr->nifs;
+    sr->if_index[sr->nifs++] = iface;
+    for(h = sr_if_name_hash(name); sr->if_names[h]; h = (h + 1) & (SR_IF_SLOTS - 1));
+    sr->if_names[h] = iface;
 
     /* -- empty list special case -- */
     if(sr->if_list == 0)
     {
-        sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
-        assert(sr->if_list);
-        sr->if_list->next = 0;
-        strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        sr->if_list = iface;
         return;
     }
 
@@ -86,11 +179,7 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     while(if_walker->next)
     {if_walker = if_walker->next; }
 
-    if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
-    assert(if_walker->next);
-    if_walker = if_walker->next;
-    strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
-    if_walker->next = 0;
+    if_walker->next = iface;
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
@@ -114,6 +203,7 @@ void sr_set_ether_addr(struct sr_instance* sr, const unsigned char* addr)
 
     /* -- copy address -- */
     memcpy(if_walker->addr,addr,6);
+    sr_if_build_tmpl(if_walker);
 
 } /* -- sr_set_ether_addr -- */
 
@@ -138,6 +228,8 @@ void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
 
     /* -- copy address -- */
     if_walker->ip = ip_nbo;
+    sr_if_index_ips(sr);
+    sr_if_build_tmpl(if_walker);
 
 } /* -- sr_set_ether_ip -- */
 
@@ -197,19 +289,36 @@ void sr_print_if(struct sr_if* iface)
 struct sr_if *sr_get_interface_from_ip(struct sr_instance* sr, uint32_t ip)
 {
     struct sr_if* if_walker = 0;
-    if_walker = sr->if_list;
-    fprintf(stderr,"searching for %d = ",ip);
-    print_addr_ip_int(ip);
-    
-    while(if_walker)
+    unsigned int h;
+
+    for(h = sr_ip_hash(ip, SR_IF_BITS); (if_walker = sr->if_ips[h]) != NULL;
+        h = (h + 1) & (SR_IF_SLOTS - 1))
     {
-        fprintf(stderr,"Comparing to %d = ", if_walker->ip);
-        print_addr_ip_int(if_walker->ip);
         if (if_walker->ip == ip){
             return if_walker;
         }
-        if_walker = if_walker->next; 
     }
 
     return NULL;
-} /* -- sr_get_interface_from_ip -- */
\ No newline at end of file
+} /* -- sr_get_interface_from_ip -- */
+
+int sr_if_set_roles(struct sr_instance* sr, const char* names, unsigned char role)
+{
+    char list[SR_IF_MAX * sr_IFACE_NAMELEN];
+    char *name, *save = NULL;
+    struct sr_if* iface;
+
+    strncpy(list, names, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    for(name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save))
+    {
+        iface = sr_get_interface(sr, name);
+        if(iface == NULL)
+        {
+            fprintf(stderr,"No interface %s\n", name);
+            return -1;
+        }
+        iface->nat_role = role;
+    }
+    return 0;
+} /* -- sr_if_set_roles -- */
\ No newline at end of file
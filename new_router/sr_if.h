@@ -28,6 +28,33 @@
 
 struct sr_instance;
 
+/* Interfaces are numbered 0.. in the order the server reports them, and
+   found by index, name or IP through small tables in sr_instance rather
+   than by walking if_list. */
+#define SR_IF_MAX   16
+#define SR_IF_BITS  6
+#define SR_IF_SLOTS (1 << SR_IF_BITS)  /* > 2 * SR_IF_MAX */
+
+/* NAT roles, set with -i / -o (default eth1 inside, eth2 outside) */
+#define SR_IF_ROLE_NONE    0
+#define SR_IF_ROLE_INSIDE  1
+#define SR_IF_ROLE_OUTSIDE 2
+
+/* Frames that traffic from an interface starts from, rebuilt whenever its
+   MAC or IP is set and read-only afterwards. Generating one is a copy and
+   patching the fields left open. */
+struct sr_if_tmpl
+{
+  uint8_t eth[SIZE_ETH];                  /* from our MAC, IP; dst open */
+  uint8_t arp_req[SIZE_ETH+SIZE_ARP];     /* broadcast who-has; ar_tip open */
+  uint8_t arp_rep[SIZE_ETH+SIZE_ARP];     /* is-at our MAC; dst, ar_sip,
+                                             ar_tha and ar_tip open */
+  uint8_t icmp_err[SIZE_ETH+SIZE_IP+SIZE_ICMP]; /* ip_len, ip_id, addresses,
+                                             type, code and the quote open */
+  uint32_t icmp_ip_sum;                   /* cksum_partial of icmp_err's IP
+                                             header with the open fields 0 */
+};
+
 /* ----------------------------------------------------------------------------
  * struct sr_if
  *
@@ -41,6 +68,9 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  int index;                /* position in sr_instance.if_index */
+  unsigned char nat_role;   /* SR_IF_ROLE_* */
+  struct sr_if_tmpl tmpl;
   struct sr_if* next;
 };
 
@@ -51,5 +81,10 @@ void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
 void sr_print_if_list(struct sr_instance*);
 void sr_print_if(struct sr_if*);
 struct sr_if *sr_get_interface_from_ip(struct sr_instance* sr, uint32_t ip);
+struct sr_if *sr_get_interface_by_index(struct sr_instance* sr, int index);
+
+/* Give each interface in the comma separated list the NAT role. Returns 0,
+   or -1 naming the first interface that doesn't exist. */
+int sr_if_set_roles(struct sr_instance* sr, const char* names, unsigned char role);
 
 #endif /* --  sr_INTERFACE_H -- */
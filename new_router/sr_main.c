@@ -69,11 +69,30 @@ int main(int argc, char **argv)
     unsigned int nat_icmpTO = 60;
     unsigned int nat_tcpEstTO = 7440;
     unsigned int nat_tcpTransTO = 300;
+    unsigned int nat_udpTO = 300;
+    int workers = 0;
+    int huge_pages = 0;
+    unsigned int nat_maxMappings = 0;
+    unsigned int nat_maxConns = 0;
+    unsigned int nat_hostMappings = 0;
+    unsigned int nat_hostRate = 0;
+    char *nat_pool = 0;
+    int nat_paired = 0;
+    char *nat_det = 0;
+    char *nat_inside = 0;
+    char *nat_outside = 0;
+    unsigned int icmp_rate = 0;
+    unsigned int icmp_dest_rate = 0;
+    char *rate_tok = 0;
+    int i;
+    int cpus[2+SR_PIPELINE_MAX_WORKERS];
+    int ncpus = 0;
+    char *cpu_tok = 0;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:U:HM:C:Q:S:P:AD:i:o:w:a:L:")) != EOF)
     {
         switch (c)
         {
@@ -117,12 +136,78 @@ int main(int argc, char **argv)
             case 'R':
                 nat_tcpTransTO = atoi((char *) optarg);
                 break;
+            case 'U':
+                nat_udpTO = atoi((char *) optarg);
+                break;
+            case 'H':
+                huge_pages = 1;
+                break;
+            case 'M':
+                nat_maxMappings = atoi((char *) optarg);
+                break;
+            case 'C':
+                nat_maxConns = atoi((char *) optarg);
+                break;
+            case 'Q':
+                nat_hostMappings = atoi((char *) optarg);
+                break;
+            case 'S':
+                nat_hostRate = atoi((char *) optarg);
+                break;
+            case 'P':
+                nat_pool = optarg;
+                break;
+            case 'A':
+                nat_paired = 1;
+                break;
+            case 'D':
+                nat_det = optarg;
+                break;
+            case 'i':
+                nat_inside = optarg;
+                break;
+            case 'o':
+                nat_outside = optarg;
+                break;
+            case 'w':
+                workers = atoi((char *) optarg);
+                break;
+            case 'L':
+                icmp_rate = atoi((char *) optarg);
+                rate_tok = strchr(optarg, ',');
+                icmp_dest_rate = rate_tok ? atoi(rate_tok + 1) : 0;
+                break;
+            case 'a':
+                ncpus = 0;
+                for (cpu_tok = strtok(optarg, ","); cpu_tok != NULL && 
+                     ncpus < 2+SR_PIPELINE_MAX_WORKERS; cpu_tok = strtok(NULL, ","))
+                { cpus[ncpus++] = atoi(cpu_tok); }
+                break;
                 
         } /* switch */
     } /* -- while -- */
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.nat.huge_pages = huge_pages;
+    sr.nat.max_mappings = nat_maxMappings;
+    sr.nat.max_conns = nat_maxConns;
+    sr.nat.max_host_mappings = nat_hostMappings;
+    sr.nat.host_rate = nat_hostRate;
+    sr.nat.paired = nat_paired;
+    sr.slowpath.limit.rate = icmp_rate;
+    for (i = 0; i < SR_ICMPLIM_CLASSES; i++)
+    { sr.slowpath.limit.dest_rate[i] = icmp_dest_rate; }
+    if(nat_pool && sr_nat_parse_pool(&(sr.nat), nat_pool) <= 0)
+    {
+        fprintf(stderr,"Bad NAT address pool %s\n", nat_pool);
+        exit(1);
+    }
+    if(nat_det && sr_nat_set_deterministic(&(sr.nat), nat_det) != 0)
+    {
+        fprintf(stderr,"Bad deterministic NAT prefix %s\n", nat_det);
+        exit(1);
+    }
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -173,8 +258,25 @@ int main(int argc, char **argv)
       sr_load_rt_wrap(&sr, rtable);
     }
 
+    /* NAT roles need the interfaces the server just reported */
+    if((nat_inside && sr_if_set_roles(&sr, nat_inside, SR_IF_ROLE_INSIDE) != 0) ||
+       (nat_outside && sr_if_set_roles(&sr, nat_outside, SR_IF_ROLE_OUTSIDE) != 0))
+    {
+        return 1;
+    }
+
     /* call router init (for arp subsystem etc.) */
-    sr_init(&sr, mode, nat_icmpTO, nat_tcpEstTO, nat_tcpTransTO);
+    if(sr_init(&sr, mode, nat_icmpTO, nat_tcpEstTO, nat_tcpTransTO, nat_udpTO) != 0)
+    {
+        return 1;
+    }
+
+    /* optional multi-core pipeline; this thread becomes the RX stage */
+    if(workers > 0 && sr_pipeline_init(&sr, workers, cpus, ncpus) != 0)
+    {
+        fprintf(stderr,"Error starting forwarding pipeline\n");
+        return 1;
+    }
 
     /* -- whizbang main loop ;-) */
     while( sr_read_from_server(&sr) == 1);
@@ -196,6 +298,16 @@ static void usage(char* argv0)
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
     printf("           [-l log file] \n");
+    printf("           [-n] [-I icmp timeout] [-E tcp established timeout]\n");
+    printf("           [-R tcp transitory timeout] [-U udp timeout]\n");
+    printf("           [-H (NAT tables on huge pages)]\n");
+    printf("           [-M max NAT mappings] [-C max NAT connections]\n");
+    printf("           [-Q max NAT mappings per host] [-S new NAT mappings/s per host]\n");
+    printf("           [-P NAT address pool a.b.c.d/len or a.b.c.d,...] [-A (paired pool)]\n");
+    printf("           [-D deterministic NAT internal prefix a.b.c.d/len]\n");
+    printf("           [-i NAT inside interfaces eth1,...] [-o NAT outside interfaces eth2,...]\n");
+    printf("           [-w pipeline workers] [-a rx_cpu,tx_cpu,worker_cpu,...]\n");
+    printf("           [-L ICMP errors/s[,per destination]]\n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -259,6 +371,8 @@ static void sr_init_instance(struct sr_instance* sr)
     /* REQUIRES */
     assert(sr);
 
+    /* the interface tables and NAT settings all start empty */
+    memset(sr, 0, sizeof(struct sr_instance));
     sr->sockfd = -1;
     sr->user[0] = 0;
     sr->host[0] = 0;
@@ -266,6 +380,8 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->if_list = 0;
     sr->routing_table = 0;
     sr->logfile = 0;
+    sr->tx.running = 0;
+    sr->pipeline.nworkers = 0;
 } /* -- sr_init_instance -- */
 
 /*-----------------------------------------------------------------------------
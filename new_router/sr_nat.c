@@ -4,42 +4,190 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "sr_nat.h"
 #include "sr_protocol.h"
 #include "sr_router.h"
+#include "sr_slowpath.h"
+#include "sr_utils.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+
+/* The packet path should only ever touch one line of a mapping */
+typedef char sr_nat_mapping_fits_line[(sizeof(struct sr_nat_mapping) <= 64) ? 1 : -1];
+
+static void sr_nat_release_mapping(struct sr_nat_mapping *maps);
+static void sr_nat_free_retired(void *map);
+static void sr_nat_pending_expire(struct sr_instance *sr, time_t curtime);
+static void sr_nat_host_release(struct sr_nat *nat, uint32_t ip);
+static long sr_nat_det_ext_host(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext);
+static void sr_nat_det_expire(struct sr_nat *nat, struct sr_nat_shard *shard,
+                              time_t curtime, unsigned int trans_to,
+                              unsigned int udp_to);
+static uint8_t sr_nat_next_state(uint8_t state, sr_tcp_hdr_t *tcp_header,
+                                 unsigned char internal);
+
+static volatile sig_atomic_t sr_nat_stats_requested = 0;
+
+static void sr_nat_stats_signal(int sig) {
+  sr_nat_stats_requested = 1;
+}
+
+/* Shard that owns an external port / icmp id */
+static struct sr_nat_shard *sr_nat_shard_ext(struct sr_nat *nat,
+    uint16_t aux_ext, sr_nat_mapping_type type) {
+  unsigned int idx;
+  if (type == nat_mapping_icmp) {
+    idx = aux_ext / ((65535 + 1) / SR_NAT_SHARDS);
+  } else if (aux_ext < SR_NAT_TCP_MIN) {
+    idx = 0;
+  } else {
+    idx = (aux_ext - SR_NAT_TCP_MIN) / 
+          ((SR_NAT_TCP_MAX - SR_NAT_TCP_MIN + 1) / SR_NAT_SHARDS);
+  }
+  return &(nat->shards[idx % SR_NAT_SHARDS]);
+}
+
+/* Shard that owns an internal (ip, port/id) pair */
+static struct sr_nat_shard *sr_nat_shard_int(struct sr_nat *nat,
+    uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+  uint32_t h = ip_int ^ ((uint32_t)aux_int * 0x9e3779b1);
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  return &(nat->shards[h % SR_NAT_SHARDS]);
+}
 
 int sr_nat_init(void *sr,
                 struct sr_nat *nat,
                 unsigned int icmp_timeout,
                 unsigned int tcp_est_timeout,
-                unsigned int tcp_trans_timeout) {
+                unsigned int tcp_trans_timeout,
+                unsigned int udp_timeout) {
 
   assert(nat);
+  int success = 0, i;
+  unsigned int icmp_span = (65535 + 1) / SR_NAT_SHARDS;
+  unsigned int tcp_span = (SR_NAT_TCP_MAX - SR_NAT_TCP_MIN + 1) / SR_NAT_SHARDS;
+  unsigned short seed = (unsigned short)(time(NULL));
+  unsigned int max_mappings, max_conns;
+  struct sigaction sa;
+
+  if (nat->next == 0){
+    fprintf(stderr,"NAT has no external addresses\n");
+    return -1;
+  }
+  if (nat->det_mask != 0){
+    /* hosts per address rounded up, then the ports split evenly */
+    uint32_t hosts = ntohl(~nat->det_mask) + 1;
+    nat->det_hosts = (hosts + nat->next - 1) / nat->next;
+    nat->det_block = (SR_NAT_TCP_MAX - SR_NAT_TCP_MIN + 1) / nat->det_hosts;
+    if (nat->det_block == 0){
+      fprintf(stderr,"NAT deterministic prefix too large: %u hosts on %u "
+              "addresses\n", hosts, nat->next);
+      return -1;
+    }
+    nat->det_dropped = 0;
+    sr_nat_print_blocks(nat, stderr);
+  }
+  /* the defaults are per external address */
+  max_mappings = nat->max_mappings ? nat->max_mappings : SR_NAT_MAX_MAPPINGS * nat->next;
+  max_conns = nat->max_conns ? nat->max_conns : SR_NAT_MAX_CONNS * nat->next;
 
   /* Acquire mutex lock */
+  success |= sr_epoch_init(&(nat->epoch));
   pthread_mutexattr_init(&(nat->attr));
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    success |= pthread_mutex_init(&(shard->lock), &(nat->attr));
+    shard->mappings = NULL;
+    shard->hand = &(shard->mappings);
+    shard->icmp_lo = i * icmp_span;
+    shard->icmp_hi = shard->icmp_lo + icmp_span - 1;
+    shard->icmp_id = (seed % icmp_span) * nat->next;
+    shard->tcp_lo = SR_NAT_TCP_MIN + i * tcp_span;
+    shard->tcp_hi = shard->tcp_lo + tcp_span - 1;
+    shard->tcp_id = 0;
+    shard->udp_id = 0;
+    success |= sr_slab_init(&(shard->map_slab), sizeof(struct sr_nat_mapping),
+                            SR_CACHE_LINE, nat->huge_pages);
+    success |= sr_slab_init(&(shard->conn_slab), sizeof(struct sr_nat_connection),
+                            sizeof(void *), nat->huge_pages);
+    success |= sr_slab_init(&(shard->det_slab), sizeof(struct sr_nat_det_session),
+                            sizeof(void *), nat->huge_pages);
+    shard->det_out = shard->det_in = NULL;
+    if (nat->det_mask != 0){
+      shard->det_out = calloc(2 * SR_NAT_DET_BUCKETS, sizeof(struct sr_nat_det_session *));
+      if (shard->det_out == NULL){
+        return -1;
+      }
+      shard->det_in = shard->det_out + SR_NAT_DET_BUCKETS;
+    }
+    shard->nmappings = shard->nconns = 0;
+    shard->max_mappings = max_mappings / SR_NAT_SHARDS + 1;
+    shard->max_conns = max_conns / SR_NAT_SHARDS + 1;
+    shard->evicted = shard->refused = shard->exhausted = 0;
+  }
 
-  /* Initialize timeout thread */
+  nat->filter.bits = calloc((size_t)SR_NAT_FILTER_TYPES * nat->next * SR_NAT_FILTER_WORDS,
+                             sizeof(uint32_t));
+  /* deterministic sessions aren't mappings, so they can't be cached */
+  nat->flows = NULL;
+  if (nat->det_mask == 0){
+    nat->flows = calloc(SR_NAT_FLOW_SLOTS, sizeof(struct sr_nat_flow));
+  }
+  if (nat->filter.bits == NULL || (nat->det_mask == 0 && nat->flows == NULL)){
+    return -1;
+  }
+  nat->serial = 0;
+  nat->flow_hits = nat->flow_misses = 0;
+  success |= pthread_mutex_init(&(nat->pending.lock), NULL);
+  memset(nat->pending.buckets, 0xff, sizeof(nat->pending.buckets));
+  nat->pending.head = nat->pending.count = 0;
+  nat->pending.icmp_second = 0;
+  nat->pending.icmp_sent = 0;
+  nat->pending.answered = nat->pending.dropped = 0;
 
-  pthread_attr_init(&(nat->thread_attr));
-  pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, sr);
+  if (nat->max_host_mappings == 0){
+    nat->max_host_mappings = SR_NAT_HOST_MAPPINGS;
+  }
+  if (nat->host_rate == 0){
+    nat->host_rate = SR_NAT_HOST_RATE;
+  }
+  success |= pthread_mutex_init(&(nat->hosts.lock), NULL);
+  memset(nat->hosts.buckets, 0xff, sizeof(nat->hosts.buckets));
+  for (i = 0; i < SR_NAT_HOSTS; i++) {
+    nat->hosts.hosts[i].ip = 0;
+    nat->hosts.hosts[i].hnext = (i + 1 < SR_NAT_HOSTS) ? i + 1 : -1;
+  }
+  nat->hosts.free = 0;
+  nat->hosts.count = 0;
+  nat->hosts.refused = nat->hosts.full = 0;
 
   /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
-  nat->mappings = NULL;
   /* Initialize any variables here */
   nat->icmp_to = icmp_timeout;
   nat->tcp_est_to = tcp_est_timeout;
   nat->tcp_trans_to = tcp_trans_timeout;
-  
-  nat->icmp_id = (unsigned short)(time(NULL));
-  nat->tcp_id = 1024;
+  nat->udp_to = udp_timeout;
+
+  /* SIGUSR1 asks the timeout thread for a stats dump */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sr_nat_stats_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&(sa.sa_mask));
+  sigaction(SIGUSR1, &sa, NULL);
+
+  /* Initialize timeout thread */
+
+  pthread_attr_init(&(nat->thread_attr));
+  pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
+  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
+  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
+  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, sr);
 
   return success;
 }
@@ -47,148 +195,665 @@ int sr_nat_init(void *sr,
 struct sr_nat_mapping *copy_map(struct sr_nat_mapping * map){
    struct sr_nat_mapping *copy = malloc(sizeof(struct sr_nat_mapping));
    memcpy(copy,map,sizeof(struct sr_nat_mapping));
-   if (map->conns != NULL){
-      /*struct sr_nat_connection *new_con = malloc(sizeof(struct sr_nat_connection));
-      memcpy(new_con,map->conns,sizeof(struct sr_nat_connection));
-      copy->conns = new_con;
-      
-      struct sr_nat_connection *prev_con = new_con;    
-      struct sr_nat_connection *con;
-      for (con = new_con->next; con != NULL; con = con->next) {
-          new_con = malloc(sizeof(struct sr_nat_connection));
-          memcpy(new_con,con,sizeof(struct sr_nat_connection));
-          prev_con->next = new_con;
-          prev_con = new_con;
-      }*/
-      copy->conns = NULL;
-   }
-   copy->packet = NULL;
+   /* connections stay with the live mapping */
+   copy->nconns = 0;
+   memset(copy->conns, 0, sizeof(copy->conns));
+   copy->conn_table = NULL;
    
    return copy;
 }
 
 int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
-  pthread_mutex_lock(&(nat->lock));
+  int ret = 0, i;
+
+  pthread_kill(nat->thread, SIGKILL);
 
   /* free nat memory here */
-  struct sr_nat_mapping *maps = nat->mappings;
-  struct sr_nat_mapping *prev = maps;
-  while(maps != NULL){
-    maps = maps->next;
-    sr_free_mapping(prev);
-    prev = maps;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    struct sr_nat_mapping *maps = shard->mappings;
+    struct sr_nat_mapping *next;
+    while(maps != NULL){
+      next = maps->next;
+      sr_nat_release_mapping(maps);
+      maps = next;
+    }
+    shard->mappings = NULL;
+    shard->hand = &(shard->mappings);
+    pthread_mutex_unlock(&(shard->lock));
+    ret |= pthread_mutex_destroy(&(shard->lock));
+    sr_slab_destroy(&(shard->map_slab));
+    sr_slab_destroy(&(shard->conn_slab));
+    sr_slab_destroy(&(shard->det_slab));  /* takes the sessions with it */
+    free(shard->det_out);
+    shard->det_out = shard->det_in = NULL;
   }
+  ret |= pthread_mutex_destroy(&(nat->pending.lock));
+  ret |= pthread_mutex_destroy(&(nat->hosts.lock));
+  free(nat->filter.bits);
+  nat->filter.bits = NULL;
+  free(nat->flows);
+  nat->flows = NULL;
 
-  pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) &&
-    pthread_mutexattr_destroy(&(nat->attr));
+  return ret || pthread_mutexattr_destroy(&(nat->attr));
+
+}
+
+/* Find helpers; the caller must hold the shard lock or be inside an epoch.
+   They return the live mapping, not a copy. */
+static struct sr_nat_mapping *sr_nat_find_external(struct sr_nat_shard *shard,
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type ) {
+  struct sr_nat_mapping *maps;
+  for (maps = SR_RCU_LOAD(shard->mappings); maps != NULL; maps = SR_RCU_LOAD(maps->next)) {
+    if (maps->aux_ext == aux_ext && maps->ip_ext == ip_ext && type == maps->type){
+      return maps;
+    }
+  }
+  return NULL;
+}
+
+static struct sr_nat_mapping *sr_nat_find_internal(struct sr_nat_shard *shard,
+    uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+  struct sr_nat_mapping *maps;
+  for (maps = SR_RCU_LOAD(shard->mappings); maps != NULL; maps = SR_RCU_LOAD(maps->next)) {
+    if (maps->ip_int == ip_int && maps->aux_int == aux_int && type == maps->type){
+      return maps;
+    }
+  }
+  return NULL;
+}
+
+static void sr_nat_touch(uint32_t *stamp, time_t now) {
+  __atomic_store_n(stamp, now, __ATOMIC_RELAXED);
+}
+
+/* Connection index (see sr_nat.h). find may run under an epoch; everything
+   else needs the shard lock. */
+static uint32_t sr_nat_conn_hash(uint32_t ip, uint16_t port) {
+  uint32_t h = ip ^ ((uint32_t)port * 0x9e3779b1);
+  h ^= h >> 15;
+  h *= 0x2c1b3c6d;
+  h ^= h >> 12;
+  return h;
+}
+
+/* Length of the connection array in use, and its i'th pointer */
+static unsigned int sr_nat_conn_slots(struct sr_nat_mapping *maps) {
+  return (maps->conn_table != NULL) ? maps->conn_table->mask + 1 : SR_NAT_CONN_INLINE;
+}
+
+static struct sr_nat_connection **sr_nat_conn_cell(struct sr_nat_mapping *maps,
+                                                   unsigned int i) {
+  if (maps->conn_table != NULL){
+    return &(maps->conn_table->slots[i].con);
+  }
+  return &(maps->conns[i]);
+}
+
+static struct sr_nat_connection *sr_nat_find_conn(struct sr_nat_mapping *maps,
+                                                  uint32_t ip, uint16_t port) {
+  struct sr_nat_conn_table *table = SR_RCU_LOAD(maps->conn_table);
+  struct sr_nat_conn_slot *slot;
+  struct sr_nat_connection *con;
+  unsigned int i, n;
+
+  if (table == NULL){
+    for (i = 0; i < SR_NAT_CONN_INLINE; i++){
+      con = SR_RCU_LOAD(maps->conns[i]);
+      if (con == NULL){
+        break;
+      }
+      if (con != SR_NAT_CONN_DEAD && con->conn_ip == ip && con->conn_port == port){
+        return con;
+      }
+    }
+    return NULL;
+  }
+  
+  i = sr_nat_conn_hash(ip, port) & table->mask;
+  for (n = 0; n <= table->mask; n++, i = (i + 1) & table->mask){
+    slot = &(table->slots[i]);
+    con = SR_RCU_LOAD(slot->con);
+    if (con == NULL){
+      break;
+    }
+    if (con != SR_NAT_CONN_DEAD && slot->ip == ip && slot->port == port){
+      return con;
+    }
+  }
+  return NULL;
+}
+
+/* First never-used slot on ip/port's probe sequence */
+static struct sr_nat_conn_slot *sr_nat_conn_probe(struct sr_nat_conn_table *table,
+                                                  uint32_t ip, uint16_t port) {
+  unsigned int i = sr_nat_conn_hash(ip, port) & table->mask;
+  while (table->slots[i].con != NULL){
+    i = (i + 1) & table->mask;
+  }
+  return &(table->slots[i]);
+}
+
+/* Move the live connections into a fresh table with room for want of them
+   at no more than half load. Readers still on the old array keep seeing
+   valid connections until the epoch frees it. Returns -1, leaving the old
+   array in place, if the table can't be allocated. */
+static int sr_nat_conn_rebuild(struct sr_nat *nat, struct sr_nat_mapping *maps,
+                                unsigned int want) {
+  struct sr_nat_conn_table *old = maps->conn_table;
+  struct sr_nat_conn_table *table;
+  struct sr_nat_conn_slot *slot;
+  struct sr_nat_connection *con;
+  unsigned int size = SR_NAT_CONN_MIN_TABLE;
+  unsigned int i, n;
+
+  while (size < want * 2){
+    size <<= 1;
+  }
+  table = calloc(1, sizeof(struct sr_nat_conn_table) +
+                    (size - 1) * sizeof(struct sr_nat_conn_slot));
+  if (table == NULL){
+    return -1;
+  }
+  table->mask = size - 1;
+
+  n = sr_nat_conn_slots(maps);
+  for (i = 0; i < n; i++){
+    con = *sr_nat_conn_cell(maps, i);
+    if (con != NULL && con != SR_NAT_CONN_DEAD){
+      slot = sr_nat_conn_probe(table, con->conn_ip, con->conn_port);
+      slot->ip = con->conn_ip;
+      slot->port = con->conn_port;
+      slot->con = con;
+      table->used++;
+    }
+  }
+  
+  SR_RCU_STORE(maps->conn_table, table);
+  if (old != NULL){
+    sr_epoch_retire(&(nat->epoch), old, free);
+  }
+  return 0;
+}
+
+static uint32_t *sr_nat_filter_word(struct sr_nat *nat, unsigned int idx,
+                                    uint16_t aux_ext, sr_nat_mapping_type type) {
+  return nat->filter.bits + 
+         ((size_t)type * nat->next + idx) * SR_NAT_FILTER_WORDS + aux_ext / 32;
+}
+
+/* Is (pool address idx, aux_ext) taken? Exact under the owning shard's lock. */
+static int sr_nat_filter_test(struct sr_nat *nat, unsigned int idx,
+                              uint16_t aux_ext, sr_nat_mapping_type type) {
+  return (__atomic_load_n(sr_nat_filter_word(nat, idx, aux_ext, type), __ATOMIC_ACQUIRE)
+          >> (aux_ext % 32)) & 1;
+}
+
+static void sr_nat_filter_set(struct sr_nat *nat, struct sr_nat_mapping *maps,
+                              int on) {
+  uint32_t *word, bit;
+  
+  if (maps->type >= SR_NAT_FILTER_TYPES){
+    return;
+  }
+  word = sr_nat_filter_word(nat, maps->ext_idx, maps->aux_ext, maps->type);
+  bit = 1U << (maps->aux_ext % 32);
+  if (on){
+    __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+  } else {
+    __atomic_fetch_and(word, ~bit, __ATOMIC_RELEASE);
+  }
+}
+
+int sr_nat_add_external(struct sr_nat *nat, uint32_t ip) {
+  unsigned int h;
+  
+  if (nat->next >= SR_NAT_MAX_EXT || sr_nat_external_index(nat, ip) >= 0){
+    return -1;
+  }
+  for (h = sr_ip_hash(ip, SR_NAT_EXT_BITS); nat->ext_slots[h] != 0; h = (h + 1) & (SR_NAT_EXT_SLOTS - 1));
+  nat->ext_ips[nat->next] = ip;
+  nat->ext_slots[h] = nat->next + 1;
+  nat->next++;
+  return 0;
+}
+
+int sr_nat_parse_pool(struct sr_nat *nat, const char *spec) {
+  char buf[1024], *tok, *slash, *save = NULL;
+  struct in_addr addr;
+  uint32_t base, count, i;
+  int bits, added = 0;
+
+  if (strlen(spec) >= sizeof(buf)){
+    return -1;
+  }
+  strcpy(buf, spec);
+  slash = strchr(buf, '/');
+  if (slash != NULL){
+    *slash = '\0';
+    bits = atoi(slash + 1);
+    if (inet_pton(AF_INET, buf, &addr) != 1 || bits < 26 || bits > 32){
+      return -1; /* at most SR_NAT_MAX_EXT addresses */
+    }
+    count = 1U << (32 - bits);
+    base = ntohl(addr.s_addr) & ~(count - 1);
+    for (i = 0; i < count; i++){
+      added += (sr_nat_add_external(nat, htonl(base + i)) == 0);
+    }
+    return added;
+  }
+  for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+    if (inet_pton(AF_INET, tok, &addr) != 1){
+      return -1;
+    }
+    added += (sr_nat_add_external(nat, addr.s_addr) == 0);
+  }
+  return added;
+}
 
+int sr_nat_external_index(struct sr_nat *nat, uint32_t ip) {
+  unsigned int h;
+  unsigned char slot;
+
+  if (nat->ext_ips[0] == ip && nat->next > 0){
+    return 0; /* the usual single address */
+  }
+  h = sr_ip_hash(ip, SR_NAT_EXT_BITS);
+  while ((slot = nat->ext_slots[h]) != 0){
+    if (nat->ext_ips[slot - 1] == ip){
+      return slot - 1;
+    }
+    h = (h + 1) & (SR_NAT_EXT_SLOTS - 1);
+  }
+  return -1;
+}
+
+int sr_nat_maybe_external(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext,
+                          sr_nat_mapping_type type) {
+  int idx = sr_nat_external_index(nat, ip_ext);
+  
+  if (idx < 0){
+    return 0;
+  }
+  if (type >= SR_NAT_FILTER_TYPES){
+    return 1;
+  }
+  if (nat->det_mask != 0 && type != nat_mapping_icmp){
+    return sr_nat_det_ext_host(nat, ip_ext, aux_ext) >= 0; /* in some block */
+  }
+  return sr_nat_filter_test(nat, idx, aux_ext, type);
+}
+
+/* Unlink the mapping at *link and hand it to the epoch */
+static void sr_nat_remove(struct sr_nat *nat, struct sr_nat_shard *shard,
+                          struct sr_nat_mapping **link) {
+  struct sr_nat_mapping *maps = *link;
+  
+  sr_nat_filter_set(nat, maps, 0);
+  __atomic_store_n(&(maps->serial), 0, __ATOMIC_RELEASE); /* flow cache */
+  SR_RCU_STORE(*link, maps->next);
+  if (shard->hand == &(maps->next)){
+    shard->hand = link;
+  }
+  shard->nmappings--;
+  shard->nconns -= maps->nconns;
+  __atomic_fetch_sub(&(nat->ext_mappings[maps->ext_idx]), 1, __ATOMIC_RELAXED);
+  sr_nat_host_release(nat, maps->ip_int);
+  sr_epoch_retire(&(nat->epoch), maps, sr_nat_free_retired);
+}
+
+/* The entry for an internal ip, or -1. The hosts lock must be held. */
+static int sr_nat_find_host(struct sr_nat_hosts *hosts, uint32_t ip) {
+  int i;
+  for (i = hosts->buckets[sr_ip_hash(ip, SR_NAT_HOST_BITS)]; i >= 0; i = hosts->hosts[i].hnext){
+    if (hosts->hosts[i].ip == ip){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Charge one new mapping to internal host ip. Returns 0 if it is within
+   the host's limits, -1 if the insert must be refused. */
+static int sr_nat_host_charge(struct sr_nat *nat, uint32_t ip, time_t now) {
+  struct sr_nat_hosts *hosts = &(nat->hosts);
+  struct sr_nat_host *host;
+  unsigned long tokens;
+  unsigned int b;
+  int i, ret = -1;
+
+  pthread_mutex_lock(&(hosts->lock));
+  i = sr_nat_find_host(hosts, ip);
+  if (i < 0){
+    if (hosts->free < 0){
+      hosts->full++;
+      pthread_mutex_unlock(&(hosts->lock));
+      return -1;
+    }
+    i = hosts->free;
+    host = &(hosts->hosts[i]);
+    hosts->free = host->hnext;
+    b = sr_ip_hash(ip, SR_NAT_HOST_BITS);
+    host->ip = ip;
+    host->nmappings = 0;
+    host->tokens = nat->host_rate;
+    host->refill = now;
+    host->refused = 0;
+    host->hnext = hosts->buckets[b];
+    hosts->buckets[b] = i;
+    hosts->count++;
+  }
+  host = &(hosts->hosts[i]);
+  
+  if ((uint32_t)now > host->refill){
+    tokens = host->tokens + (unsigned long)nat->host_rate * ((uint32_t)now - host->refill);
+    host->tokens = (tokens > nat->host_rate) ? nat->host_rate : tokens;
+    host->refill = now;
+  }
+  if (host->nmappings >= nat->max_host_mappings || host->tokens == 0){
+    host->refused++;
+    hosts->refused++;
+  } else {
+    host->tokens--;
+    host->nmappings++;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&(hosts->lock));
+  return ret;
+}
+
+/* A mapping charged to ip is gone */
+static void sr_nat_host_release(struct sr_nat *nat, uint32_t ip) {
+  struct sr_nat_hosts *hosts = &(nat->hosts);
+  int i;
+
+  pthread_mutex_lock(&(hosts->lock));
+  i = sr_nat_find_host(hosts, ip);
+  if (i >= 0 && hosts->hosts[i].nmappings > 0){
+    hosts->hosts[i].nmappings--;
+  }
+  pthread_mutex_unlock(&(hosts->lock));
+}
+
+/* Recycle entries with no mappings whose bucket has refilled, so a host
+   can't reset its rate by letting its mappings lapse */
+static void sr_nat_hosts_expire(struct sr_nat *nat, time_t curtime) {
+  struct sr_nat_hosts *hosts = &(nat->hosts);
+  struct sr_nat_host *host;
+  unsigned int b;
+  int *link;
+
+  pthread_mutex_lock(&(hosts->lock));
+  for (b = 0; b < SR_NAT_HOST_BUCKETS && hosts->count > 0; b++){
+    link = &(hosts->buckets[b]);
+    while (*link >= 0){
+      host = &(hosts->hosts[*link]);
+      if (host->nmappings == 0 && (uint32_t)curtime > host->refill){
+        int i = *link;
+        *link = host->hnext;
+        host->ip = 0;
+        host->hnext = hosts->free;
+        hosts->free = i;
+        hosts->count--;
+      } else {
+        link = &(host->hnext);
+      }
+    }
+  }
+  pthread_mutex_unlock(&(hosts->lock));
+}
+
+/* Evict the least recently used mapping in a sample taken from the clock
+   hand, other than keep. With conns set only mappings holding connections
+   are candidates (freeing a connection is the point), otherwise any
+   mapping. Either way mappings with an established connection are spared.
+   Returns 1 if one went. Lock held. */
+static int sr_nat_evict(struct sr_nat *nat, struct sr_nat_shard *shard,
+                        struct sr_nat_mapping *keep, int conns) {
+  struct sr_nat_mapping **link = shard->hand, **victim = NULL, *maps;
+  unsigned int scanned, seen = 0;
+
+  for (scanned = 0; scanned < shard->nmappings && scanned < SR_NAT_EVICT_SCAN &&
+       seen < SR_NAT_EVICT_SAMPLE; scanned++){
+    if (*link == NULL){
+      link = &(shard->mappings); /* wrap round */
+    }
+    maps = *link;
+    if (maps != keep && !(maps->type == nat_mapping_tcp && maps->estab) &&
+        (!conns || maps->nconns > 0)){
+      seen++;
+      if (victim == NULL || maps->last_updated < (*victim)->last_updated){
+        victim = link;
+      }
+    }
+    link = &(maps->next);
+  }
+  shard->hand = link;
+  if (victim == NULL){
+    return 0;
+  }
+  sr_nat_remove(nat, shard, victim);
+  shard->evicted++;
+  return 1;
+}
+
+/* A timeout scaled down for the shard's occupancy */
+static unsigned int sr_nat_pressure_to(struct sr_nat_shard *shard, unsigned int to) {
+  unsigned long occ = (unsigned long)shard->nmappings * 1000 / shard->max_mappings;
+  unsigned long occ_conns = (unsigned long)shard->nconns * 1000 / shard->max_conns;
+  unsigned long scaled;
+
+  if (occ_conns > occ){
+    occ = occ_conns;
+  }
+  if (occ <= 500){
+    return to;
+  }
+  scaled = (occ >= 1000) ? 0 : (unsigned long)to * (1000 - occ) / 500;
+  return (scaled < SR_NAT_MIN_TO) ? SR_NAT_MIN_TO : scaled;
+}
+
+static struct sr_nat_connection *sr_nat_new_conn(struct sr_nat *nat,
+                                                 struct sr_nat_shard *shard,
+                                                 struct sr_nat_mapping *maps,
+                                                 uint32_t ip, uint16_t port,
+                                                 time_t now) {
+  struct sr_nat_connection *con;
+  struct sr_nat_conn_slot *slot;
+  struct sr_nat_conn_table *table;
+  unsigned int i;
+  
+  if (shard->nconns >= shard->max_conns){
+    sr_nat_evict(nat, shard, maps, 1);
+    if (shard->nconns >= shard->max_conns){
+      shard->refused++;
+      return NULL;
+    }
+  }
+  con = sr_slab_alloc(&(shard->conn_slab));
+  if (con == NULL){
+    return NULL;
+  }
+  shard->nconns++;
+  con->conn_ip = ip;
+  con->conn_port = port;
+  con->state = SYN_SENT;
+  con->last_updated = now;
+
+  if (maps->conn_table == NULL){
+    for (i = 0; i < SR_NAT_CONN_INLINE; i++){
+      if (maps->conns[i] == NULL){
+        SR_RCU_STORE(maps->conns[i], con);
+        maps->nconns++;
+        return con;
+      }
+    }
+  }
+  
+  table = maps->conn_table;
+  if (table == NULL || (table->used + 1) * 4 > (table->mask + 1) * 3){
+    if (sr_nat_conn_rebuild(nat, maps, maps->nconns + 1) != 0){
+      shard->nconns--;
+      sr_slab_free(con);
+      return NULL;
+    }
+    table = maps->conn_table;
+  }
+  slot = sr_nat_conn_probe(table, ip, port);
+  slot->ip = ip;
+  slot->port = port;
+  SR_RCU_STORE(slot->con, con);
+  table->used++;
+  maps->nconns++;
+  return con;
+}
+
+/* Free a live mapping and everything it owns. Only once no reader can
+   reach it: under the shard lock before publication, or from the epoch. */
+static void sr_nat_release_mapping(struct sr_nat_mapping *maps) {
+  struct sr_nat_connection *con;
+  unsigned int i, n;
+
+  n = sr_nat_conn_slots(maps);
+  for (i = 0; i < n; i++){
+    con = *sr_nat_conn_cell(maps, i);
+    if (con != NULL && con != SR_NAT_CONN_DEAD){
+      sr_slab_free(con);
+    }
+  }
+  if (maps->conn_table != NULL){
+    free(maps->conn_table);
+  }
+  sr_slab_free(maps);
+}
+
+static void sr_nat_free_retired(void *map) {
+  sr_nat_release_mapping((struct sr_nat_mapping *)map);
+}
+
+/* Drop connections idle past their timeout and refresh maps->estab */
+static void sr_nat_expire_conns(struct sr_nat *nat, struct sr_nat_shard *shard,
+                                struct sr_nat_mapping *maps, time_t curtime,
+                                unsigned int trans_to) {
+  struct sr_nat_connection **cell, *con;
+  unsigned int i, n, timeout;
+  uint8_t estab = 0, state;
+
+  n = sr_nat_conn_slots(maps);
+  for (i = 0; i < n && maps->nconns > 0; i++){
+    cell = sr_nat_conn_cell(maps, i);
+    con = *cell;
+    if (con == NULL || con == SR_NAT_CONN_DEAD){
+      continue;
+    }
+    state = __atomic_load_n(&(con->state), __ATOMIC_ACQUIRE);
+    if (state == ESTAB2){
+      timeout = nat->tcp_est_to;
+    } else if (state == TIME_W){
+      timeout = (trans_to < SR_NAT_TCP_TIME_WAIT) ? trans_to : SR_NAT_TCP_TIME_WAIT;
+    } else {
+      timeout = trans_to;
+    }
+    if (difftime(curtime, con->last_updated) >= timeout){
+      SR_RCU_STORE(*cell, SR_NAT_CONN_DEAD);
+      __atomic_store_n(&(con->state), 0, __ATOMIC_RELEASE); /* flow cache */
+      sr_epoch_retire(&(nat->epoch), con, sr_slab_free);
+      maps->nconns--;
+      shard->nconns--;
+    } else if (state == ESTAB2){
+      estab = 1;
+    }
+  }
+  __atomic_store_n(&(maps->estab), estab, __ATOMIC_RELAXED);
+}
+
+/* Sweep one shard. Returns with the shard unlocked. ICMP errors for
+   unanswered SYNs are queued on the slow path, never sent from here. */
+static void sr_nat_sweep_shard(struct sr_instance *sr, struct sr_nat_shard *shard,
+                               time_t curtime) {
+  struct sr_nat *nat = &(sr->nat);
+  struct sr_nat_mapping **link, *maps;
+  unsigned int icmp_to, trans_to, udp_to;
+
+  pthread_mutex_lock(&(shard->lock));
+  icmp_to = sr_nat_pressure_to(shard, nat->icmp_to);
+  trans_to = sr_nat_pressure_to(shard, nat->tcp_trans_to);
+  udp_to = sr_nat_pressure_to(shard, nat->udp_to);
+  link = &(shard->mappings);
+  while ((maps = *link) != NULL){
+    double diff = difftime(curtime, maps->last_updated);
+    unsigned char expired = 0;
+
+    if (maps->type == nat_mapping_icmp){
+      expired = (diff > icmp_to);
+    } else if (maps->type == nat_mapping_udp){
+      expired = (diff > udp_to);
+    } else if (maps->type == nat_mapping_tcp){
+      sr_nat_expire_conns(nat, shard, maps, curtime, trans_to);
+      expired = (maps->nconns == 0 || diff >= nat->tcp_est_to);
+    }
+
+    if (expired){
+      sr_nat_remove(nat, shard, link);
+    } else {
+      link = &(maps->next);
+    }
+  }
+  if (shard->det_out != NULL){
+    sr_nat_det_expire(nat, shard, curtime, trans_to, udp_to);
+  }
+  pthread_mutex_unlock(&(shard->lock));
 }
 
 void *sr_nat_timeout(void * sr_ptr) {  /* Periodic Timout handling */
   struct sr_instance *sr = (struct sr_instance *)sr_ptr;
   struct sr_nat *nat = &(sr->nat);
+  int i;
   while (1) {
     sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
 
+    /* handle periodic tasks here, one shard at a time so traffic on the
+       other shards never waits for the sweep */
     time_t curtime = time(NULL);
-    /* handle periodic tasks here */
-    struct sr_nat_mapping *maps = nat->mappings;
-    struct sr_nat_mapping *prev = NULL;
-    while(maps != NULL){ /*TODO: SEND ICMP??*/
-      double diff = difftime(curtime, maps->last_updated);
-        
-      if (maps->type == nat_mapping_icmp && diff > nat->icmp_to){
-          if(prev == NULL){
-            nat->mappings = NULL;
-          } else {
-            prev->next = maps->next;
-          }
-          sr_free_mapping(maps);
-      } else if (maps->type == nat_mapping_waiting && diff >= 6.0){
-          struct sr_nat_mapping *targ_map = sr_nat_lookup_external(nat,
-                                                                  maps->aux_ext,
-                                                                  nat_mapping_tcp);
-          if(targ_map == NULL){
-              sr_send_icmp(sr, maps->packet, SIZE_ETH+SIZE_IP+SIZE_TCP, 3, 3, 0);
-          } else {
-              unsigned char found = 0;
-              struct sr_nat_connection *con = maps->conns;
-              for (con = maps->conns; con != NULL; con = con->next) {
-                  if (con->conn_ip == maps->ip_ext){
-                     found = 1;
-                     break;
-                  } 
-              }
-              if (!found){
-                  sr_send_icmp(sr, maps->packet, SIZE_ETH+SIZE_IP+SIZE_TCP, 3, 3, 0);
-              }
-          }
-          if(prev == NULL){
-            nat->mappings = NULL;
-          } else {
-            prev->next = maps->next;
-          }
-          sr_free_mapping(maps);
-      }else if (maps->type == nat_mapping_tcp){
-          if (diff >= nat->tcp_est_to){
-              sr_free_mapping(maps);
-          } else {
-              unsigned char keep = 0;
-              struct sr_nat_connection *con = maps->conns;
-              struct sr_nat_connection *prev_con = maps->conns;
-              for (con = maps->conns; con != NULL; con = con->next) {
-                  unsigned int timeout = ((con->state == ESTAB2) ? nat->tcp_est_to : nat->tcp_trans_to);
-                  if (difftime(curtime, con->last_updated) >= timeout){
-                     prev_con->next = con->next;
-                     free(con);
-                     con = prev_con;
-                  } else {
-                     keep = 1;
-                  }
-              }
-              
-              if (!keep){
-                  sr_free_mapping(maps);
-              }
-          }
-      }
-      
-      prev = maps;
-      maps = maps->next;
+    for (i = 0; i < SR_NAT_SHARDS; i++) {
+      sr_nat_sweep_shard(sr, &(nat->shards[i]), curtime);
+    }
+    sr_nat_pending_expire(sr, curtime);
+    sr_nat_hosts_expire(nat, curtime);
+    sr_epoch_reclaim(&(nat->epoch));
+    
+    if (sr_nat_stats_requested){
+      sr_nat_stats_requested = 0;
+      sr_nat_print_stats(nat, stderr);
     }
-
-    pthread_mutex_unlock(&(nat->lock));
   }
   return NULL;
 }
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
+/* Get the mapping associated with given external address and port.
+   Lock-free. You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  if (!sr_nat_maybe_external(nat, ip_ext, aux_ext, type)){
+    return NULL;
+  }
+  
+  struct sr_nat_shard *shard = sr_nat_shard_ext(nat, aux_ext, type);
+  struct sr_epoch_slot *rcu = sr_epoch_enter(&(nat->epoch));
 
   /* handle lookup here, malloc and assign to copy. */
   struct sr_nat_mapping *copy = NULL;
-  struct sr_nat_mapping *maps = nat->mappings;
-  fprintf(stderr,"Lookup External %u\n",aux_ext);
-  while(maps != NULL){
-    fprintf(stderr,"\t comparing to: %u\n", aux_ext);
-    if (maps->aux_ext == aux_ext && type == maps->type){
-      /*maps->last_updated = time(NULL);*/
-      copy = copy_map(maps);
-      pthread_mutex_unlock(&(nat->lock));
-      return copy;
-    }
-    maps = maps->next;
+  struct sr_nat_mapping *maps;
+  maps = sr_nat_find_external(shard, ip_ext, aux_ext, type);
+  if (maps != NULL){
+    copy = copy_map(maps);
   }
 
-  pthread_mutex_unlock(&(nat->lock));
-  return NULL;
+  sr_epoch_exit(rcu);
+  return copy;
 }
 
 /* Get the mapping associated with given internal (ip, port) pair.
@@ -196,185 +861,1187 @@ struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_shard *shard = sr_nat_shard_int(nat, ip_int, aux_int, type);
+  pthread_mutex_lock(&(shard->lock));
 
   /* handle lookup here, malloc and assign to copy. */
   struct sr_nat_mapping *copy = NULL;
-  struct sr_nat_mapping *maps = nat->mappings;
-  while(maps != NULL){
-    if (maps->ip_int == ip_int && maps->aux_int == aux_int && type == maps->type){
-      /*maps->last_updated = time(NULL);*/
-      copy = copy_map(maps);
-      pthread_mutex_unlock(&(nat->lock));
-      return copy;
+  struct sr_nat_mapping *maps = sr_nat_find_internal(shard, ip_int, aux_int, type);
+  if (maps != NULL){
+    copy = copy_map(maps);
+  }
+
+  pthread_mutex_unlock(&(shard->lock));
+  return copy;
+}
+
+/* Host number of ip_int within the deterministic prefix, or -1 */
+static long sr_nat_det_host(struct sr_nat *nat, uint32_t ip_int) {
+  if (nat->det_mask == 0 || (ip_int & nat->det_mask) != nat->det_net){
+    return -1;
+  }
+  return (long)ntohl(ip_int & ~nat->det_mask);
+}
+
+unsigned int sr_nat_det_block(struct sr_nat *nat, uint32_t ip_int,
+  uint32_t *ip_ext, uint16_t *lo) {
+  long host = sr_nat_det_host(nat, ip_int);
+  if (host < 0){
+    return 0;
+  }
+  *ip_ext = nat->ext_ips[host / nat->det_hosts];
+  *lo = SR_NAT_TCP_MIN + (host % nat->det_hosts) * nat->det_block;
+  return nat->det_block;
+}
+
+int sr_nat_set_deterministic(struct sr_nat *nat, const char *prefix) {
+  char addr[INET_ADDRSTRLEN];
+  const char *slash = strchr(prefix, '/');
+  struct in_addr in;
+  int len;
+
+  if (slash == NULL || slash - prefix >= INET_ADDRSTRLEN){
+    return -1;
+  }
+  memcpy(addr, prefix, slash - prefix);
+  addr[slash - prefix] = '\0';
+  len = atoi(slash + 1);
+  if (inet_pton(AF_INET, addr, &in) != 1 || len < 1 || len > 32){
+    return -1;
+  }
+  nat->det_mask = htonl(0xffffffffU << (32 - len));
+  nat->det_net = in.s_addr & nat->det_mask;
+  return 0;
+}
+
+void sr_nat_print_blocks(struct sr_nat *nat, FILE *out) {
+  uint32_t hosts = ntohl(~nat->det_mask) + 1, h;
+  char in_name[INET_ADDRSTRLEN], ext_name[INET_ADDRSTRLEN];
+  struct in_addr addr;
+  uint32_t ip_ext;
+  uint16_t lo;
+
+  fprintf(out, "NAT: deterministic, %u hosts, %u per address, %u ports each\n",
+          hosts, nat->det_hosts, nat->det_block);
+  for (h = 0; h < hosts; h++) {
+    addr.s_addr = nat->det_net | htonl(h);
+    sr_nat_det_block(nat, addr.s_addr, &ip_ext, &lo);
+    inet_ntop(AF_INET, &addr, in_name, sizeof(in_name));
+    addr.s_addr = ip_ext;
+    inet_ntop(AF_INET, &addr, ext_name, sizeof(ext_name));
+    fprintf(out, "NAT:   %-15s -> %-15s %5u-%u\n", in_name, ext_name,
+            lo, lo + nat->det_block - 1);
+  }
+}
+
+/* Pool address for internal host ip_int in paired mode, and for ICMP in
+   deterministic mode, where it is the host's block address */
+static unsigned int sr_nat_paired_index(struct sr_nat *nat, uint32_t ip_int) {
+  long host = sr_nat_det_host(nat, ip_int);
+  if (host >= 0){
+    return host / nat->det_hosts;
+  }
+  return sr_nat_conn_hash(ip_int, 0) % nat->next;
+}
+
+/* Host whose block holds external address ip_ext and port aux_ext (host
+   order), or -1: host = address index * hosts per address + block */
+static long sr_nat_det_ext_host(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext) {
+  int idx = sr_nat_external_index(nat, ip_ext);
+  unsigned int block;
+  uint32_t host;
+
+  if (idx < 0 || aux_ext < SR_NAT_TCP_MIN){
+    return -1;
+  }
+  block = (aux_ext - SR_NAT_TCP_MIN) / nat->det_block;
+  host = idx * nat->det_hosts + block;
+  if (block >= nat->det_hosts || (htonl(host) & nat->det_mask) != 0){
+    return -1;
+  }
+  return host;
+}
+
+/* Deterministic sessions (see sr_nat.h). All of these need the lock of
+   the host's shard, host % SR_NAT_SHARDS. */
+static struct sr_nat_shard *sr_nat_det_shard(struct sr_nat *nat, long host) {
+  return &(nat->shards[host % SR_NAT_SHARDS]);
+}
+
+static unsigned int sr_nat_det_hash(uint32_t ip_int, uint16_t port, uint32_t peer_ip,
+                                    uint16_t peer_port, uint8_t proto) {
+  uint32_t h = sr_nat_conn_hash(peer_ip, peer_port) ^
+               sr_nat_conn_hash(ip_int ^ proto, port) * 0x9e3779b1;
+  return (h ^ (h >> 16)) & (SR_NAT_DET_BUCKETS - 1);
+}
+
+static struct sr_nat_det_session *sr_nat_det_find_out(struct sr_nat_shard *shard,
+    uint32_t ip_int, uint16_t aux_int, uint32_t peer_ip, uint16_t peer_port,
+    uint8_t proto) {
+  struct sr_nat_det_session *sess;
+  for (sess = shard->det_out[sr_nat_det_hash(ip_int, aux_int, peer_ip, peer_port, proto)];
+       sess != NULL; sess = sess->onext){
+    if (sess->ip_int == ip_int && sess->aux_int == aux_int && sess->peer_ip == peer_ip &&
+        sess->peer_port == peer_port && sess->proto == proto){
+      return sess;
     }
-    maps = maps->next;
   }
+  return NULL;
+}
 
-  pthread_mutex_unlock(&(nat->lock));
+static struct sr_nat_det_session *sr_nat_det_find_in(struct sr_nat_shard *shard,
+    uint32_t ip_int, uint16_t aux_ext, uint32_t peer_ip, uint16_t peer_port,
+    uint8_t proto) {
+  struct sr_nat_det_session *sess;
+  for (sess = shard->det_in[sr_nat_det_hash(ip_int, aux_ext, peer_ip, peer_port, proto)];
+       sess != NULL; sess = sess->inext){
+    if (sess->ip_int == ip_int && sess->aux_ext == aux_ext && sess->peer_ip == peer_ip &&
+        sess->peer_port == peer_port && sess->proto == proto){
+      return sess;
+    }
+  }
   return NULL;
 }
 
+/* Open a session for internal host number host. The block port is picked
+   first, then the limits are charged, so a packet that can't be
+   translated costs nobody else anything. NULL if it can't be opened. */
+static struct sr_nat_det_session *sr_nat_det_new(struct sr_nat *nat,
+    struct sr_nat_shard *shard, long host, uint32_t ip_int, uint16_t aux_int,
+    uint32_t peer_ip, uint16_t peer_port, uint8_t proto, time_t now) {
+  struct sr_nat_det_session *sess;
+  unsigned int lo = SR_NAT_TCP_MIN + (host % nat->det_hosts) * nat->det_block;
+  unsigned int start = ntohs(aux_int) % nat->det_block, i;
+  unsigned int b;
+  uint16_t aux_ext = 0;
+
+  for (i = 0; i < nat->det_block; i++){
+    aux_ext = lo + (start + i) % nat->det_block;
+    if (sr_nat_det_find_in(shard, ip_int, aux_ext, peer_ip, peer_port, proto) == NULL){
+      break;
+    }
+  }
+  if (i == nat->det_block){
+    shard->exhausted++;
+    return NULL;
+  }
+  if (shard->nconns >= shard->max_conns){
+    shard->refused++;
+    return NULL;
+  }
+  if (sr_nat_host_charge(nat, ip_int, now) != 0){
+    return NULL;
+  }
+  sess = sr_slab_alloc(&(shard->det_slab));
+  if (sess == NULL){
+    sr_nat_host_release(nat, ip_int);
+    return NULL;
+  }
+  sess->ip_int = ip_int;
+  sess->aux_int = aux_int;
+  sess->peer_ip = peer_ip;
+  sess->peer_port = peer_port;
+  sess->aux_ext = aux_ext;
+  sess->proto = proto;
+  sess->state = (proto == ip_protocol_tcp) ? SYN_SENT : 0;
+  sess->last_updated = now;
+  b = sr_nat_det_hash(ip_int, aux_int, peer_ip, peer_port, proto);
+  sess->onext = shard->det_out[b];
+  shard->det_out[b] = sess;
+  b = sr_nat_det_hash(ip_int, aux_ext, peer_ip, peer_port, proto);
+  sess->inext = shard->det_in[b];
+  shard->det_in[b] = sess;
+  shard->nconns++;
+  return sess;
+}
+
+/* Unlink the session at *link (its outbound chain) and free it */
+static void sr_nat_det_remove(struct sr_nat *nat, struct sr_nat_shard *shard,
+                              struct sr_nat_det_session **link) {
+  struct sr_nat_det_session *sess = *link, **in;
+
+  *link = sess->onext;
+  in = &(shard->det_in[sr_nat_det_hash(sess->ip_int, sess->aux_ext, sess->peer_ip,
+                                       sess->peer_port, sess->proto)]);
+  while (*in != sess){
+    in = &((*in)->inext);
+  }
+  *in = sess->inext;
+  shard->nconns--;
+  sr_nat_host_release(nat, sess->ip_int);
+  sr_slab_free(sess);
+}
+
+/* Drop the shard's sessions idle past their timeout */
+static void sr_nat_det_expire(struct sr_nat *nat, struct sr_nat_shard *shard,
+                              time_t curtime, unsigned int trans_to,
+                              unsigned int udp_to) {
+  struct sr_nat_det_session **link, *sess;
+  unsigned int b, timeout;
+
+  for (b = 0; b < SR_NAT_DET_BUCKETS && shard->nconns > 0; b++){
+    link = &(shard->det_out[b]);
+    while ((sess = *link) != NULL){
+      if (sess->proto == ip_protocol_udp){
+        timeout = udp_to;
+      } else if (sess->state == ESTAB2){
+        timeout = nat->tcp_est_to;
+      } else if (sess->state == TIME_W){
+        timeout = (trans_to < SR_NAT_TCP_TIME_WAIT) ? trans_to : SR_NAT_TCP_TIME_WAIT;
+      } else {
+        timeout = trans_to;
+      }
+      if (difftime(curtime, sess->last_updated) >= timeout){
+        sr_nat_det_remove(nat, shard, link);
+      } else {
+        link = &(sess->onext);
+      }
+    }
+  }
+}
+
+/* Outbound half of sr_nat_translate_outbound for TCP (tcp_header set) and
+   UDP: find or open the session and step its state. Sets the external
+   address and port (host order), or returns -1. */
+static int sr_nat_det_outbound(struct sr_nat *nat, sr_ip_hdr_t *ip_header,
+                               sr_tcp_hdr_t *tcp_header, uint16_t aux_int,
+                               uint16_t peer_port, uint32_t *ip_ext,
+                               uint16_t *aux_ext) {
+  long host = sr_nat_det_host(nat, ip_header->ip_src);
+  uint8_t proto = (tcp_header != NULL) ? ip_protocol_tcp : ip_protocol_udp;
+  struct sr_nat_shard *shard;
+  struct sr_nat_det_session *sess;
+  time_t now = time(NULL);
+
+  if (host < 0){
+    __atomic_fetch_add(&(nat->det_dropped), 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  shard = sr_nat_det_shard(nat, host);
+  pthread_mutex_lock(&(shard->lock));
+  sess = sr_nat_det_find_out(shard, ip_header->ip_src, aux_int, ip_header->ip_dst,
+                             peer_port, proto);
+  if (sess == NULL){
+    /* a TCP session only starts with a SYN: without one there is no
+       block port to send the rest from */
+    if (tcp_header == NULL || tcp_header->syn){
+      sess = sr_nat_det_new(nat, shard, host, ip_header->ip_src, aux_int,
+                            ip_header->ip_dst, peer_port, proto, now);
+    }
+    if (sess == NULL){
+      pthread_mutex_unlock(&(shard->lock));
+      return -1;
+    }
+  } else {
+    sess->last_updated = now;
+    if (tcp_header != NULL){
+      sess->state = sr_nat_next_state(sess->state, tcp_header, 1);
+    }
+  }
+  *aux_ext = sess->aux_ext;
+  pthread_mutex_unlock(&(shard->lock));
+  *ip_ext = nat->ext_ips[host / nat->det_hosts];
+  return 0;
+}
+
+/* Next free (pool address, external port / icmp id) in the shard's range.
+   Returns the port and sets *idx, or returns -1 if the shard has run out
+   (on the host's address, in paired mode). The shard lock must be held. */
+static int sr_nat_alloc_aux(struct sr_nat *nat, struct sr_nat_shard *shard,
+                            sr_nat_mapping_type type, uint32_t ip_int,
+                            unsigned int *idx) {
+  unsigned int *next = (type == nat_mapping_icmp) ? &(shard->icmp_id) :
+                       (type == nat_mapping_udp) ? &(shard->udp_id) : &(shard->tcp_id);
+  unsigned short lo = (type == nat_mapping_icmp) ? shard->icmp_lo : shard->tcp_lo;
+  unsigned short hi = (type == nat_mapping_icmp) ? shard->icmp_hi : shard->tcp_hi;
+  unsigned int span = (unsigned int)(hi - lo) + 1;
+  unsigned int total = span * nat->next;
+  unsigned int tries, c, off;
+
+  if (nat->paired || nat->det_mask != 0){
+    *idx = sr_nat_paired_index(nat, ip_int);
+    for (tries = 0; tries < span; tries++) {
+      off = (*next / nat->next + tries) % span;
+      if (!sr_nat_filter_test(nat, *idx, lo + off, type)){
+        *next = ((off + 1) % span) * nat->next;
+        return lo + off;
+      }
+    }
+    return -1;
+  }
+  for (tries = 0; tries < total; tries++) {
+    c = *next % total;
+    *next = (c + 1) % total;
+    *idx = c % nat->next;
+    if (!sr_nat_filter_test(nat, *idx, lo + c / nat->next, type)){
+      return lo + c / nat->next;
+    }
+  }
+  return -1;
+}
+
+/* Allocate an external port/id and link a new mapping into the shard.
+   The shard lock must be held. Returns NULL if the shard is out of ports. */
+static struct sr_nat_mapping *sr_nat_new_mapping(struct sr_nat *nat,
+  struct sr_nat_shard *shard,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+  struct sr_nat_mapping *mapping;
+  unsigned int idx;
+  int aux_ext;
+  time_t now = time(NULL);
+
+  if (nat->det_mask != 0 && type != nat_mapping_icmp){
+    return NULL; /* deterministic TCP and UDP have sessions instead */
+  }
+  if (sr_nat_host_charge(nat, ip_int, now) != 0){
+    return NULL; /* counted in the host table */
+  }
+  if (shard->nmappings >= shard->max_mappings && !sr_nat_evict(nat, shard, NULL, 0)){
+    shard->refused++;
+    sr_nat_host_release(nat, ip_int);
+    return NULL;
+  }
+  aux_ext = sr_nat_alloc_aux(nat, shard, type, ip_int, &idx);
+  if (aux_ext < 0){
+    shard->exhausted++;
+    sr_nat_host_release(nat, ip_int);
+    return NULL;
+  }
+  
+  mapping = sr_slab_alloc(&(shard->map_slab));
+  if (mapping == NULL){
+    sr_nat_host_release(nat, ip_int);
+    return NULL;
+  }
+  memset(mapping, 0, sizeof(struct sr_nat_mapping));
+  mapping->ip_int = ip_int;
+  mapping->ip_ext = nat->ext_ips[idx];
+  mapping->ext_idx = idx;
+  mapping->aux_int = aux_int;
+  mapping->aux_ext = aux_ext;
+  mapping->last_updated = now;
+  mapping->type = type;
+  do {
+    mapping->serial = __atomic_add_fetch(&(nat->serial), 1, __ATOMIC_RELAXED);
+  } while (mapping->serial == 0);
+  mapping->next = shard->mappings;
+  
+  SR_RCU_STORE(shard->mappings, mapping);
+  shard->nmappings++;
+  __atomic_fetch_add(&(nat->ext_mappings[idx]), 1, __ATOMIC_RELAXED);
+  sr_nat_filter_set(nat, mapping, 1);
+  return mapping;
+}
+
 /* Insert a new mapping into the nat's mapping table.
    Actually returns a copy to the new mapping, for thread safety.
+   Returns NULL if the shard has no external ports left.
  */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_shard *shard = sr_nat_shard_int(nat, ip_int, aux_int, type);
+  pthread_mutex_lock(&(shard->lock));
 
   /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = NULL;
-  mapping = sr_nat_lookup_internal(nat, ip_int, aux_int, type);
+  struct sr_nat_mapping *mapping = sr_nat_find_internal(shard, ip_int, aux_int, type);
+  struct sr_nat_mapping *ret_map = NULL;
   
-  if (mapping != NULL){
-    return mapping;
+  if (mapping == NULL){
+    mapping = sr_nat_new_mapping(nat, shard, ip_int, aux_int, type);
   }
-  
-  mapping = malloc(sizeof(struct sr_nat_mapping));
-  mapping->ip_int = ip_int;
-  mapping->conns = NULL;
-  mapping->packet = NULL;
-  mapping->aux_int = aux_int;
-  mapping->last_updated = time(NULL);
-  mapping->type = type;
-  mapping->next = nat->mappings;
-  
-  if (type == nat_mapping_icmp){
-    mapping->aux_ext = nat->icmp_id;
-    nat->icmp_id += 1;
-  } else {
-    mapping->aux_ext = nat->tcp_id;
-    nat->tcp_id += 1;
-    if (nat->tcp_id == 0){
-      nat->tcp_id = 1024;
-    }
+  if (mapping != NULL){
+    ret_map = copy_map(mapping);
   }
-  
-  nat->mappings = mapping;
-  struct sr_nat_mapping *ret_map = copy_map(mapping);
 
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&(shard->lock));
   return ret_map;
 }
 
-void *sr_nat_waiting_mapping(struct sr_nat *nat,
-                             uint32_t ip_ext, 
-                             uint16_t aux_ext, 
-                             sr_nat_mapping_type type, 
-                             void * buf){
+static unsigned int sr_nat_pending_hash(uint32_t ip, uint16_t port, uint16_t aux_ext) {
+  return (sr_nat_conn_hash(ip, port) ^ ((uint32_t)aux_ext * 0x85ebca6b)) 
+         % SR_NAT_PENDING_BUCKETS;
+}
+
+int sr_nat_waiting_mapping(struct sr_nat *nat,
+                           uint32_t ip_ext, 
+                           uint16_t aux_ext, 
+                           sr_nat_mapping_type type, 
+                           void * buf,
+                           const struct sr_meta *meta){
 
-    pthread_mutex_lock(&(nat->lock));
+    struct sr_nat_pending *pend = &(nat->pending);
+    uint16_t port = meta->sport;
+    unsigned int h = sr_nat_pending_hash(ip_ext, port, aux_ext);
+    struct sr_nat_pending_syn *syn;
+    time_t now = time(NULL);
+    int i, ret = 0;
     
-    struct sr_nat_mapping *mapping = NULL;
-    mapping = malloc(sizeof(struct sr_nat_mapping));
-    mapping->ip_ext = ip_ext;
-    mapping->conns = NULL;
-    mapping->aux_ext = aux_ext;
-    mapping->last_updated = time(NULL);
-    mapping->type = type;
-    mapping->packet = malloc(SIZE_ETH+SIZE_IP+SIZE_TCP);
-    memcpy(mapping->packet,buf, SIZE_ETH+SIZE_IP+SIZE_TCP);
-    mapping->next = nat->mappings;
+    pthread_mutex_lock(&(pend->lock));
+    for (i = pend->buckets[h]; i >= 0; i = pend->syns[i].hnext){
+      syn = &(pend->syns[i]);
+      if (syn->ip == ip_ext && syn->port == port && syn->aux_ext == aux_ext &&
+          syn->dst == meta->dst){
+        pthread_mutex_unlock(&(pend->lock));
+        return 0; /* retransmission */
+      }
+    }
     
-    nat->mappings = mapping;
-    pthread_mutex_unlock(&(nat->lock));
-    return NULL;
+    if (pend->count == SR_NAT_PENDING_MAX){
+      if (pend->icmp_second != now){
+        pend->icmp_second = now;
+        pend->icmp_sent = 0;
+      }
+      if (pend->icmp_sent < SR_NAT_PENDING_ICMP_RATE){
+        pend->icmp_sent++;
+        pend->answered++;
+        ret = 1;
+      } else {
+        pend->dropped++;
+        ret = -1;
+      }
+      pthread_mutex_unlock(&(pend->lock));
+      return ret;
+    }
+    
+    i = (pend->head + pend->count) % SR_NAT_PENDING_MAX;
+    syn = &(pend->syns[i]);
+    syn->ip = ip_ext;
+    syn->port = port;
+    syn->aux_ext = aux_ext;
+    syn->dst = meta->dst;
+    syn->added = now;
+    memcpy(syn->frame, buf, (meta->end < SR_NAT_PENDING_FRAME) ?
+                            meta->end : SR_NAT_PENDING_FRAME);
+    syn->hnext = pend->buckets[h];
+    pend->buckets[h] = i;
+    pend->count++;
+    pthread_mutex_unlock(&(pend->lock));
+    return 0;
+}
+
+/* Release held SYNs older than SR_NAT_PENDING_HOLD, oldest first. If the
+   internal host hasn't opened the matching connection meanwhile, the
+   sender gets port unreachable (through the slow path). */
+static void sr_nat_pending_expire(struct sr_instance *sr, time_t curtime) {
+  struct sr_nat *nat = &(sr->nat);
+  struct sr_nat_pending *pend = &(nat->pending);
+  struct sr_nat_pending_syn *syn;
+  struct sr_nat_shard *shard;
+  struct sr_nat_mapping *targ_map;
+  int *link;
+  int found;
+  long host;
+
+  pthread_mutex_lock(&(pend->lock));
+  while (pend->count > 0){
+    syn = &(pend->syns[pend->head]);
+    if (difftime(curtime, syn->added) < SR_NAT_PENDING_HOLD){
+      break;
+    }
+    
+    if (nat->det_mask != 0){
+      host = sr_nat_det_ext_host(nat, syn->dst, syn->aux_ext);
+      found = 0;
+      if (host >= 0){
+        shard = sr_nat_det_shard(nat, host);
+        pthread_mutex_lock(&(shard->lock));
+        found = (sr_nat_det_find_in(shard, nat->det_net | htonl(host), syn->aux_ext,
+                                    syn->ip, syn->port, ip_protocol_tcp) != NULL);
+        pthread_mutex_unlock(&(shard->lock));
+      }
+    } else {
+      shard = sr_nat_shard_ext(nat, syn->aux_ext, nat_mapping_tcp);
+      pthread_mutex_lock(&(shard->lock));
+      targ_map = sr_nat_find_external(shard, syn->dst, syn->aux_ext, nat_mapping_tcp);
+      found = (targ_map != NULL && sr_nat_find_conn(targ_map, syn->ip, syn->port) != NULL);
+      pthread_mutex_unlock(&(shard->lock));
+    }
+    if (!found){
+      sr_slowpath_icmp(sr, syn->frame, SR_NAT_PENDING_FRAME, 3, 3, 0);
+    }
+
+    link = &(pend->buckets[sr_nat_pending_hash(syn->ip, syn->port, syn->aux_ext)]);
+    while (*link != (int)pend->head){
+      link = &(pend->syns[*link].hnext);
+    }
+    *link = syn->hnext;
+    pend->head = (pend->head + 1) % SR_NAT_PENDING_MAX;
+    pend->count--;
+  }
+  pthread_mutex_unlock(&(pend->lock));
+}
+
+/* TCP state machine step for a segment seen in one direction */
+static uint8_t sr_nat_next_state(uint8_t state, sr_tcp_hdr_t *tcp_header,
+                                 unsigned char internal){
+    if (tcp_header->rst){
+        return TIME_W;
+    }
+    switch (state)
+    {
+       case SYN_SENT :
+          if(tcp_header->syn && tcp_header->ack && !internal)
+             return SYN_REC;
+       break;
+       case SYN_REC :
+          if(tcp_header->fin)
+             return internal ? FIN_INT : FIN_EXT;
+          /* the handshake's final ACK (or a simultaneous-open SYN+ACK) */
+          if(tcp_header->ack && internal)
+             return ESTAB1;
+       break;
+       case ESTAB1 :
+          if(tcp_header->fin)
+             return internal ? FIN_INT : FIN_EXT;
+          if(tcp_header->ack && !internal)
+             return ESTAB2;
+       break;
+       case ESTAB2 :
+          if(tcp_header->fin)
+             return internal ? FIN_INT : FIN_EXT;
+       break; 
+       case FIN_INT :
+          if(tcp_header->fin && !internal)
+             return CLOSING_EXT;
+       break;
+       case FIN_EXT :
+          if(tcp_header->fin && internal)
+             return CLOSING_INT;
+       break;
+       case CLOSING_INT :
+          /* the ACK of the second FIN, from the side that didn't send it;
+             the internal side's late ACKs of the first FIN don't count */
+          if(tcp_header->ack && !tcp_header->fin && !internal)
+             return TIME_W;
+       break;
+       case CLOSING_EXT :
+          if(tcp_header->ack && !tcp_header->fin && internal)
+             return TIME_W;
+       break;
+       case TIME_W :
+          /* the internal host reopens the same 4-tuple */
+          if(tcp_header->syn && !tcp_header->ack && internal)
+             return SYN_SENT;
+       break;
+    }
+    return state;
+}
+
+/* Advance con's state. Inbound readers do this without the shard lock, so
+   every writer goes through a CAS. Reaching ESTAB2 protects the mapping
+   from eviction. */
+static void sr_nat_advance_state(struct sr_nat_mapping *maps,
+                                 struct sr_nat_connection *con,
+                                 sr_tcp_hdr_t *tcp_header,
+                                 unsigned char internal){
+    uint8_t old = __atomic_load_n(&(con->state), __ATOMIC_ACQUIRE);
+    uint8_t new;
+    do {
+        new = sr_nat_next_state(old, tcp_header, internal);
+        if (new == old){
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&(con->state), &old, new, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if (new == ESTAB2){
+        __atomic_store_n(&(maps->estab), 1, __ATOMIC_RELAXED);
+    }
 }
 
+/* Refresh (and, for an internal SYN, create) the connection the TCP segment
+   in packet, parsed into meta, belongs to. Internal segments take the shard
+   lock; external ones never do. You must free the returned structure if it
+   is not NULL. */
 struct sr_nat_connection *sr_nat_update_connection(struct sr_nat *nat,
-                                                   void * buf,
+                                                   uint8_t *packet,
+                                                   const struct sr_meta *meta,
                                                    unsigned char internal){ 
-    pthread_mutex_lock(&(nat->lock));
-    sr_ip_hdr_t *ip_header = (sr_ip_hdr_t *)buf;  
-    sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(buf+SIZE_IP);
+    sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(packet+meta->l4);
+    struct sr_nat_shard *shard;
+    struct sr_nat_mapping *maps;
+    struct sr_epoch_slot *rcu = NULL;
+    uint32_t peer = (internal ? meta->dst : meta->src);
+    uint16_t peer_port = (internal ? meta->dport : meta->sport);
+    time_t now = time(NULL);
+    
+    if (meta->proto != ip_protocol_tcp || !(meta->flags & SR_META_L4)){
+        return NULL;
+    }
+    if (internal){
+        shard = sr_nat_shard_int(nat, meta->src, meta->sport, nat_mapping_tcp);
+        pthread_mutex_lock(&(shard->lock));
+        maps = sr_nat_find_internal(shard, meta->src, meta->sport, nat_mapping_tcp);
+    } else {
+        shard = sr_nat_shard_ext(nat, ntohs(meta->dport), nat_mapping_tcp);
+        rcu = sr_epoch_enter(&(nat->epoch));
+        maps = sr_nat_find_external(shard, meta->dst, ntohs(meta->dport),
+                                    nat_mapping_tcp);
+    }
     /* handle lookup here, malloc and assign to copy. */
     struct sr_nat_connection *con = NULL;
     struct sr_nat_connection *copy = NULL;
-    struct sr_nat_mapping *maps = nat->mappings;
-    while(maps != NULL){
-        if(internal && 
-           maps->ip_int == ip_header->ip_src && 
-           maps->aux_int == tcp_header->tcp_src &&
-           maps->type == nat_mapping_tcp){
-             fprintf(stderr,"\t got map\n");
-            con = maps->conns;
-            break;
-        } else if(!internal &&  
-                  maps->aux_ext == ntohs(tcp_header->tcp_dst) &&
-                  maps->type == nat_mapping_tcp){
-            fprintf(stderr,"\t got map\n");
-            con = maps->conns;
-            break;
-        }
-        maps = maps->next;
+    if (maps != NULL){
+        con = sr_nat_find_conn(maps, peer, peer_port);
     }
-  
-    while (con != NULL){
-       if(internal && con->conn_ip == ip_header->ip_dst){
-         fprintf(stderr,"\t got con\n");
-          copy = con;
-          break;
-       } else if(!internal && con->conn_ip == ip_header->ip_src){
-         fprintf(stderr,"\t got con\n");
-          copy = con;
-          break;
-       }
-       con = con->next;
+    
+    if (maps!= NULL && con == NULL && internal && tcp_header->syn){
+       fprintf(stderr,"\t creating con\n");
+       con = sr_nat_new_conn(nat, shard, maps, peer, peer_port, now);
+       sr_nat_touch(&(maps->last_updated), now);
+    } else if (con != NULL){  
+       sr_nat_touch(&(maps->last_updated), now);
+       sr_nat_touch(&(con->last_updated), now);
+       sr_nat_advance_state(maps, con, tcp_header, internal);
     }
     
-    if (maps!= NULL && copy == NULL && internal && tcp_header->syn){
-      fprintf(stderr,"\t creating con\n");
-       copy = malloc(sizeof(struct sr_nat_connection*));
-       copy->conn_ip = (internal ? ip_header->ip_dst : ip_header->ip_src);
-       copy->state = SYN_SENT;
-       maps->last_updated = time(NULL);
-       copy->last_updated = time(NULL);
-       con = malloc(sizeof(struct sr_nat_connection));
-       memcpy(con,copy,sizeof(struct sr_nat_connection));
-       con->next = maps->conns;
-       maps->conns = con;
-    } else if (copy != NULL){  
-       maps->last_updated = time(NULL);
-       copy->last_updated = time(NULL);
-       switch (copy->state)
-       {
-          case SYN_SENT :
-             if(tcp_header->syn && tcp_header->ack && !internal)
-                copy->state = SYN_REC;
-          break;
-          case SYN_REC :
-             if(tcp_header->syn && tcp_header->ack && internal)
-                copy->state = ESTAB1;
-          break;
-          case ESTAB1 :
-             if(tcp_header->ack && !internal)
-                copy->state = ESTAB2;
-          break;
-          case ESTAB2 :
-             if(tcp_header->fin || tcp_header->rst)
-                copy->state = CLOSING;
-          break; 
-       }
-       con = copy;
+    if (con != NULL){
        copy = malloc(sizeof(struct sr_nat_connection));
        memcpy(copy,con,sizeof(struct sr_nat_connection));
     }
     
-    pthread_mutex_unlock(&(nat->lock));
+    if (internal){
+        pthread_mutex_unlock(&(shard->lock));
+    } else {
+        sr_epoch_exit(rcu);
+    }
     return copy;
 }
 
+/* Outbound half of sr_nat_translate_outbound for mappings: find or create
+   the mapping (and, for a SYN, the connection) and step the TCP state.
+   Sets the external address and port/id, or returns -1. */
+static int sr_nat_map_outbound(struct sr_nat *nat, sr_ip_hdr_t *ip_header,
+                               sr_tcp_hdr_t *tcp_header, uint16_t aux_int,
+                               sr_nat_mapping_type type, uint32_t *ip_ext,
+                               uint16_t *aux_ext){
+    struct sr_nat_shard *shard;
+    struct sr_nat_mapping *maps;
+    struct sr_nat_connection *con;
+    time_t now;
+
+    now = time(NULL);
+    shard = sr_nat_shard_int(nat, ip_header->ip_src, aux_int, type);
+    pthread_mutex_lock(&(shard->lock));
+    maps = sr_nat_find_internal(shard, ip_header->ip_src, aux_int, type);
+    if (maps == NULL){
+        maps = sr_nat_new_mapping(nat, shard, ip_header->ip_src, aux_int, type);
+        if (maps == NULL){
+            pthread_mutex_unlock(&(shard->lock));
+            return -1;
+        }
+    }
+    sr_nat_touch(&(maps->last_updated), now);
+    if (tcp_header != NULL){
+        con = sr_nat_find_conn(maps, ip_header->ip_dst, tcp_header->tcp_dst);
+        if (con == NULL && tcp_header->syn){
+            if (sr_nat_new_conn(nat, shard, maps, ip_header->ip_dst, 
+                                tcp_header->tcp_dst, now) == NULL){
+                pthread_mutex_unlock(&(shard->lock));
+                return -1;
+            }
+        } else if (con != NULL){
+            sr_nat_touch(&(con->last_updated), now);
+            sr_nat_advance_state(maps, con, tcp_header, 1);
+        }
+    }
+    *aux_ext = maps->aux_ext;
+    *ip_ext = maps->ip_ext;
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+}
+
+/* Fused outbound path: one probe and one critical section for find-or-create
+   of the mapping and connection and the state machine step, then an
+   incremental rewrite of the headers. */
+int sr_nat_translate_outbound(struct sr_nat *nat,
+                              uint8_t *packet,
+                              const struct sr_meta *meta){
+    sr_ip_hdr_t *ip_header = (sr_ip_hdr_t *)(packet+meta->l3);
+    sr_tcp_hdr_t *tcp_header = NULL;
+    sr_udp_hdr_t *udp_header = NULL;
+    sr_icmp_t8_hdr_t *icmp_header = NULL;
+    sr_nat_mapping_type type;
+    uint16_t aux_int = meta->sport, aux_ext;
+    uint32_t ip_ext;
+    int ret;
+
+    if (!(meta->flags & SR_META_L4)){
+        return -1;
+    } else if (meta->proto == ip_protocol_tcp){
+        tcp_header = (sr_tcp_hdr_t *)(packet+meta->l4);
+        type = nat_mapping_tcp;
+    } else if (meta->proto == ip_protocol_udp){
+        udp_header = (sr_udp_hdr_t *)(packet+meta->l4);
+        type = nat_mapping_udp;
+    } else if (meta->proto == ip_protocol_icmp){
+        icmp_header = (sr_icmp_t8_hdr_t *)(packet+meta->l4);
+        type = nat_mapping_icmp;
+    } else {
+        return -1;
+    }
+
+    if (nat->det_mask != 0 && type != nat_mapping_icmp){
+        ret = sr_nat_det_outbound(nat, ip_header, tcp_header, aux_int,
+                                  meta->dport, &ip_ext, &aux_ext);
+    } else {
+        ret = sr_nat_map_outbound(nat, ip_header, tcp_header, aux_int, type,
+                                  &ip_ext, &aux_ext);
+    }
+    if (ret != 0){
+        return -1;
+    }
+
+    if (tcp_header != NULL){
+        /* the pseudo header covers ip_src, so the TCP sum sees both changes */
+        tcp_header->tcp_sum = cksum_update32(tcp_header->tcp_sum, 
+                                             ip_header->ip_src, ip_ext);
+        tcp_header->tcp_sum = cksum_update16(tcp_header->tcp_sum,
+                                             tcp_header->tcp_src, htons(aux_ext));
+        tcp_header->tcp_src = htons(aux_ext);
+    } else if (udp_header != NULL){
+        /* a zero checksum was never computed and must stay zero */
+        if (udp_header->udp_sum != 0){
+            udp_header->udp_sum = cksum_update32(udp_header->udp_sum,
+                                                 ip_header->ip_src, ip_ext);
+            udp_header->udp_sum = cksum_update16(udp_header->udp_sum,
+                                                 udp_header->udp_src, htons(aux_ext));
+        }
+        udp_header->udp_src = htons(aux_ext);
+    } else {
+        icmp_header->icmp_sum = cksum_update16(icmp_header->icmp_sum,
+                                               icmp_header->icmp_id, aux_ext);
+        icmp_header->icmp_id = aux_ext;
+    }
+    ip_header->ip_sum = cksum_update32(ip_header->ip_sum, ip_header->ip_src, ip_ext);
+    ip_header->ip_src = ip_ext;
+    return 0;
+}
+
+/* Inbound half of sr_nat_translate_inbound in deterministic mode: the
+   host comes from the address and port, the session from its shard. Sets
+   the internal address and port, or returns -1. */
+static int sr_nat_det_inbound(struct sr_nat *nat, sr_ip_hdr_t *ip_header,
+                              sr_tcp_hdr_t *tcp_header, uint16_t aux_ext,
+                              uint16_t peer_port, uint32_t *ip_int,
+                              uint16_t *aux_int){
+    long host = sr_nat_det_ext_host(nat, ip_header->ip_dst, aux_ext);
+    uint8_t proto = (tcp_header != NULL) ? ip_protocol_tcp : ip_protocol_udp;
+    struct sr_nat_shard *shard;
+    struct sr_nat_det_session *sess;
+
+    if (host < 0){
+        return -1;
+    }
+    *ip_int = nat->det_net | htonl(host);
+    shard = sr_nat_det_shard(nat, host);
+    pthread_mutex_lock(&(shard->lock));
+    sess = sr_nat_det_find_in(shard, *ip_int, aux_ext, ip_header->ip_src,
+                              peer_port, proto);
+    if (sess == NULL){
+        pthread_mutex_unlock(&(shard->lock));
+        return -1;
+    }
+    sess->last_updated = time(NULL);
+    if (tcp_header != NULL){
+        sess->state = sr_nat_next_state(sess->state, tcp_header, 0);
+    }
+    *aux_int = sess->aux_int;
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+}
+
+/* Inbound counterpart of the fused path, for TCP and UDP. A mapping is
+   read, its timestamp refreshed and, for TCP, its connection's state
+   stepped inside one epoch section; then the headers are rewritten
+   incrementally with no lock and no copy. */
+int sr_nat_translate_inbound(struct sr_nat *nat,
+                             uint8_t *packet,
+                             const struct sr_meta *meta){
+    sr_ip_hdr_t *ip_header = (sr_ip_hdr_t *)(packet+meta->l3);
+    sr_udp_hdr_t *udp_header = NULL;
+    sr_tcp_hdr_t *tcp_header = NULL;
+    struct sr_nat_mapping *maps;
+    struct sr_nat_connection *con;
+    struct sr_epoch_slot *rcu;
+    sr_nat_mapping_type type;
+    uint32_t ip_int;
+    uint16_t aux_ext = ntohs(meta->dport), aux_int;
+    time_t now;
+
+    if (!(meta->flags & SR_META_L4)){
+        return -1;
+    } else if (meta->proto == ip_protocol_udp){
+        udp_header = (sr_udp_hdr_t *)(packet+meta->l4);
+        type = nat_mapping_udp;
+    } else if (meta->proto == ip_protocol_tcp){
+        tcp_header = (sr_tcp_hdr_t *)(packet+meta->l4);
+        type = nat_mapping_tcp;
+    } else {
+        return -1;
+    }
+
+    if (nat->det_mask != 0){
+        if (sr_nat_det_inbound(nat, ip_header, tcp_header, aux_ext, meta->sport,
+                               &ip_int, &aux_int) != 0){
+            return -1;
+        }
+    } else {
+        if (!sr_nat_maybe_external(nat, meta->dst, aux_ext, type)){
+            return -1;
+        }
+        now = time(NULL);
+        rcu = sr_epoch_enter(&(nat->epoch));
+        maps = sr_nat_find_external(sr_nat_shard_ext(nat, aux_ext, type),
+                                    meta->dst, aux_ext, type);
+        if (maps == NULL){
+            sr_epoch_exit(rcu);
+            return -1;
+        }
+        sr_nat_touch(&(maps->last_updated), now);
+        /* a segment with no connection is still let through to the host,
+           which answers it (with a RST if it has to) */
+        if (tcp_header != NULL &&
+            (con = sr_nat_find_conn(maps, meta->src, meta->sport)) != NULL){
+            sr_nat_touch(&(con->last_updated), now);
+            sr_nat_advance_state(maps, con, tcp_header, 0);
+        }
+        ip_int = maps->ip_int;
+        aux_int = maps->aux_int;
+        sr_epoch_exit(rcu);
+    }
+
+    if (tcp_header != NULL){
+        tcp_header->tcp_sum = cksum_update32(tcp_header->tcp_sum,
+                                             ip_header->ip_dst, ip_int);
+        tcp_header->tcp_sum = cksum_update16(tcp_header->tcp_sum,
+                                             tcp_header->tcp_dst, aux_int);
+        tcp_header->tcp_dst = aux_int;
+    } else {
+        if (udp_header->udp_sum != 0){
+            udp_header->udp_sum = cksum_update32(udp_header->udp_sum,
+                                                 ip_header->ip_dst, ip_int);
+            udp_header->udp_sum = cksum_update16(udp_header->udp_sum,
+                                                 udp_header->udp_dst, aux_int);
+        }
+        udp_header->udp_dst = aux_int;
+    }
+    ip_header->ip_sum = cksum_update32(ip_header->ip_sum, ip_header->ip_dst, ip_int);
+    ip_header->ip_dst = ip_int;
+    return 0;
+}
+
+static unsigned int sr_nat_flow_hash(const struct sr_nat_flow_key *key) {
+  uint32_t h = sr_nat_conn_hash(key->src, key->sport) ^
+               sr_nat_conn_hash(key->dst ^ key->dir, key->dport) * 0x9e3779b1;
+  return (h ^ (h >> 16)) & (SR_NAT_FLOW_SLOTS - 1);
+}
+
+static int sr_nat_flow_key_eq(const struct sr_nat_flow_key *a,
+                              const struct sr_nat_flow_key *b) {
+  return a->src == b->src && a->dst == b->dst && a->sport == b->sport &&
+         a->dport == b->dport && a->dir == b->dir;
+}
+
+/* The flow key of packet, if it may take the cache: a whole TCP segment
+   with no handshake flags that can be forwarded. Returns 0 if not. */
+static int sr_nat_flow_key_of(struct sr_nat *nat, const uint8_t *packet,
+                              const struct sr_meta *meta, struct sr_if *rec_iface,
+                              struct sr_nat_flow_key *key) {
+  const sr_ip_hdr_t *ip_header = (const sr_ip_hdr_t *)(packet+meta->l3);
+  const sr_tcp_hdr_t *tcp_header = (const sr_tcp_hdr_t *)(packet+meta->l4);
+
+  if (nat->flows == NULL || rec_iface->nat_role == SR_IF_ROLE_NONE ||
+      meta->proto != ip_protocol_tcp || !(meta->flags & SR_META_L4) ||
+      ip_header->ip_ttl <= 1 || tcp_header->syn || tcp_header->fin ||
+      tcp_header->rst){
+    return 0;
+  }
+  key->src = meta->src;
+  key->dst = meta->dst;
+  key->sport = meta->sport;
+  key->dport = meta->dport;
+  key->dir = rec_iface->nat_role;
+  return 1;
+}
+
+int sr_nat_flow_forward(struct sr_instance *sr, uint8_t *packet,
+                        unsigned int len, const struct sr_meta *meta,
+                        struct sr_if *rec_iface) {
+  struct sr_nat *nat = &(sr->nat);
+  sr_ip_hdr_t *ip_header = (sr_ip_hdr_t *)(packet+meta->l3);
+  sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(packet+meta->l4);
+  struct sr_nat_flow_key key;
+  struct sr_nat_flow *flow, snap;
+  struct sr_nat_connection *con;
+  struct sr_epoch_slot *rcu;
+  struct sr_if *iface;
+  unsigned int seq;
+  uint32_t now;
+
+  if (!sr_nat_flow_key_of(nat, packet, meta, rec_iface, &key)){
+    return 0;
+  }
+
+  flow = &(nat->flows[sr_nat_flow_hash(&key)]);
+  seq = __atomic_load_n(&(flow->seq), __ATOMIC_ACQUIRE);
+  if (seq & 1){
+    __atomic_fetch_add(&(nat->flow_misses), 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  memcpy(&snap, flow, sizeof(snap));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (seq != __atomic_load_n(&(flow->seq), __ATOMIC_RELAXED) ||
+      !sr_nat_flow_key_eq(&(snap.key), &key) ||
+      snap.rt_gen != __atomic_load_n(&(sr->dcache.rt_gen), __ATOMIC_ACQUIRE) ||
+      snap.arp_seq != __atomic_load_n(&(sr->cache.entries[snap.arp_slot].seq),
+                                      __ATOMIC_ACQUIRE) ||
+      (iface = sr_get_interface_by_index(sr, snap.ifindex)) == NULL){
+    __atomic_fetch_add(&(nat->flow_misses), 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  /* snap.maps may have been removed and its memory reused since the fill.
+     Reading it is still safe: slab arenas are never unmapped while the NAT
+     is up, and sr_nat_remove clears serial before the mapping goes back to
+     the slab, so a changed serial catches both removal and reuse. The
+     connection is looked up again under the epoch rather than trusted. */
+  rcu = sr_epoch_enter(&(nat->epoch));
+  if (__atomic_load_n(&(snap.maps->serial), __ATOMIC_ACQUIRE) != snap.serial ||
+      (con = (key.dir == SR_IF_ROLE_INSIDE) ?
+             sr_nat_find_conn(snap.maps, key.dst, key.dport) :
+             sr_nat_find_conn(snap.maps, key.src, key.sport)) != snap.con ||
+      __atomic_load_n(&(con->state), __ATOMIC_ACQUIRE) != ESTAB2){
+    sr_epoch_exit(rcu);
+    __atomic_fetch_add(&(nat->flow_misses), 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  now = time(NULL);
+  if (snap.maps->last_updated != now){
+    sr_nat_touch(&(snap.maps->last_updated), now);
+  }
+  if (con->last_updated != now){
+    sr_nat_touch(&(con->last_updated), now);
+  }
+  sr_epoch_exit(rcu);
+  __atomic_fetch_add(&(nat->flow_hits), 1, __ATOMIC_RELAXED);
+
+  if (key.dir == SR_IF_ROLE_INSIDE){
+    ip_header->ip_src = snap.ip;
+    tcp_header->tcp_src = snap.port;
+  } else {
+    ip_header->ip_dst = snap.ip;
+    tcp_header->tcp_dst = snap.port;
+  }
+  ip_header->ip_ttl--;
+  ip_header->ip_sum = cksum_apply(ip_header->ip_sum, snap.ip_delta);
+  tcp_header->tcp_sum = cksum_apply(tcp_header->tcp_sum, snap.tcp_delta);
+  memcpy(packet, snap.eth, SIZE_ETH);
+  sr_send_packet(sr, packet, len, iface->name);
+  return 1;
+}
+
+void sr_nat_flow_fill(struct sr_instance *sr, const struct sr_nat_flow_key *key,
+                      struct sr_rt *rt) {
+  struct sr_nat *nat = &(sr->nat);
+  struct sr_nat_shard *shard;
+  struct sr_nat_mapping *maps;
+  struct sr_nat_connection *con = NULL;
+  struct sr_epoch_slot *rcu = NULL;
+  struct sr_nat_flow *flow, fill;
+  struct sr_arpentry arp;
+  struct sr_if *iface;
+  sr_ethernet_hdr_t *eth;
+  uint32_t old_ip;
+  uint16_t old_port;
+  unsigned int seq;
+
+  if (nat->flows == NULL || (iface = sr_get_interface(sr, rt->interface)) == NULL){
+    return;
+  }
+  memset(&fill, 0, sizeof(fill));
+  fill.key = *key;
+  fill.rt_gen = __atomic_load_n(&(sr->dcache.rt_gen), __ATOMIC_ACQUIRE);
+
+  if (key->dir == SR_IF_ROLE_INSIDE){
+    shard = sr_nat_shard_int(nat, key->src, key->sport, nat_mapping_tcp);
+    pthread_mutex_lock(&(shard->lock));
+    maps = sr_nat_find_internal(shard, key->src, key->sport, nat_mapping_tcp);
+    if (maps != NULL){
+      con = sr_nat_find_conn(maps, key->dst, key->dport);
+      fill.ip = maps->ip_ext;
+      fill.port = htons(maps->aux_ext);
+    }
+    old_ip = key->src;
+    old_port = key->sport;
+  } else {
+    shard = sr_nat_shard_ext(nat, ntohs(key->dport), nat_mapping_tcp);
+    rcu = sr_epoch_enter(&(nat->epoch));
+    maps = sr_nat_find_external(shard, key->dst, ntohs(key->dport), nat_mapping_tcp);
+    if (maps != NULL){
+      con = sr_nat_find_conn(maps, key->src, key->sport);
+      fill.ip = maps->ip_int;
+      fill.port = maps->aux_int;
+    }
+    old_ip = key->dst;
+    old_port = key->dport;
+  }
+  if (con != NULL && __atomic_load_n(&(con->state), __ATOMIC_ACQUIRE) == ESTAB2){
+    fill.maps = maps;
+    fill.serial = __atomic_load_n(&(maps->serial), __ATOMIC_ACQUIRE);
+    fill.con = con;
+  }
+  if (rcu != NULL){
+    sr_epoch_exit(rcu);
+  } else {
+    pthread_mutex_unlock(&(shard->lock));
+  }
+  if (fill.con == NULL || fill.serial == 0){
+    return;
+  }
+
+  /* the TTL drops by one: its word (with the protocol) loses 0x0100 */
+  fill.ip_delta = cksum_delta32(old_ip, fill.ip) + htons(0xfeff);
+  fill.tcp_delta = cksum_delta32(old_ip, fill.ip) + cksum_delta32(old_port, fill.port);
+
+  fill.arp_slot = sr_arpcache_find_slot(&(sr->cache), rt->gw.s_addr, &arp);
+  if (fill.arp_slot < 0){
+    return;
+  }
+  fill.arp_seq = arp.seq;
+  fill.ifindex = iface->index;
+  memcpy(fill.eth, iface->tmpl.eth, SIZE_ETH);
+  eth = (sr_ethernet_hdr_t *)fill.eth;
+  memcpy(eth->ether_dhost, arp.mac, ETHER_ADDR_LEN);
+
+  flow = &(nat->flows[sr_nat_flow_hash(key)]);
+  seq = __atomic_load_n(&(flow->seq), __ATOMIC_RELAXED);
+  if ((seq & 1) || !__atomic_compare_exchange_n(&(flow->seq), &seq, seq + 1, 0,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+    return; /* another thread is filling this slot */
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  fill.seq = seq + 1;
+  memcpy(flow, &fill, sizeof(fill));
+  __atomic_store_n(&(flow->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+const struct sr_nat_flow *sr_nat_flow_prefetch(struct sr_instance *sr,
+                                               const uint8_t *packet,
+                                               const struct sr_meta *meta,
+                                               struct sr_if *rec_iface) {
+  struct sr_nat_flow_key key;
+  const struct sr_nat_flow *flow;
+
+  if (!sr_nat_flow_key_of(&(sr->nat), packet, meta, rec_iface, &key)){
+    return NULL;
+  }
+  flow = &(sr->nat.flows[sr_nat_flow_hash(&key)]);
+  __builtin_prefetch(flow);
+  return flow;
+}
+
+void sr_nat_flow_prefetch_next(struct sr_instance *sr,
+                               const struct sr_nat_flow *flow) {
+  /* racy reads, but only hints: forward checks everything under the
+     seqlock and the epoch, and a prefetch of a stale pointer can't fault */
+  const volatile struct sr_nat_flow *v = flow;
+  int slot = v->arp_slot;
+
+  if (v->key.dir == 0){
+    return;
+  }
+  __builtin_prefetch(v->maps);
+  __builtin_prefetch(v->con);
+  if (slot >= 0 && slot < SR_ARPCACHE_SZ){
+    __builtin_prefetch(&(sr->cache.entries[slot]));
+  }
+}
+
+/* Copies only; live mappings go through sr_nat_release_mapping */
 void * sr_free_mapping(struct sr_nat_mapping * map){
-   if (map->conns != NULL){
-      struct sr_nat_connection *con = map->conns;
-      for (con = map->conns; con != NULL; con = con->next) {
-          free(con);
-      }
-   }
-   if (map->packet != NULL){
-     free(map->packet);
-   }
    free(map);
    return NULL;
-}
\ No newline at end of file
+}
+
+void sr_nat_print_stats(struct sr_nat *nat, FILE *out){
+   unsigned long mappings = 0, conns = 0, max_mappings = 0, max_conns = 0;
+   unsigned long evicted = 0, refused = 0, exhausted = 0;
+   struct sr_nat_host top[SR_NAT_HOST_TOP];
+   int i, j, ntop = 0;
+   
+   for (i = 0; i < SR_NAT_SHARDS; i++) {
+     struct sr_nat_shard *shard = &(nat->shards[i]);
+     pthread_mutex_lock(&(shard->lock));
+     mappings += shard->nmappings;
+     conns += shard->nconns;
+     max_mappings += shard->max_mappings;
+     max_conns += shard->max_conns;
+     evicted += shard->evicted;
+     refused += shard->refused;
+     exhausted += shard->exhausted;
+     pthread_mutex_unlock(&(shard->lock));
+   }
+   fprintf(out, "NAT: %lu/%lu mappings, %lu/%lu connections, "
+           "%lu evicted, %lu refused, %lu out of ports\n", 
+           mappings, max_mappings, conns, max_conns, evicted, refused, exhausted);
+   pthread_mutex_lock(&(nat->pending.lock));
+   fprintf(out, "NAT: %u/%u pending SYNs, %lu answered, %lu dropped when full\n",
+           nat->pending.count, SR_NAT_PENDING_MAX, 
+           nat->pending.answered, nat->pending.dropped);
+   pthread_mutex_unlock(&(nat->pending.lock));
+
+   fprintf(out, "NAT: %u external addresses%s\n", nat->next,
+           nat->paired ? ", paired" : "");
+   if (nat->det_mask != 0){
+     fprintf(out, "NAT: deterministic, %u hosts per address, %u ports each, "
+             "%lu dropped from outside the prefix\n", nat->det_hosts, nat->det_block,
+             __atomic_load_n(&(nat->det_dropped), __ATOMIC_RELAXED));
+   }
+   if (nat->flows != NULL){
+     fprintf(out, "NAT: flow cache %lu hits, %lu misses\n",
+             __atomic_load_n(&(nat->flow_hits), __ATOMIC_RELAXED),
+             __atomic_load_n(&(nat->flow_misses), __ATOMIC_RELAXED));
+   }
+   for (j = 0; j < (int)nat->next; j++) {
+     struct in_addr addr;
+     char name[INET_ADDRSTRLEN];
+     addr.s_addr = nat->ext_ips[j];
+     inet_ntop(AF_INET, &addr, name, sizeof(name));
+     fprintf(out, "NAT:   %-15s %6lu mappings\n", name,
+             __atomic_load_n(&(nat->ext_mappings[j]), __ATOMIC_RELAXED));
+   }
+
+   /* keep the SR_NAT_HOST_TOP biggest, sorted, by insertion */
+   pthread_mutex_lock(&(nat->hosts.lock));
+   for (i = 0; i < SR_NAT_HOSTS; i++) {
+     struct sr_nat_host *host = &(nat->hosts.hosts[i]);
+     if (host->ip == 0){
+       continue;
+     }
+     for (j = ntop; j > 0 && top[j-1].nmappings < host->nmappings; j--) {
+       if (j < SR_NAT_HOST_TOP){
+         top[j] = top[j-1];
+       }
+     }
+     if (j < SR_NAT_HOST_TOP){
+       top[j] = *host;
+       if (ntop < SR_NAT_HOST_TOP){
+         ntop++;
+       }
+     }
+   }
+   fprintf(out, "NAT: %u/%u hosts, limit %u mappings and %u new/s each, "
+           "%lu refused, %lu refused when full\n",
+           nat->hosts.count, SR_NAT_HOSTS, nat->max_host_mappings, 
+           nat->host_rate, nat->hosts.refused, nat->hosts.full);
+   pthread_mutex_unlock(&(nat->hosts.lock));
+   for (j = 0; j < ntop; j++) {
+     struct in_addr addr;
+     char name[INET_ADDRSTRLEN];
+     addr.s_addr = top[j].ip;
+     inet_ntop(AF_INET, &addr, name, sizeof(name));
+     fprintf(out, "NAT:   %-15s %6u mappings, %lu refused\n",
+             name, top[j].nmappings, top[j].refused);
+   }
+}
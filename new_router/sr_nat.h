@@ -5,60 +5,351 @@
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdio.h>
+
+#include "sr_epoch.h"
+#include "sr_slab.h"
+#include "sr_protocol.h"
+
+struct sr_instance;
+struct sr_if;
+struct sr_rt;
+struct sr_meta;
 
 typedef enum {
   nat_mapping_icmp,
   nat_mapping_tcp,
+  nat_mapping_udp,
   nat_mapping_waiting
-  /* nat_mapping_udp, */
 } sr_nat_mapping_type;
 
 struct sr_nat_connection {
   /* add TCP connection state data members here */
-  uint32_t conn_ip;
+  uint32_t conn_ip;   /* remote ip */
+  uint16_t conn_port; /* remote port */
   uint8_t state;
 /*#define LISTEN 1*/
 #define SYN_SENT 2
 #define SYN_REC 3
 #define ESTAB1 4
 #define ESTAB2 5
-/*#define FIN_W1 6
-#define FIN_W2 7
-#define CLOSE_W 7*/
-#define CLOSING 8
-/*#define LAST_ACK 9
-#define TIME_W 10
-#define CLOSED 0*/
-  /*uint8_t ext_flags;
-  uint8_t int_flags;*/
-  time_t last_updated; /* use to timeout mappings */
-  struct sr_nat_connection *next;
+#define FIN_INT 6  /* internal side sent the first FIN */
+#define FIN_EXT 7  /* external side sent the first FIN */
+#define CLOSING_INT 8  /* both sides sent FIN, the internal side second */
+#define CLOSING_EXT 9  /* both sides sent FIN, the external side second */
+#define TIME_W 10  /* last ACK or a RST seen, held for SR_NAT_TCP_TIME_WAIT */
+/*#define CLOSED 0*/
+  uint32_t last_updated; /* time(), use to timeout mappings */
+};
+
+/* A TCP mapping indexes its connections by (remote ip, remote port). The
+   first two sit inline in the mapping (the key is read from the connection
+   itself); past that they move to an open-addressed hash table whose slots
+   carry the key. A slot's key is written before its connection pointer is
+   published, and a slot is never reused in place: removal leaves
+   SR_NAT_CONN_DEAD behind and the table is rebuilt (and the old one retired
+   through the epoch) when dead slots pile up. That keeps the index safe for
+   the lock-free inbound readers. */
+#define SR_NAT_CONN_INLINE 2
+#define SR_NAT_CONN_MIN_TABLE 16
+#define SR_NAT_CONN_DEAD ((struct sr_nat_connection *)1)
+
+struct sr_nat_conn_slot {
+  uint32_t ip;
+  uint16_t port;
+  struct sr_nat_connection *con; /* NULL: never used */
+};
+
+struct sr_nat_conn_table {
+  unsigned int mask;
+  unsigned int used;                /* slots used, live or dead */
+  struct sr_nat_conn_slot slots[1]; /* mask+1 slots */
 };
 
+/* Laid out so a lookup and the packet path touch exactly one cache line:
+   mappings come from a 64-byte aligned slab (sr_slab.h). */
 struct sr_nat_mapping {
-  sr_nat_mapping_type type;
+  struct sr_nat_mapping *next;
   uint32_t ip_int; /* internal ip addr */
-  uint32_t ip_ext; /* external ip addr */
+  uint32_t ip_ext; /* external ip addr, from the pool */
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
-  time_t last_updated; /* use to timeout mappings */
-  struct sr_nat_connection *conns; /* list of connections. null for ICMP */
-  struct sr_nat_mapping *next;
-  void *packet;
+  uint32_t last_updated; /* time(), use to timeout mappings */
+  uint32_t nconns; /* live connections. 0 for ICMP and UDP */
+  uint8_t type;    /* sr_nat_mapping_type */
+  uint8_t estab;   /* has an ESTAB2 connection; the sweeper refreshes it */
+  uint8_t ext_idx; /* ip_ext's index in the pool */
+  struct sr_nat_connection *conns[SR_NAT_CONN_INLINE];
+  struct sr_nat_conn_table *conn_table; /* NULL while conns[] suffices */
+  uint32_t serial; /* nonzero and unique while linked, 0 once removed */
+};
+
+/* The table is split into independently locked shards. Each shard owns a
+   contiguous slice of the external port (TCP and UDP alike, each with its
+   own allocation cursor) and ICMP id space and allocates
+   only from it, so an outbound packet (shard picked by hashing the internal
+   ip/port) and an inbound packet (shard picked from the external port) land
+   on the same shard for the same mapping. With an external address pool
+   a shard owns its slice on every address.
+
+   Inserts, the sweeper and the outbound path take the shard lock. Inbound
+   lookups (sr_nat_lookup_external, sr_nat_translate_inbound and the
+   inbound half of sr_nat_update_connection) take no lock at all: they traverse the lists
+   inside an epoch (sr_epoch.h), refresh timestamps and advance connection
+   state with atomics, and the sweeper retires unlinked mappings and
+   connections instead of freeing them. */
+#define SR_NAT_SHARDS 16
+
+#define SR_NAT_TCP_MIN 1024
+#define SR_NAT_TCP_MAX 65535
+
+/* Capacity. The limits are split evenly over the shards. Past half of a
+   shard's limit the transitory TCP and ICMP timeouts shrink linearly,
+   down to SR_NAT_MIN_TO at the limit. At the mapping limit an insert
+   evicts the least recently used mapping with no established connection;
+   at the connection limit a new connection only evicts a mapping that
+   holds (unestablished) connections, and is refused if that frees none.
+   Victims are found by a clock hand going round the shard's list: each
+   eviction looks at the next SR_NAT_EVICT_SCAN mappings at most, and
+   stops early once it has seen SR_NAT_EVICT_SAMPLE candidates. */
+#define SR_NAT_MAX_MAPPINGS 65536
+#define SR_NAT_MAX_CONNS    262144
+#define SR_NAT_MIN_TO       2
+#define SR_NAT_EVICT_SCAN   256
+#define SR_NAT_EVICT_SAMPLE 8
+
+/* A closed connection (both FINs and the last ACK, or a RST) is held this
+   many seconds for stray retransmissions, then released with its mapping
+   and external port if it was the last one. */
+#define SR_NAT_TCP_TIME_WAIT 4
+
+struct sr_nat_shard {
+  pthread_mutex_t lock;
+  struct sr_nat_mapping *mappings;
+  struct sr_nat_mapping **hand;    /* clock hand: link to the next mapping
+                                      eviction looks at */
+  
+  unsigned short icmp_lo, icmp_hi; /* [lo, hi] ids owned by this shard */
+  unsigned short tcp_lo, tcp_hi;   /* [lo, hi] ports owned by this shard */
+  /* allocation cursors: (id/port - lo) * pool size + address index of
+     the next one to try, so consecutive mappings rotate over the pool */
+  unsigned int icmp_id;
+  unsigned int tcp_id;
+  unsigned int udp_id;             /* same port range as TCP */
+
+  struct sr_slab map_slab;         /* mappings and connections live here */
+  struct sr_slab conn_slab;
+  struct sr_slab det_slab;         /* deterministic sessions */
+  /* deterministic mode only, SR_NAT_DET_BUCKETS each, under the lock */
+  struct sr_nat_det_session **det_out, **det_in;
+
+  unsigned int nmappings, nconns;  /* live, under the lock */
+  unsigned int max_mappings, max_conns;
+  unsigned long evicted;           /* mappings dropped at the limit */
+  unsigned long refused;           /* inserts failed at the limit */
+  unsigned long exhausted;         /* inserts failed for want of a port */
+  
+  char pad[64];
+};
+
+/* Unsolicited inbound SYNs are held for SR_NAT_PENDING_HOLD seconds
+   (RFC 5382 REQ-4) in a fixed-size table of their own: a ring in arrival
+   order, so expiry only ever pops the head, with a hash on (remote ip,
+   remote port, external port) to drop retransmissions. When the ring is
+   full new SYNs are answered with port unreachable, at most
+   SR_NAT_PENDING_ICMP_RATE per second, and dropped beyond that. */
+#define SR_NAT_PENDING_MAX       1024
+#define SR_NAT_PENDING_BUCKETS   2048
+#define SR_NAT_PENDING_HOLD      6
+#define SR_NAT_PENDING_ICMP_RATE 50
+#define SR_NAT_PENDING_FRAME     (SIZE_ETH+ICMP_DATA_SIZE) /* what the
+                                        port unreachable will quote */
+
+struct sr_nat_pending_syn {
+  uint32_t ip;       /* remote ip */
+  uint16_t port;     /* remote port */
+  uint16_t aux_ext;  /* external port it was sent to, host order */
+  uint32_t dst;      /* external address it was sent to */
+  uint32_t added;
+  int hnext;         /* hash chain, -1 ends it */
+  uint8_t frame[SR_NAT_PENDING_FRAME];
+};
+
+struct sr_nat_pending {
+  pthread_mutex_t lock;
+  struct sr_nat_pending_syn syns[SR_NAT_PENDING_MAX];
+  int buckets[SR_NAT_PENDING_BUCKETS];
+  unsigned int head;  /* oldest */
+  unsigned int count;
+  
+  time_t icmp_second; /* rate limit window for the overflow answers */
+  unsigned int icmp_sent;
+  unsigned long answered;
+  unsigned long dropped;
+};
+
+/* Which external ports / icmp ids are in use, per mapping type and pool
+   address, kept by the writers under the shard lock and read with no lock
+   at all so inbound scan noise is rejected before any lookup. Keys are 16
+   bits per address, so the filter is an exact bitmap; the allocator uses
+   it too, to find a free port without walking the shard. */
+#define SR_NAT_FILTER_TYPES 3 /* icmp, tcp, udp */
+#define SR_NAT_FILTER_WORDS (65536 / 32)
+
+struct sr_nat_filter {
+  uint32_t *bits; /* [type][pool index][SR_NAT_FILTER_WORDS] */
+};
+
+/* External address pool. Mappings get an (address, port) pair: by default
+   consecutive mappings rotate over the addresses; in paired mode an
+   internal host always gets the same address (RFC 4787 REQ-2). Addresses
+   other than the outside interfaces' own are answered for by proxy ARP on
+   the outside interfaces. Lookups
+   from an address to its index go through a small open-addressed table. */
+#define SR_NAT_MAX_EXT   64
+#define SR_NAT_EXT_BITS  7
+#define SR_NAT_EXT_SLOTS (1 << SR_NAT_EXT_BITS)  /* > 2 * SR_NAT_MAX_EXT */
+
+/* Deterministic mode (RFC 7422). Host i of the internal prefix owns port
+   block i % det_hosts, det_block ports from SR_NAT_TCP_MIN up, on pool
+   address i / det_hosts; the whole assignment is logged once at startup
+   and is all it takes to trace a flow back to its host. Either way the
+   host is computed from the addresses, and so is its shard, so TCP and
+   UDP keep no mappings: each session (the 5-tuple, plus the TCP state) is
+   one entry in its host's shard, hashed by the internal 5-tuple for
+   outbound packets and by (internal ip, block port, remote) for inbound
+   ones. A new session keeps the internal port's image in the block,
+   lo + port % det_block, unless the host already uses that block port
+   with the same remote, in which case it takes the next free one (the
+   mapping is address and port dependent, so a block port is shared by all
+   the remotes). Sessions count as the shard's connections and are charged
+   to their host like mappings. ICMP queries are mapped as usual, on the
+   host's block address, and the flow cache is off. */
+#define SR_NAT_DET_BUCKETS 4096 /* per shard and direction, power of two */
+
+struct sr_nat_det_session {
+  struct sr_nat_det_session *onext; /* chain by internal 5-tuple */
+  struct sr_nat_det_session *inext; /* chain by block port and remote */
+  uint32_t ip_int;    /* internal ip */
+  uint32_t peer_ip;   /* remote ip */
+  uint16_t aux_int;   /* internal port, network order */
+  uint16_t peer_port; /* remote port, network order */
+  uint16_t aux_ext;   /* block port, host order */
+  uint8_t proto;      /* ip_protocol_tcp or ip_protocol_udp */
+  uint8_t state;      /* TCP state, as in sr_nat_connection */
+  uint32_t last_updated;
+};
+
+/* Per internal host limits: at most max_host_mappings live mappings and
+   a token bucket of host_rate new mappings per second (burst host_rate),
+   charged in sr_nat_insert_mapping and the outbound path before the shard
+   limit is looked at, so one host opening ports in a loop is refused
+   before it can push anyone else's mappings out. A host's mappings are
+   spread over every shard, so the counters live in one table of their
+   own: a fixed pool chained off a hash on the internal ip, under its own
+   lock (taken inside a shard lock, never the other way round). Entries
+   with no mappings left are recycled by the timeout thread once their
+   bucket has refilled. */
+#define SR_NAT_HOSTS         4096
+#define SR_NAT_HOST_BITS     13
+#define SR_NAT_HOST_BUCKETS  (1 << SR_NAT_HOST_BITS)
+#define SR_NAT_HOST_MAPPINGS 2048
+#define SR_NAT_HOST_RATE     1000
+#define SR_NAT_HOST_TOP      5    /* consumers listed by sr_nat_print_stats */
+
+struct sr_nat_host {
+  uint32_t ip;             /* internal ip, 0 when the entry is free */
+  unsigned int nmappings;  /* live mappings */
+  unsigned int tokens;     /* new mappings left this second */
+  uint32_t refill;         /* time() the bucket was last topped up */
+  unsigned long refused;   /* inserts refused by either limit */
+  int hnext;               /* hash chain or free list, -1 ends it */
+};
+
+struct sr_nat_hosts {
+  pthread_mutex_t lock;
+  struct sr_nat_host hosts[SR_NAT_HOSTS];
+  int buckets[SR_NAT_HOST_BUCKETS];
+  int free;                /* free list head, -1 when the table is full */
+  unsigned int count;      /* entries in use */
+  unsigned long refused;   /* inserts refused by a host's limits */
+  unsigned long full;      /* inserts refused for want of an entry */
+};
+
+/* Established TCP flows bypass the slow path. A direct-mapped cache keyed
+   by the 5-tuple as received (and the side it came in on) holds the whole
+   rewrite: the new address and port, the checksum deltas (the IP one
+   including the TTL decrement), the egress interface and the finished
+   Ethernet header. Entries are filled after a packet of an ESTAB2
+   connection has been forwarded the slow way, and checked on every hit:
+   the mapping's serial and the connection's state must be unchanged, the
+   route generation (sr_dcache) and the neighbour's ARP sequence too.
+   SYN, FIN and RST segments always take the slow path, so the state
+   machine still sees every transition. Hits refresh the mapping's and the
+   connection's timestamps only when the second has changed. Like UDP, the
+   TCP checksum isn't verified on a hit: the update keeps a bad one bad. */
+#define SR_NAT_FLOW_SLOTS 16384 /* power of two */
+
+struct sr_nat_flow_key {
+  uint32_t src, dst;            /* as received, network order */
+  uint16_t sport, dport;
+  uint8_t dir;                  /* SR_IF_ROLE_* of the receiving side */
+};
+
+struct sr_nat_flow {
+  unsigned int seq;             /* odd while a writer is filling it */
+  struct sr_nat_flow_key key;   /* dir 0: empty */
+  uint32_t ip;                  /* replaces src outbound, dst inbound */
+  uint16_t port;
+  uint32_t ip_delta, tcp_delta; /* one's complement addends */
+  struct sr_nat_mapping *maps;
+  uint32_t serial;              /* maps->serial when filled */
+  struct sr_nat_connection *con; /* checked against a fresh lookup */
+  unsigned int rt_gen;          /* sr_dcache.rt_gen when filled */
+  int arp_slot;
+  unsigned int arp_seq;
+  int ifindex;
+  uint8_t eth[SIZE_ETH];
 };
 
 struct sr_nat {
   /* add any fields here */
-  struct sr_nat_mapping *mappings;
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
   unsigned int icmp_to;
   unsigned int tcp_est_to;
   unsigned int tcp_trans_to;
+  unsigned int udp_to;
+  /* set before sr_nat_init; 0 picks the defaults */
+  int huge_pages; /* back the slabs with huge pages */
+  unsigned int max_mappings;
+  unsigned int max_conns;
+  unsigned int max_host_mappings;
+  unsigned int host_rate;
+  int paired;     /* one pool address per internal host */
+  /* the pool, filled by sr_nat_add_external / sr_nat_parse_pool */
+  uint32_t ext_ips[SR_NAT_MAX_EXT];
+  unsigned int next;
+  unsigned char ext_slots[SR_NAT_EXT_SLOTS]; /* pool index + 1, 0 empty */
+  unsigned long ext_mappings[SR_NAT_MAX_EXT]; /* live, per address */
+  /* deterministic mode, sr_nat_set_deterministic; det_mask 0 is off */
+  uint32_t det_net, det_mask;  /* internal prefix, network order */
+  unsigned int det_hosts;      /* hosts per pool address */
+  unsigned int det_block;      /* ports per host */
+  unsigned long det_dropped;   /* TCP/UDP from outside the prefix */
   
-  unsigned short icmp_id;
-  unsigned short tcp_id;
+  struct sr_epoch epoch;  /* reclamation for lock-free readers */
+  struct sr_nat_pending pending;
+  struct sr_nat_filter filter;
+  struct sr_nat_hosts hosts;
+  struct sr_nat_flow *flows;     /* SR_NAT_FLOW_SLOTS */
+  uint32_t serial;               /* last mapping serial handed out */
+  /* every worker bumps these; keep them off the line with flows, which
+     every worker reads, as sr_dcache does */
+  char flow_pad0[64];
+  unsigned long flow_hits, flow_misses; /* relaxed atomics */
+  char flow_pad1[64];
    
   /* threading */
-  pthread_mutex_t lock;
   pthread_mutexattr_t attr;
   pthread_attr_t thread_attr;
   pthread_t thread;
@@ -69,14 +360,46 @@ int   sr_nat_init(void *sr,
                   struct sr_nat *nat,
                   unsigned int icmp_timeout,
                   unsigned int tcp_est_timeout,
-                  unsigned int tcp_trans_timeout);     /* Initializes the nat */
+                  unsigned int tcp_trans_timeout,
+                  unsigned int udp_timeout);     /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
 void *sr_nat_timeout(void *sr_ptr);  /* Periodic Timout */
 
-/* Get the mapping associated with given external port.
+/* Add ip (network order) to the external pool. Only before sr_nat_init.
+   Returns 0, or -1 if it is already there or the pool is full. */
+int sr_nat_add_external(struct sr_nat *nat, uint32_t ip);
+
+/* Add "a.b.c.d/len" (every address in the prefix) or "a.b.c.d,e.f.g.h,..."
+   to the pool. Returns the number added, -1 on a malformed spec. */
+int sr_nat_parse_pool(struct sr_nat *nat, const char *spec);
+
+/* Turn on deterministic mode for internal prefix "a.b.c.d/len". Only
+   before sr_nat_init, which sizes the blocks once the pool is known.
+   Returns 0, or -1 on a malformed prefix. */
+int sr_nat_set_deterministic(struct sr_nat *nat, const char *prefix);
+
+/* Deterministic block of internal host ip_int: its pool address and first
+   port (host order). Returns the block size, or 0 if ip_int is outside
+   the prefix or the mode is off. */
+unsigned int sr_nat_det_block(struct sr_nat *nat, uint32_t ip_int,
+  uint32_t *ip_ext, uint16_t *lo);
+
+/* Log every host's block */
+void sr_nat_print_blocks(struct sr_nat *nat, FILE *out);
+
+/* Pool index of ip, or -1 if it isn't a pool address. Lock-free. */
+int sr_nat_external_index(struct sr_nat *nat, uint32_t ip);
+
+/* Lock-free pre-check. 0 means no mapping uses external address ip_ext
+   and port/id aux_ext, so an inbound packet to it can be rejected
+   without a lookup. */
+int sr_nat_maybe_external(struct sr_nat *nat, uint32_t ip_ext,
+  uint16_t aux_ext, sr_nat_mapping_type type);
+
+/* Get the mapping associated with given external address and port.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type );
 
 /* Get the mapping associated with given internal (ip, port) pair.
    You must free the returned structure if it is not NULL. */
@@ -88,11 +411,13 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
-/* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
-void *sr_nat_waiting_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_ext, sr_nat_mapping_type type, 
-  void * buf);
+/* Hold an unsolicited inbound SYN (buf is the whole frame, parsed into
+   meta). Returns 0 if it is held (or already was), 1 if the table is full
+   and the caller should answer with port unreachable, -1 if it should be
+   dropped. */
+int sr_nat_waiting_mapping(struct sr_nat *nat,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type, 
+  void * buf, const struct sr_meta *meta);
   
 /* Insert a new connection into the nat's mapping table.
    You must free the returned structure if it is not NULL. */
@@ -102,8 +427,57 @@ struct sr_nat_mapping *sr_nat_insert_connection(struct sr_nat *nat,
 /* Insert a new connection into the nat's mapping table.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_connection *sr_nat_update_connection(struct sr_nat *nat,
-  void *buf, unsigned char internal);
+  uint8_t *packet, const struct sr_meta *meta, unsigned char internal);
+
+/* Translate an outbound TCP segment, UDP datagram or ICMP echo request
+   from an internal host. packet is the whole frame, parsed into meta: the
+   addresses and ports come from meta, the headers are at meta->l3 and
+   meta->l4, and nothing is parsed again. Finds or creates the mapping
+   (and, for a SYN, the connection), steps the TCP state machine and
+   rewrites the source to the mapping's pool address and port, and the
+   checksums, in place, all under a single shard lock. In deterministic
+   mode TCP and UDP find or create their session instead (TCP only on a
+   SYN). Returns 0 on success, -1 if the packet can't be translated (the
+   headers are then left untouched). */
+int sr_nat_translate_outbound(struct sr_nat *nat, uint8_t *packet,
+  const struct sr_meta *meta);
+
+/* Translate an inbound TCP segment or UDP datagram to a mapped
+   address/port, lock-free and without copying the mapping; a TCP segment
+   also steps its connection's state. Any remote host may use a mapping
+   (endpoint-independent filtering). In deterministic mode both go by their
+   session instead, under the host's shard lock. packet and meta as for
+   sr_nat_translate_outbound; the destination address/port and checksums
+   are rewritten in place. Returns 0 on success, -1 if no mapping (or
+   session) matches. */
+int sr_nat_translate_inbound(struct sr_nat *nat, uint8_t *packet,
+  const struct sr_meta *meta);
+
+/* Forward an IP packet, parsed into meta, that came in on rec_iface from
+   the flow cache. Returns 1 if it was sent, 0 if it needs the slow path. */
+int sr_nat_flow_forward(struct sr_instance *sr, uint8_t *packet,
+                        unsigned int len, const struct sr_meta *meta,
+                        struct sr_if *rec_iface);
+
+/* A TCP segment with key was just translated and sent along rt. If its
+   connection is ESTAB2, remember the rewrite. */
+void sr_nat_flow_fill(struct sr_instance *sr, const struct sr_nat_flow_key *key,
+                      struct sr_rt *rt);
+
+/* For bursts: start loading the flow entry packet would probe and return
+   it (NULL if the packet can't take the cache); later, once it has
+   arrived, start on the mapping, connection and ARP entry it names */
+const struct sr_nat_flow *sr_nat_flow_prefetch(struct sr_instance *sr,
+                                               const uint8_t *packet,
+                                               const struct sr_meta *meta,
+                                               struct sr_if *rec_iface);
+void sr_nat_flow_prefetch_next(struct sr_instance *sr,
+                               const struct sr_nat_flow *flow);
 
 void * sr_free_mapping(struct sr_nat_mapping * map);
 
+/* Print occupancy and limit counters and the internal hosts holding the
+   most mappings. The timeout thread also does this on SIGUSR1. */
+void sr_nat_print_stats(struct sr_nat *nat, FILE *out);
+
 #endif
\ No newline at end of file
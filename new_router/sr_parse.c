@@ -0,0 +1,172 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_parse.c
+ *
+ * Description:
+ *
+ * One-time parse of received frames, see sr_parse.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+#include "sr_parse.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+static uint32_t sr_mix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Look at the transport header in [l4, end): note the ports and whether
+   it is all there */
+static void sr_parse_l4(const uint8_t *buf, struct sr_meta *meta)
+{
+    const uint8_t *l4 = buf + meta->l4;
+    unsigned int room = meta->end - meta->l4;
+    const sr_tcp_hdr_t *tcp_header;
+    const sr_icmp_t8_hdr_t *icmp_header;
+
+    switch (meta->proto) {
+        case ip_protocol_tcp:
+            tcp_header = (const sr_tcp_hdr_t *)l4;
+            if (room < SIZE_TCP || tcp_header->tcp_off * 4 < SIZE_TCP ||
+                tcp_header->tcp_off * 4 > room) {
+                return;
+            }
+            meta->sport = tcp_header->tcp_src;
+            meta->dport = tcp_header->tcp_dst;
+            break;
+        case ip_protocol_udp:
+            if (room < SIZE_UDP) {
+                return;
+            }
+            meta->sport = ((const sr_udp_hdr_t *)l4)->udp_src;
+            meta->dport = ((const sr_udp_hdr_t *)l4)->udp_dst;
+            break;
+        case ip_protocol_icmp:
+            icmp_header = (const sr_icmp_t8_hdr_t *)l4;
+            if (room < sizeof(sr_icmp_t8_hdr_t)) {
+                return;
+            }
+            meta->sport = meta->dport = icmp_header->icmp_id;
+            break;
+        default:
+            return;
+    }
+    meta->flags |= SR_META_L4;
+} /* -- sr_parse_l4 -- */
+
+int sr_parse(const uint8_t *buf, unsigned int len, struct sr_meta *meta)
+{
+    const sr_ip_hdr_t *ip_header;
+    const sr_arp_hdr_t *arp_header;
+    unsigned int ihl, ip_len;
+    uint32_t h, ports;
+
+    memset(meta, 0, sizeof(struct sr_meta));
+    if (len < SIZE_ETH) {
+        return -1;
+    }
+    meta->type = ethertype((uint8_t *)buf);
+    meta->l3 = SIZE_ETH;
+
+    if (meta->type == ethertype_arp) {
+        if (len < SIZE_ETH+SIZE_ARP) {
+            return -1;
+        }
+        arp_header = (const sr_arp_hdr_t *)(buf+SIZE_ETH);
+        meta->l4 = meta->end = SIZE_ETH+SIZE_ARP;
+        meta->src = arp_header->ar_sip;
+        meta->dst = arp_header->ar_tip;
+        meta->hash = sr_mix32(arp_header->ar_sip);
+        return 0;
+    }
+    if (meta->type != ethertype_ip) {
+        return 0; /* for the handler to turn away */
+    }
+
+    if (len < SIZE_ETH+SIZE_IP) {
+        return -1;
+    }
+    ip_header = (const sr_ip_hdr_t *)(buf+SIZE_ETH);
+    ihl = ip_header->ip_hl * 4;
+    ip_len = ntohs(ip_header->ip_len);
+    if (ip_header->ip_v != 4 || ihl < SIZE_IP || ip_len < ihl ||
+        ip_len > len - SIZE_ETH) {
+        return -1;
+    }
+    /* a correct header, options and checksum included, sums to -0 */
+    if (cksum_finish(cksum_partial(ip_header, ihl)) != 0xffff) {
+        return -1;
+    }
+    meta->l4 = SIZE_ETH + ihl;
+    meta->end = SIZE_ETH + ip_len;
+    meta->proto = ip_header->ip_p;
+    meta->src = ip_header->ip_src;
+    meta->dst = ip_header->ip_dst;
+
+    /* later fragments carry no transport header */
+    if ((ntohs(ip_header->ip_off) & IP_OFFMASK) == 0) {
+        sr_parse_l4(buf, meta);
+    }
+
+    h = meta->src * 31 + meta->dst;
+    h = h * 31 + meta->proto;
+    if (!(meta->flags & SR_META_L4)) {
+        /* addresses only */
+    } else if (meta->proto == ip_protocol_icmp) {
+        h = h * 31 + meta->sport;
+    } else {
+        memcpy(&ports, buf + meta->l4, 4); /* source and destination port */
+        h = h * 31 + ports;
+    }
+    meta->hash = sr_mix32(h);
+    return 0;
+} /* -- sr_parse -- */
+
+int sr_meta_l4_ok(const uint8_t *buf, struct sr_meta *meta)
+{
+    const uint8_t *l4 = buf + meta->l4;
+    unsigned int l4_len = meta->end - meta->l4;
+    const void *ip = buf + meta->l3;
+    uint16_t sum;
+
+    if (!(meta->flags & SR_META_L4)) {
+        return 0;
+    }
+    if (meta->flags & SR_META_L4_DONE) {
+        return !(meta->flags & SR_META_L4_BAD);
+    }
+    meta->flags |= SR_META_L4_DONE;
+    switch (meta->proto) {
+        case ip_protocol_tcp:
+            sum = ((const sr_tcp_hdr_t *)l4)->tcp_sum;
+            if (sr_l4_cksum(ip, l4, l4_len, offsetof(sr_tcp_hdr_t, tcp_sum)) != sum) {
+                meta->flags |= SR_META_L4_BAD;
+            }
+            break;
+        case ip_protocol_udp:
+            sum = ((const sr_udp_hdr_t *)l4)->udp_sum;
+            if (sum != 0 &&
+                sr_l4_cksum(ip, l4, l4_len, offsetof(sr_udp_hdr_t, udp_sum)) != sum) {
+                meta->flags |= SR_META_L4_BAD;
+            }
+            break;
+        case ip_protocol_icmp:
+            sum = ((const sr_icmp_hdr_t *)l4)->icmp_sum;
+            if (sr_l4_cksum(NULL, l4, l4_len, offsetof(sr_icmp_hdr_t, icmp_sum)) != sum) {
+                meta->flags |= SR_META_L4_BAD;
+            }
+            break;
+    }
+    return !(meta->flags & SR_META_L4_BAD);
+} /* -- sr_meta_l4_ok -- */
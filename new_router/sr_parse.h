@@ -0,0 +1,52 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_parse.h
+ *
+ * Description:
+ *
+ * One-time parse of a received frame. sr_parse checks what every later
+ * stage relies on: the frame holds the whole header, the IP version, the
+ * header length (options included) and the total length agree with it,
+ * and the IP checksum is right. The result goes in a small struct sr_meta
+ * with the header offsets, the protocol, the flow's addresses and ports
+ * and its hash. Handlers find the transport header at meta->l4 instead of
+ * assuming a 20 byte IP header, take lengths from meta->end instead of the
+ * frame (which may carry Ethernet padding), and don't check any of it
+ * again.
+ *
+ * Only some paths need the transport checksum: the NAT, and ICMP to the
+ * router itself. sr_meta_l4_ok checks it on first use and keeps the answer
+ * in the metadata.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PARSE_H
+#define SR_PARSE_H
+
+#include <stdint.h>
+
+#define SR_META_L4      0x01  /* transport header present and complete */
+#define SR_META_L4_DONE 0x02  /* transport checksum checked... */
+#define SR_META_L4_BAD  0x04  /* ...and found wrong */
+
+struct sr_meta {
+    uint16_t type;          /* ethertype, host order */
+    uint16_t l3;            /* offset of the ARP or IP header */
+    uint16_t l4;            /* offset of the transport header, l3 + ip_hl*4 */
+    uint16_t end;           /* end of the datagram, l3 + ip_len */
+    uint8_t  proto;         /* ip_p */
+    uint8_t  flags;         /* SR_META_* */
+    uint16_t sport, dport;  /* TCP/UDP ports, or the ICMP id in both */
+    uint32_t src, dst;      /* IP (or ARP sender/target) addresses */
+    uint32_t hash;          /* flow hash, for spreading over workers */
+};                          /* addresses, ports: network order */
+
+/* Parse and check the Ethernet frame in buf. Returns 0 and fills meta if
+   the frame can be handled (frames that are neither IP nor ARP only get
+   type), -1 if it must be dropped. */
+int  sr_parse(const uint8_t *buf, unsigned int len, struct sr_meta *meta);
+
+/* 1 if the transport header is present and its checksum right (a UDP
+   datagram sent without one counts as right) */
+int  sr_meta_l4_ok(const uint8_t *buf, struct sr_meta *meta);
+
+#endif /* -- SR_PARSE_H -- */
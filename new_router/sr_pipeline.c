@@ -0,0 +1,174 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pipeline.c
+ *
+ * Description:
+ *
+ * RX -> worker -> TX forwarding pipeline, see sr_pipeline.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "sr_pipeline.h"
+#include "sr_router.h"
+#include "sr_utils.h"
+
+int sr_set_cpu(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return 0;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+} /* -- sr_set_cpu -- */
+
+static void *sr_worker_thread(void *worker_ptr)
+{
+    struct sr_worker *worker = (struct sr_worker *)worker_ptr;
+    struct sr_job *jobs[SR_RX_BURST];
+    struct sr_rx_frame frames[SR_RX_BURST];
+    int cnt, i;
+
+    while (1) {
+        if (sem_wait(&(worker->wakeup)) != 0 && errno != EINTR) {
+            perror("sem_wait(..):sr_worker_thread");
+            return NULL;
+        }
+        /* Take whatever has queued up as one burst */
+        do {
+            for (cnt = 0; cnt < SR_RX_BURST; cnt++) {
+                jobs[cnt] = (struct sr_job *)sr_ring_dequeue(&(worker->ring));
+                if (jobs[cnt] == NULL) {
+                    break;
+                }
+                frames[cnt].buf = jobs[cnt]->buf;
+                frames[cnt].len = jobs[cnt]->len;
+                frames[cnt].iface = jobs[cnt]->iface;
+                frames[cnt].parsed = 1;
+                frames[cnt].meta = jobs[cnt]->meta;
+            }
+            sr_handleburst(worker->sr, frames, cnt);
+            for (i = 0; i < cnt; i++) {
+                free(jobs[i]);
+            }
+            __atomic_add_fetch(&(worker->packets), cnt, __ATOMIC_RELEASE);
+        } while (cnt == SR_RX_BURST);
+    }
+    return NULL;
+} /* -- sr_worker_thread -- */
+
+/* Undo the first n workers of a failed sr_pipeline_init. Nothing has been
+   dispatched yet, so they are all parked in sem_wait, a cancellation
+   point, and their rings are empty. */
+static void sr_pipeline_teardown(struct sr_pipeline *pl, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        pthread_cancel(pl->workers[i].thread);
+        pthread_join(pl->workers[i].thread, NULL);
+        sem_destroy(&(pl->workers[i].wakeup));
+        sr_ring_destroy(&(pl->workers[i].ring));
+    }
+    free(pl->workers);
+    pl->workers = NULL;
+    pl->nworkers = 0;
+} /* -- sr_pipeline_teardown -- */
+
+int sr_pipeline_init(struct sr_instance *sr, int nworkers,
+                     const int *cpus, int ncpus)
+{
+    struct sr_pipeline *pl = &(sr->pipeline);
+    int i;
+
+    if (nworkers <= 0) {
+        pl->nworkers = 0;
+        return 0;
+    }
+    if (nworkers > SR_PIPELINE_MAX_WORKERS) {
+        nworkers = SR_PIPELINE_MAX_WORKERS;
+    }
+
+    pl->workers = (struct sr_worker *)calloc(nworkers, sizeof(struct sr_worker));
+    if (pl->workers == NULL) {
+        pl->nworkers = 0;
+        return -1;
+    }
+
+    if (ncpus > 0 && sr_set_cpu(pthread_self(), cpus[0]) != 0) {
+        fprintf(stderr, "Could not pin RX stage to cpu %d\n", cpus[0]);
+    }
+    if (ncpus > 1 && sr->tx.running && sr_set_cpu(sr->tx.thread, cpus[1]) != 0) {
+        fprintf(stderr, "Could not pin TX stage to cpu %d\n", cpus[1]);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        struct sr_worker *worker = &(pl->workers[i]);
+        worker->sr = sr;
+        worker->cpu = (ncpus > 2+i) ? cpus[2+i] : -1;
+        if (sr_ring_init(&(worker->ring), SR_PIPELINE_RING_SZ) != 0) {
+            sr_pipeline_teardown(pl, i);
+            return -1;
+        }
+        if (sem_init(&(worker->wakeup), 0, 0) != 0) {
+            sr_ring_destroy(&(worker->ring));
+            sr_pipeline_teardown(pl, i);
+            return -1;
+        }
+        if (pthread_create(&(worker->thread), &(sr->attr),
+                           sr_worker_thread, worker) != 0) {
+            sem_destroy(&(worker->wakeup));
+            sr_ring_destroy(&(worker->ring));
+            sr_pipeline_teardown(pl, i);
+            return -1;
+        }
+        if (sr_set_cpu(worker->thread, worker->cpu) != 0) {
+            fprintf(stderr, "Could not pin worker %d to cpu %d\n", i, worker->cpu);
+        }
+    }
+
+    /* Publish last: the RX stage starts dispatching once nworkers is set */
+    __atomic_store_n(&(pl->nworkers), nworkers, __ATOMIC_RELEASE);
+    fprintf(stderr, "Forwarding pipeline enabled with %d workers\n", nworkers);
+    return 0;
+} /* -- sr_pipeline_init -- */
+
+void sr_pipeline_dispatch(struct sr_instance *sr, uint8_t *packet,
+                          unsigned int len, const char *iface)
+{
+    struct sr_pipeline *pl = &(sr->pipeline);
+    struct sr_worker *worker;
+    struct sr_job *job;
+    struct sr_meta meta;
+
+    /* parsed here once, for the hash; the worker reuses the result */
+    if (sr_parse(packet, len, &meta) != 0) {
+        return;
+    }
+    job = (struct sr_job *)malloc(sizeof(struct sr_job) + len);
+    if (job == NULL) {
+        return;
+    }
+    job->len = len;
+    job->meta = meta;
+    job->buf = (uint8_t *)(job + 1);
+    memcpy(job->buf, packet, len);
+    strncpy(job->iface, iface, sr_IFACE_NAMELEN);
+
+    worker = &(pl->workers[meta.hash % pl->nworkers]);
+
+    /* Back-pressure rather than drop: a full ring stalls RX, which in turn
+       stops us reading from the VNS socket. */
+    while (!sr_ring_enqueue(&(worker->ring), job)) {
+        sem_post(&(worker->wakeup));
+        sched_yield();
+    }
+    sem_post(&(worker->wakeup));
+} /* -- sr_pipeline_dispatch -- */
@@ -0,0 +1,70 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pipeline.h
+ *
+ * Description:
+ *
+ * Optional multi-core forwarding pipeline. The RX stage (the thread running
+ * sr_read_from_server) parses each frame (sr_parse.h), steers it by its
+ * flow hash to one of N worker threads and hands it over a single-producer
+ * ring with the metadata; workers take whatever has
+ * queued as a burst for sr_handleburst and send through the TX thread
+ * (sr_tx.h). A flow always hashes to the same worker, so packets of one
+ * flow stay in order.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PIPELINE_H
+#define SR_PIPELINE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "sr_protocol.h"
+#include "sr_ring.h"
+#include "sr_parse.h"
+
+#define SR_PIPELINE_MAX_WORKERS 32
+#define SR_PIPELINE_RING_SZ     1024
+
+struct sr_instance;
+
+struct sr_job {
+    unsigned int len;
+    struct sr_meta meta;
+    char iface[sr_IFACE_NAMELEN];
+    uint8_t *buf;               /* points just past the job */
+};
+
+struct sr_worker {
+    struct sr_ring ring;        /* fed by the RX stage only */
+    sem_t wakeup;
+    struct sr_instance *sr;
+    int cpu;                    /* -1 if not pinned */
+    unsigned long packets;      /* frames handled */
+    pthread_t thread;
+    char pad[SR_CACHE_LINE];
+};
+
+struct sr_pipeline {
+    int nworkers;               /* 0 when the pipeline is disabled */
+    struct sr_worker *workers;
+};
+
+/* Start nworkers workers. cpus lists the CPU for RX, TX and then each
+   worker in that order; ncpus may be shorter than that (or 0), and a CPU
+   of -1 leaves that stage unpinned. Returns 0 on success; on failure no
+   worker is left running and the pipeline stays disabled. */
+int  sr_pipeline_init(struct sr_instance *sr, int nworkers,
+                      const int *cpus, int ncpus);
+
+/* RX stage: parse the frame, drop it if it is malformed, otherwise copy
+   it and queue it on its flow's worker. The flow hash (sr_meta.hash) is
+   the 5-tuple for TCP/UDP, (addresses, id) for ICMP, addresses for other
+   IP and the sender address for ARP. */
+void sr_pipeline_dispatch(struct sr_instance *sr, uint8_t *packet,
+                          unsigned int len, const char *iface);
+
+int  sr_set_cpu(pthread_t thread, int cpu);
+
+#endif /* -- SR_PIPELINE_H -- */
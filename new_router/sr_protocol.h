@@ -72,7 +72,7 @@
   #define __BYTE_ORDER __BIG_ENDIAN
   #endif
 #endif
-#define ICMP_DATA_SIZE 28
+#define ICMP_DATA_SIZE 68  /* most an error quotes: 60 byte IP header + 8 */
 
 #define SIZE_ETH sizeof(sr_ethernet_hdr_t)
 #define SIZE_IP sizeof(sr_ip_hdr_t)
@@ -80,6 +80,7 @@
 #define SIZE_ICMP sizeof(sr_icmp_t3_hdr_t)
 #define SIZE_TCP sizeof(sr_tcp_hdr_t)
 #define SIZE_PTCP sizeof(sr_tcp_pseudo_hdr_t)
+#define SIZE_UDP sizeof(sr_udp_hdr_t)
 
 /* Structure of a ICMP header
  */
@@ -159,6 +160,17 @@ struct sr_tcp_hdr {
 typedef struct sr_tcp_hdr sr_tcp_hdr_t;
 
 
+/* Structure of a UDP header. A zero checksum means none was computed.
+ */
+struct sr_udp_hdr {
+  uint16_t udp_src;
+  uint16_t udp_dst;
+  uint16_t udp_len;
+  uint16_t udp_sum;
+} __attribute__ ((packed)) ;
+typedef struct sr_udp_hdr sr_udp_hdr_t;
+
+
 /* Structure of a TCP-Pseudo header
  */
 struct sr_tcp_pseudo_hdr {
@@ -219,6 +231,8 @@ typedef struct sr_ethernet_hdr sr_ethernet_hdr_t;
 
 enum sr_ip_protocol {
   ip_protocol_icmp = 0x0001,
+  ip_protocol_tcp = 0x0006,
+  ip_protocol_udp = 0x0011,
 };
 
 enum sr_ethertype {
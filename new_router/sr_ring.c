@@ -0,0 +1,85 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ring.c
+ *
+ * Description:
+ *
+ * Bounded multi-producer / single-consumer ring, see sr_ring.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_ring.h"
+
+int sr_ring_init(struct sr_ring *ring, unsigned long size)
+{
+    unsigned long i, cap = 1;
+
+    while (cap < size) {
+        cap <<= 1;
+    }
+
+    memset(ring, 0, sizeof(struct sr_ring));
+    ring->cells = (struct sr_ring_cell *)malloc(cap * sizeof(struct sr_ring_cell));
+    if (ring->cells == NULL) {
+        return -1;
+    }
+    for (i = 0; i < cap; i++) {
+        ring->cells[i].seq = i;
+        ring->cells[i].data = NULL;
+    }
+    ring->mask = cap - 1;
+    return 0;
+} /* -- sr_ring_init -- */
+
+void sr_ring_destroy(struct sr_ring *ring)
+{
+    free(ring->cells);
+    ring->cells = NULL;
+} /* -- sr_ring_destroy -- */
+
+int sr_ring_enqueue(struct sr_ring *ring, void *data)
+{
+    struct sr_ring_cell *cell;
+    unsigned long pos = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    unsigned long seq;
+    long dif;
+
+    while (1) {
+        cell = &(ring->cells[pos & ring->mask]);
+        seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+        dif = (long)seq - (long)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&(ring->head), &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return 0; /* full */
+        } else {
+            pos = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = data;
+    __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+    return 1;
+} /* -- sr_ring_enqueue -- */
+
+void *sr_ring_dequeue(struct sr_ring *ring)
+{
+    unsigned long pos = ring->tail;
+    struct sr_ring_cell *cell = &(ring->cells[pos & ring->mask]);
+    unsigned long seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+    void *data;
+
+    if ((long)seq - (long)(pos + 1) < 0) {
+        return NULL; /* empty */
+    }
+
+    data = cell->data;
+    __atomic_store_n(&(cell->seq), pos + ring->mask + 1, __ATOMIC_RELEASE);
+    ring->tail = pos + 1;
+    return data;
+} /* -- sr_ring_dequeue -- */
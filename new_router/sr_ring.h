@@ -0,0 +1,43 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ring.h
+ *
+ * Description:
+ *
+ * Bounded lock-free ring of pointers. Any number of threads may enqueue
+ * concurrently; exactly one thread may dequeue. Each cell carries a sequence
+ * number so producers claim a slot with a single CAS on the head and publish
+ * it with a release store, and the consumer never touches the head at all.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_RING_H
+#define SR_RING_H
+
+#define SR_CACHE_LINE 64
+
+struct sr_ring_cell {
+    unsigned long seq;
+    void *data;
+};
+
+struct sr_ring {
+    struct sr_ring_cell *cells;
+    unsigned long mask;
+    char pad0[SR_CACHE_LINE];
+    unsigned long head;         /* next slot to claim (producers) */
+    char pad1[SR_CACHE_LINE];
+    unsigned long tail;         /* next slot to read (consumer) */
+    char pad2[SR_CACHE_LINE];
+};
+
+/* size is rounded up to a power of two. Returns 0 on success. */
+int   sr_ring_init(struct sr_ring *ring, unsigned long size);
+void  sr_ring_destroy(struct sr_ring *ring);
+
+/* Returns 1 if data was queued, 0 if the ring is full. */
+int   sr_ring_enqueue(struct sr_ring *ring, void *data);
+
+/* Single consumer only. Returns NULL if the ring is empty. */
+void *sr_ring_dequeue(struct sr_ring *ring);
+
+#endif /* -- SR_RING_H -- */
@@ -23,6 +23,7 @@
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 #include "sr_nat.h"
+#include "sr_slowpath.h"
 
 /*INTERNAL TO sr_router*/
 void sendIPPacket(struct sr_instance* sr,
@@ -30,33 +31,46 @@ void sendIPPacket(struct sr_instance* sr,
                unsigned int len, 
                struct sr_rt* rt){
     struct sr_if* iface = sr_get_interface(sr, rt->interface);
-    struct sr_arpentry* entry;
-    pthread_mutex_lock(&(sr->cache.lock));
-    entry = sr_arpcache_lookup(&sr->cache, (uint32_t)(rt->gw.s_addr));
+    struct sr_arpentry entry;
     sr_ethernet_hdr_t* eth_header = (sr_ethernet_hdr_t*) packet;
     sr_ip_hdr_t* ip_header = (sr_ip_hdr_t*) (packet+SIZE_ETH);
+    int slot = sr_arpcache_find_slot(&sr->cache, (uint32_t)(rt->gw.s_addr), &entry);
+    int hit = (slot >= 0);
     
-    if (entry) {
+    if (!hit) {
+        /* Re-check under the lock so a reply that lands between the lock-free
+           miss and the queueing below can't strand this packet. */
+        pthread_mutex_lock(&(sr->cache.lock));
+        hit = sr_arpcache_find(&sr->cache, (uint32_t)(rt->gw.s_addr), &entry);
+        if (!hit) {
+            fprintf(stderr,"Adding ARP Request\n");
+            memcpy(eth_header->ether_shost,iface->addr,6);
+            struct sr_arpreq *req = sr_arpcache_queuereq(&(sr->cache), 
+                                                         (uint32_t)(rt->gw.s_addr), 
+                                                         packet, 
+                                                         len, 
+                                                         iface->index);
+            sr_handle_arpreq(sr,req);
+        }
+        pthread_mutex_unlock(&(sr->cache.lock));
+    }
+    
+    if (hit) {
         fprintf(stderr,"Found cache hit\n");
-        iface = sr_get_interface(sr, rt->interface);
-        memcpy(eth_header->ether_dhost,entry->mac,6);
-        memcpy(eth_header->ether_shost,iface->addr,6);
+        memcpy(eth_header, iface->tmpl.eth, SIZE_ETH);
+        memcpy(eth_header->ether_dhost,entry.mac,6);
+        /* every caller hands over a valid checksum; TTL shares its word
+           with the protocol */
+        uint16_t old_ttl, new_ttl;
+        memcpy(&old_ttl, &(ip_header->ip_ttl), 2);
         ip_header->ip_ttl = ip_header->ip_ttl - 1;
-        ip_header->ip_sum = 0;
-        ip_header->ip_sum = cksum((uint8_t *)ip_header,SIZE_IP);
+        memcpy(&new_ttl, &(ip_header->ip_ttl), 2);
+        ip_header->ip_sum = cksum_update16(ip_header->ip_sum, old_ttl, new_ttl);
         sr_send_packet(sr,packet,len,rt->interface);
-        free(entry);
-    } else {
-        fprintf(stderr,"Adding ARP Request\n");
-        memcpy(eth_header->ether_shost,iface->addr,6);
-        struct sr_arpreq *req = sr_arpcache_queuereq(&(sr->cache), 
-                                                     (uint32_t)(rt->gw.s_addr), 
-                                                     packet, 
-                                                     len, 
-                                                     rt->interface);
-        sr_handle_arpreq(sr,req);
+        if (sr->mode == 0 && slot >= 0){
+            sr_dcache_fill(&(sr->dcache), ip_header->ip_dst, rt, iface, slot, &entry);
+        }
     }
-    pthread_mutex_unlock(&(sr->cache.lock));
 } /*end sendIPPacket */
 
 /*INTERNAL TO sr_router*/
@@ -68,44 +82,50 @@ void handleARPpacket(struct sr_instance *sr,
     sr_ethernet_hdr_t* eth_header = (sr_ethernet_hdr_t*) packet;
     sr_arp_hdr_t * arp_header = (sr_arp_hdr_t *) (packet+SIZE_ETH);
     struct sr_if *tgt_iface = sr_get_interface_from_ip(sr, arp_header->ar_tip);
-    if (tgt_iface == NULL || strcmp(rec_iface->name, tgt_iface->name) != 0){
+    if (tgt_iface == NULL && sr->mode == 1 && rec_iface->nat_role == SR_IF_ROLE_OUTSIDE &&
+        sr_nat_external_index(&(sr->nat), arp_header->ar_tip) >= 0){
+        tgt_iface = rec_iface; /* proxy ARP for the NAT's address pool */
+    }
+    if (tgt_iface == NULL || rec_iface != tgt_iface){
         fprintf(stderr,"ARP Not for us\n");
     }
     else if(ntohs(arp_header->ar_op) == arp_op_request){
         fprintf(stderr,"Replying to ARP request\n");
         /*sr_arpcache_insert(&(sr->cache), arp_header->ar_sha, arp_header->ar_sip);*/
-        /*Setup ETH Header for Reply*/
-        memcpy(eth_header->ether_dhost, arp_header->ar_sha,6);
-        memcpy(eth_header->ether_shost, rec_iface->addr,6);
-        /*Setup ARP Header for Reply*/
-        arp_header->ar_op = ntohs(arp_op_reply);
-        uint32_t temp = arp_header->ar_sip;
-        arp_header->ar_sip = arp_header->ar_tip;
-        arp_header->ar_tip = temp;
-        memcpy(arp_header->ar_tha, arp_header->ar_sha,6);
-        memcpy(arp_header->ar_sha, rec_iface->addr,6);
+        /*Reply from the template, the requester's fields patched in*/
+        unsigned char sha[ETHER_ADDR_LEN];
+        uint32_t sip = arp_header->ar_sip;
+        uint32_t tip = arp_header->ar_tip;
+        memcpy(sha, arp_header->ar_sha, ETHER_ADDR_LEN);
+        memcpy(packet, rec_iface->tmpl.arp_rep, SIZE_ETH+SIZE_ARP);
+        memcpy(eth_header->ether_dhost, sha, ETHER_ADDR_LEN);
+        arp_header->ar_sip = tip;
+        memcpy(arp_header->ar_tha, sha, ETHER_ADDR_LEN);
+        arp_header->ar_tip = sip;
         sr_send_packet(sr, packet, SIZE_ETH+SIZE_ARP, rec_iface->name);
     } else if (ntohs(arp_header->ar_op) == arp_op_reply){/*} && strcmp(rec_iface->addr,eth_header->ether_dhost) == 0){*/
         fprintf(stderr,"Processing ARP reply\n");
         struct sr_arpreq *req;
         struct sr_packet *pckt;
-        pthread_mutex_lock(&(sr->cache.lock));
+        /* insert unlinks the request from the queue under the cache lock, so
+           from here on it is ours and can be flushed without holding it. */
         req = sr_arpcache_insert(&(sr->cache), arp_header->ar_sha, arp_header->ar_sip);
         if(req){
             fprintf(stderr,"Clearing queue\n");
             for (pckt = req->packets; pckt != NULL; pckt = pckt->next){
                 sr_ethernet_hdr_t * outETH = (sr_ethernet_hdr_t *)(pckt->buf);
-                memcpy(outETH->ether_shost, rec_iface->addr,6);
+                memcpy(outETH, rec_iface->tmpl.eth, SIZE_ETH);
                 memcpy(outETH->ether_dhost, arp_header->ar_sha,6);
                 sr_ip_hdr_t * outIP = (sr_ip_hdr_t *)(pckt->buf+14);
+                uint16_t old_ttl, new_ttl;
+                memcpy(&old_ttl, &(outIP->ip_ttl), 2);
                 outIP->ip_ttl = outIP->ip_ttl-1;
-                outIP->ip_sum = 0;
-                outIP->ip_sum = cksum((uint8_t *)outIP,20);
+                memcpy(&new_ttl, &(outIP->ip_ttl), 2);
+                outIP->ip_sum = cksum_update16(outIP->ip_sum, old_ttl, new_ttl);
                 sr_send_packet(sr,pckt->buf,pckt->len,rec_iface->name);
             }
             sr_arpreq_destroy(&(sr->cache), req);
         }
-        pthread_mutex_unlock(&(sr->cache.lock));
     }
 }/* end handleARPPacket */
 
@@ -113,43 +133,34 @@ void handleARPpacket(struct sr_instance *sr,
 void handleIPPacket(struct sr_instance* sr, 
         uint8_t* packet,
         unsigned int len, 
-        struct sr_if * rec_iface)
+        struct sr_if * rec_iface,
+        struct sr_meta * meta)
 {
-    sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet+SIZE_ETH);
+    sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet+meta->l3);
     struct sr_if *tgt_iface= sr_get_interface_from_ip(sr,ip_header->ip_dst);
 
-    uint16_t incm_cksum = ip_header->ip_sum;
-    ip_header->ip_sum = 0;
-    uint16_t calc_cksum = cksum((uint8_t*)ip_header,20);
-    ip_header->ip_sum = incm_cksum;
-    if (calc_cksum != incm_cksum){
-        fprintf(stderr,"Bad checksum\n");
-    } else if (tgt_iface != NULL){
+    if (tgt_iface != NULL){
         fprintf(stderr,"For us\n");
-        if(ip_header->ip_p==6){ /*TCP*/
+        if(meta->proto==ip_protocol_tcp){
             fprintf(stderr,"TCP\n");
-            sr_send_icmp(sr, packet, len, 3, 3, ip_header->ip_dst);
-        } else if (ip_header->ip_p==17){ /*UDP*/
+            sr_slowpath_icmp(sr, packet, len, 3, 3, ip_header->ip_dst);
+        } else if (meta->proto==ip_protocol_udp){
             fprintf(stderr,"UDP\n");
-            sr_send_icmp(sr, packet, len, 3, 3, ip_header->ip_dst);
-        } else if (ip_header->ip_p==1 && ip_header->ip_tos==0){ /*ICMP PING*/
+            sr_slowpath_icmp(sr, packet, len, 3, 3, ip_header->ip_dst);
+        } else if (meta->proto==ip_protocol_icmp && ip_header->ip_tos==0){ /*ICMP PING*/
             fprintf(stderr,"ICMP\n");
-            sr_icmp_hdr_t* icmp_header = (sr_icmp_hdr_t *)(packet+SIZE_ETH+SIZE_IP);
-            incm_cksum = icmp_header->icmp_sum;
-            icmp_header->icmp_sum = 0;
-            calc_cksum = cksum((uint8_t*)icmp_header,len-SIZE_ETH-SIZE_IP);
-            icmp_header->icmp_sum = incm_cksum;
-            uint8_t type = icmp_header->icmp_type;
-            uint8_t code = icmp_header->icmp_code;
-            if (incm_cksum != calc_cksum){
-                fprintf(stderr,"Bad cksum %d != %d\n", incm_cksum, calc_cksum);
-            } else if (type == 8 && code == 0) {
-                sr_send_icmp(sr, packet, len, 0, 0, ip_header->ip_dst);
+            sr_icmp_hdr_t* icmp_header = (sr_icmp_hdr_t *)(packet+meta->l4);
+            if (!sr_meta_l4_ok(packet, meta)){
+                fprintf(stderr,"Bad ICMP cksum\n");
+            } else if (icmp_header->icmp_type == 8 && icmp_header->icmp_code == 0) {
+                sr_send_echo_reply(sr, packet, len, meta);
             }
         }
     } else if (ip_header->ip_ttl <= 1){
         fprintf(stderr,"Packet died\n");
-        sr_send_icmp(sr, packet, len, 11, 0,0);
+        sr_slowpath_icmp(sr, packet, len, 11, 0,0);
+    } else if (sr_dcache_forward(sr, packet, len)){
+        /* route, egress and next hop MAC all cached */
     } else {
         fprintf(stderr,"Not for us\n");
         struct sr_rt* rt;
@@ -157,7 +168,7 @@ void handleIPPacket(struct sr_instance* sr,
         if (rt){
             sendIPPacket(sr,packet,len,rt);
         } else {
-            sr_send_icmp(sr, packet, len, 3, 0, 0);
+            sr_slowpath_icmp(sr, packet, len, 3, 0, 0);
         }
     }
 }/* end handleIPPacket */
@@ -165,142 +176,136 @@ void handleIPPacket(struct sr_instance* sr,
 void natHandleIPPacket(struct sr_instance* sr, 
         uint8_t* packet,
         unsigned int len, 
-        struct sr_if * rec_iface)
+        struct sr_if * rec_iface,
+        struct sr_meta * meta)
 {
-    sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet+SIZE_ETH);
+    sr_ip_hdr_t * ip_header = (sr_ip_hdr_t *)(packet+meta->l3);
     struct sr_if *tgt_iface = sr_get_interface_from_ip(sr,ip_header->ip_dst);
     struct sr_rt * rt = NULL;
     struct sr_nat_mapping *map = NULL;
-    struct sr_nat_connection *con = NULL;
+    struct sr_nat_flow_key key;
+    /* transport protocol, 0 when there is no complete header to look at */
+    uint8_t l4 = (meta->flags & SR_META_L4) ? meta->proto : 0;
     /*struct sr_if *int_if = sr_get_interface(sr,"eth1");*/
-    struct sr_if *ext_if = sr_get_interface(sr,"eth2");
 
-    uint16_t incm_cksum = ip_header->ip_sum;
-    ip_header->ip_sum = 0;
-    uint16_t calc_cksum = cksum((uint8_t*)ip_header,SIZE_IP);
-    ip_header->ip_sum = incm_cksum;
-    
-    if (calc_cksum != incm_cksum){
-        fprintf(stderr,"Bad checksum\n");
-    } else if (strcmp(rec_iface->name, "eth1") == 0){ /*INTERNAL*/
+    if (sr_nat_flow_forward(sr, packet, len, meta, rec_iface)){
+        /* established flow, rewritten from the cache */
+    } else if (rec_iface->nat_role == SR_IF_ROLE_INSIDE){ /*INTERNAL*/
         rt = (struct sr_rt*)sr_find_routing_entry_int(sr, ip_header->ip_dst);
         if (tgt_iface != NULL || rt == NULL){
             /*(handleIPPacket(sr, packet, len, rec_iface);*/
-            sr_send_icmp(sr, packet, len, 3, 3, 0);
+            sr_slowpath_icmp(sr, packet, len, 3, 3, 0);
         } else if (ip_header->ip_ttl <= 1){
             fprintf(stderr,"Packet died\n");
-            sr_send_icmp(sr, packet, len, 11, 0,0);
-        } else if(ip_header->ip_p==6) { /*TCP*/
+            sr_slowpath_icmp(sr, packet, len, 11, 0,0);
+        } else if(l4==ip_protocol_tcp) {
             fprintf(stderr,"FWD TCP from int\n");
-            sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t*)(packet+SIZE_ETH+SIZE_IP);
-            calc_cksum = sr_tcp_cksum(packet+SIZE_ETH, len-SIZE_ETH);
-            if (calc_cksum != tcp_header->tcp_sum){
-                fprintf(stderr,"\t TCP bad checksum %u\n", htons(calc_cksum));
+            if (!sr_meta_l4_ok(packet, meta)){
+                fprintf(stderr,"\t TCP bad checksum\n");
             } else {
                 fprintf(stderr,"\t fwding\n");
-                map = sr_nat_insert_mapping(&(sr->nat),
-                                        ip_header->ip_src,
-                                        tcp_header->tcp_src,
-                                        nat_mapping_tcp);
-                con = sr_nat_update_connection(&(sr->nat), packet+SIZE_ETH, 1);
-                ip_header->ip_src = ext_if->ip;
-                ip_header->ip_sum = 0;
-                ip_header->ip_sum = cksum((uint8_t*)ip_header,SIZE_IP);
-                
-                tcp_header->tcp_src = htons(map->aux_ext);
-                tcp_header->tcp_sum = sr_tcp_cksum(packet+SIZE_ETH, len-SIZE_ETH);
-                sr_free_mapping(map);
+                key.src = meta->src;
+                key.dst = meta->dst;
+                key.sport = meta->sport;
+                key.dport = meta->dport;
+                key.dir = SR_IF_ROLE_INSIDE;
+                if (sr_nat_translate_outbound(&(sr->nat), packet, meta) != 0){
+                    return;
+                }
                 sendIPPacket(sr, packet, len, rt);
+                sr_nat_flow_fill(sr, &key, rt);
             }
             
-        } else if(ip_header->ip_p==1 ) { /*ICMP*/
+        } else if(l4==ip_protocol_udp) {
+            /* the checksum isn't verified: the incremental update keeps
+               a bad one bad for the receiver to catch */
+            fprintf(stderr,"FWD UDP from int\n");
+            if (sr_nat_translate_outbound(&(sr->nat), packet, meta) != 0){
+                return;
+            }
+            sendIPPacket(sr, packet, len, rt);
+        } else if(l4==ip_protocol_icmp) {
             fprintf(stderr,"FWD ICMP from int\n");
-            sr_icmp_t8_hdr_t * icmp_header = (sr_icmp_t8_hdr_t*)(packet+SIZE_ETH+SIZE_IP);
-            incm_cksum = icmp_header->icmp_sum;
-            icmp_header->icmp_sum = 0;
-            calc_cksum = cksum((uint8_t*)icmp_header,len-SIZE_ETH-SIZE_IP);
-            icmp_header->icmp_sum = incm_cksum;
-            if (incm_cksum != calc_cksum){
-                fprintf(stderr,"Bad cksum %d != %d\n", incm_cksum, calc_cksum);
+            sr_icmp_t8_hdr_t * icmp_header = (sr_icmp_t8_hdr_t*)(packet+meta->l4);
+            if (!sr_meta_l4_ok(packet, meta)){
+                fprintf(stderr,"Bad ICMP cksum\n");
             }
             else if (icmp_header->icmp_type == 8 && icmp_header->icmp_code == 0){
                 fprintf(stderr,"\t intfwd icmp id %d\n", icmp_header->icmp_id);
-                map = sr_nat_insert_mapping(&(sr->nat),
-                                        ip_header->ip_src,
-                                        icmp_header->icmp_id,
-                                        nat_mapping_icmp);
-                /*map->ip_ext = ip_header->ip_dst;*/
-                fprintf(stderr,"\t intfwd icmp ext id %d\n", map->aux_ext);
-                icmp_header->icmp_id = map->aux_ext;
-                icmp_header->icmp_sum = 0;
-                icmp_header->icmp_sum = cksum((uint8_t*)icmp_header,len-SIZE_ETH-SIZE_IP);
-                
-                ip_header->ip_src = ext_if->ip;
-                ip_header->ip_sum = 0;
-                ip_header->ip_sum = cksum((uint8_t*)ip_header,SIZE_IP);
-                sr_free_mapping(map);
+                if (sr_nat_translate_outbound(&(sr->nat), packet, meta) != 0){
+                    return;
+                }
                 sendIPPacket(sr, packet, len, rt);
             }
         }
-    } else if (strcmp(rec_iface->name, "eth2") == 0){ /*EXTERNAL*/
+    } else if (rec_iface->nat_role == SR_IF_ROLE_OUTSIDE){ /*EXTERNAL*/
         if (ip_header->ip_ttl <= 1){
             fprintf(stderr,"Packet died\n");
-            sr_send_icmp(sr, packet, len, 11, 0,0);
-        } else if (tgt_iface == NULL) {
+            sr_slowpath_icmp(sr, packet, len, 11, 0,0);
+        } else if (tgt_iface == NULL &&
+                   sr_nat_external_index(&(sr->nat), ip_header->ip_dst) < 0) {
             fprintf(stderr,"NAT Not for us\n");
-        } else if(ip_header->ip_p==6) { /*TCP*/
+        } else if(l4==ip_protocol_tcp) {
+            sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t*)(packet+meta->l4);
+            if (!tcp_header->syn && ntohs(meta->dport) >= 1024 &&
+                !sr_nat_maybe_external(&(sr->nat), meta->dst,
+                                       ntohs(meta->dport), nat_mapping_tcp)){
+                return; /* no mapping, and only a SYN could start one */
+            }
             fprintf(stderr,"FWD TCP from ext\n");
-            sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t*)(packet+SIZE_ETH+SIZE_IP);
-            calc_cksum = sr_tcp_cksum(packet+SIZE_ETH, len-SIZE_ETH);
-            if (calc_cksum != tcp_header->tcp_sum){
-                fprintf(stderr,"\t TCP bad checksum %u\n", htons(calc_cksum));
-            } if (ntohs(tcp_header->tcp_dst) < 1024){
+            if (!sr_meta_l4_ok(packet, meta)){
+                fprintf(stderr,"\t TCP bad checksum\n");
+            } else if (ntohs(meta->dport) < 1024){
                 fprintf(stderr,"\t INVALID PORT TCP\n");
-                sr_send_icmp(sr, packet, len, 3, 3, 0);
+                sr_slowpath_icmp(sr, packet, len, 3, 3, 0);
             } else {
-                map = sr_nat_lookup_external(&(sr->nat),
-                                        ntohs(tcp_header->tcp_dst),
-                                        nat_mapping_tcp);
-                con = sr_nat_update_connection(&(sr->nat), packet+SIZE_ETH, 0);
-                if (map != NULL){/*} && con != NULL){*/
-                    fprintf(stderr,"\t got copy\n");
-                    ip_header->ip_dst = map->ip_int;
-                    ip_header->ip_sum = 0;
-                    ip_header->ip_sum = cksum((uint8_t*)ip_header,SIZE_IP);
-                    
-                    tcp_header->tcp_dst = map->aux_int;
-                    tcp_header->tcp_sum = sr_tcp_cksum(packet+SIZE_ETH, len-SIZE_ETH);
-                    sr_free_mapping(map);
+                key.src = meta->src;
+                key.dst = meta->dst;
+                key.sport = meta->sport;
+                key.dport = meta->dport;
+                key.dir = SR_IF_ROLE_OUTSIDE;
+                if (sr_nat_translate_inbound(&(sr->nat), packet, meta) == 0){
                     rt = (struct sr_rt*)sr_find_routing_entry_int(sr, ip_header->ip_dst);
                     if (rt != NULL){
                         sendIPPacket(sr, packet, len, rt);
+                        sr_nat_flow_fill(sr, &key, rt);
                     }
                 } else if (tcp_header->syn) {
                     rt = (struct sr_rt*)sr_find_routing_entry_int(sr, ip_header->ip_dst);
-                    if (rt != NULL){
-                        map = sr_nat_waiting_mapping(&(sr->nat),
-                                                     ip_header->ip_src,
-                                                     ntohs(tcp_header->tcp_dst),
-                                                     nat_mapping_waiting,
-                                                     packet);
+                    if (rt != NULL &&
+                        sr_nat_waiting_mapping(&(sr->nat),
+                                               meta->src,
+                                               ntohs(meta->dport),
+                                               nat_mapping_waiting,
+                                               packet, meta) == 1){
+                        sr_slowpath_icmp(sr, packet, len, 3, 3, 0);
                     }
                 } /*else {
-                    sr_send_icmp(sr, packet, len, 3, 3, 0);
+                    sr_slowpath_icmp(sr, packet, len, 3, 3, 0);
                 }*/
             }
-        } else if(ip_header->ip_p==1 ) { /*ICMP*/
+        } else if(l4==ip_protocol_udp) {
+            /* unmapped ports are dropped silently, like TCP scan noise */
+            if (sr_nat_translate_inbound(&(sr->nat), packet, meta) == 0){
+                fprintf(stderr,"FWD UDP from ext\n");
+                rt = (struct sr_rt*)sr_find_routing_entry_int(sr, ip_header->ip_dst);
+                if (rt != NULL){
+                    sendIPPacket(sr, packet, len, rt);
+                }
+            }
+        } else if(l4==ip_protocol_icmp) {
+            sr_icmp_t8_hdr_t * icmp_header = (sr_icmp_t8_hdr_t*)(packet+meta->l4);
+            if (!sr_nat_maybe_external(&(sr->nat), meta->dst,
+                                       icmp_header->icmp_id, nat_mapping_icmp)){
+                return; /* only echo replies to a mapped id are forwarded */
+            }
             fprintf(stderr,"FWD ICMP from ext\n");
-            sr_icmp_t8_hdr_t * icmp_header = (sr_icmp_t8_hdr_t*)(packet+SIZE_ETH+SIZE_IP);
-            incm_cksum = icmp_header->icmp_sum;
-            icmp_header->icmp_sum = 0;
-            calc_cksum = cksum((uint8_t*)icmp_header,len-SIZE_ETH-SIZE_IP);
-            icmp_header->icmp_sum = incm_cksum;
-            if (incm_cksum != calc_cksum){
-                fprintf(stderr,"Bad cksum %d != %d\n", incm_cksum, calc_cksum);
+            if (!sr_meta_l4_ok(packet, meta)){
+                fprintf(stderr,"Bad ICMP cksum\n");
             }
             else if (icmp_header->icmp_type == 0 && icmp_header->icmp_code == 0){
                 fprintf(stderr,"\t extfwd icmp id %d\n", icmp_header->icmp_id);
-                map = sr_nat_lookup_external(&(sr->nat),
+                map = sr_nat_lookup_external(&(sr->nat), meta->dst,
                                              icmp_header->icmp_id,
                                              nat_mapping_icmp);
                 if (map != NULL){
@@ -308,13 +313,13 @@ void natHandleIPPacket(struct sr_instance* sr,
                     rt = (struct sr_rt*)sr_find_routing_entry_int(sr, map->ip_int);
                     if (rt != NULL){
                         fprintf(stderr,"\t extfwd found route\n");
+                        icmp_header->icmp_sum = cksum_update16(icmp_header->icmp_sum,
+                                                               icmp_header->icmp_id,
+                                                               map->aux_int);
                         icmp_header->icmp_id = map->aux_int;
-                        icmp_header->icmp_sum = 0;
-                        icmp_header->icmp_sum = cksum((uint8_t*)icmp_header,len-SIZE_ETH-SIZE_IP);
-                        
+                        ip_header->ip_sum = cksum_update32(ip_header->ip_sum,
+                                                           ip_header->ip_dst, map->ip_int);
                         ip_header->ip_dst = map->ip_int;
-                        ip_header->ip_sum = 0;
-                        ip_header->ip_sum = cksum((uint8_t*)ip_header,SIZE_IP);
                         sendIPPacket(sr, packet, len, rt);
                     }
                     sr_free_mapping(map);
@@ -324,11 +329,12 @@ void natHandleIPPacket(struct sr_instance* sr,
     }
 }/* end natHandleIPPacket */
 
-void sr_init(struct sr_instance* sr, 
+int sr_init(struct sr_instance* sr, 
              unsigned short mode,
              unsigned int icmp_timeout,
              unsigned int tcp_est_timeout,
-             unsigned int tcp_trans_timeout)
+             unsigned int tcp_trans_timeout,
+             unsigned int udp_timeout)
 {
     /* REQUIRES */
     assert(sr);
@@ -342,15 +348,78 @@ void sr_init(struct sr_instance* sr,
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
     pthread_t thread;
 
+    sr_tx_init(sr);
     pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);    
+    if (sr_slowpath_init(sr) != 0){
+        fprintf(stderr,"Error starting the slow path\n");
+        return -1;
+    }
+    if (sr_dcache_init(&(sr->dcache)) != 0){
+        fprintf(stderr,"Error allocating the destination cache\n");
+        return -1;
+    }
     /* Add initialization code here! */
     sr->mode = mode;
     if (mode == 1){
         fprintf(stderr,"Nat mode enabled!\n");
-        sr_nat_init(sr, &(sr->nat), icmp_timeout, tcp_est_timeout, tcp_trans_timeout);
+        struct sr_if *iface;
+        int roles = 0, add_pool = (sr->nat.next == 0);
+        for (iface = sr->if_list; iface != NULL; iface = iface->next){
+            roles |= iface->nat_role;
+        }
+        if (roles == SR_IF_ROLE_NONE){
+            sr_if_set_roles(sr, "eth1", SR_IF_ROLE_INSIDE);
+            sr_if_set_roles(sr, "eth2", SR_IF_ROLE_OUTSIDE);
+        }
+        for (iface = sr->if_list; iface != NULL && add_pool; iface = iface->next){
+            /* no pool configured: translate to the outside addresses */
+            if (iface->nat_role == SR_IF_ROLE_OUTSIDE){
+                sr_nat_add_external(&(sr->nat), iface->ip);
+            }
+        }
+        if (sr_nat_init(sr, &(sr->nat), icmp_timeout, tcp_est_timeout,
+                        tcp_trans_timeout, udp_timeout) != 0){
+            fprintf(stderr,"Error setting up the NAT\n");
+            return -1;
+        }
     }
+    return 0;
 } /* -- sr_init -- */
 
+/* Everything sr_handlepacket does once the frame has been parsed and
+   checked into meta */
+static void sr_handleparsed(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        char* interface/* lent */,
+        const struct sr_meta *meta)
+{
+    fprintf(stderr,"*** -> Received packet of length %d \n",len);
+    print_hdrs(packet,len);
+    struct sr_if * iface = sr_get_interface(sr, interface);
+    /* handlers rewrite the frame in place; anything that outlives
+       this call (ARP queue, pending SYNs, ICMP work) copies it */
+    uint8_t frame[SR_RX_FRAME];
+    uint8_t* ether_packet = (len <= sizeof(frame)) ? frame : malloc((size_t)len);
+    struct sr_meta m = *meta; /* the handlers note the L4 checksum in it */
+    memcpy(ether_packet,packet,len);
+    if(m.type == ethertype_arp){
+        handleARPpacket(sr, ether_packet, len, iface);
+    }else if(m.type == ethertype_ip){
+        if (sr->mode == 0){
+            handleIPPacket(sr, ether_packet, len, iface, &m);
+        } else if (sr->mode == 1){
+            /*handleIPPacket(sr, ether_packet, len, iface, &m);*/
+            natHandleIPPacket(sr, ether_packet, len, iface, &m);
+        }
+    }else{
+        fprintf(stderr,"Unsupported Protocol!\n");
+    }
+    if (ether_packet != frame){
+        free(ether_packet);
+    }
+}/* end sr_handleparsed */
+
 /*---------------------------------------------------------------------
  * Method: sr_handlepacket(uint8_t* p,char* interface)
  * Scope:  Global
@@ -371,32 +440,99 @@ void sr_handlepacket(struct sr_instance* sr,
         unsigned int len,
         char* interface/* lent */)
 {
+    struct sr_meta meta;
+
     assert(sr);
     assert(packet);
     assert(interface);
-    fprintf(stderr,"*** -> Received packet of length %d \n",len);
-    print_hdrs(packet,len);
-    struct sr_if * iface = sr_get_interface(sr, interface);
-    if(len>=34){
-        uint8_t* ether_packet = malloc((size_t)(len+28));
-        memcpy(ether_packet,packet,len);
-        uint16_t packet_type = ethertype(ether_packet);
-        if(packet_type == ethertype_arp){
-            handleARPpacket(sr, ether_packet, len, iface);
-        }else if(packet_type==ethertype_ip){
-            if (sr->mode == 0){
-                handleIPPacket(sr, ether_packet, len, iface);
-            } else if (sr->mode == 1){
-                /*handleIPPacket(sr, ether_packet, len, iface);*/
-                natHandleIPPacket(sr, ether_packet, len, iface);
+    if (sr_parse(packet, len, &meta) != 0){
+        fprintf(stderr,"*** -> Dropped malformed packet of length %d \n",len);
+        return;
+    }
+    sr_handleparsed(sr, packet, len, interface, &meta);
+}/* end sr_handlepacket */
+
+/* Pass 1 of a burst: parse the frame, then find the cache slot it will
+   probe (the destination cache in router mode, the flow cache in NAT
+   mode) and start loading it. Returns the slot, or NULL if the frame
+   won't probe one. */
+static const void *sr_burst_prefetch(struct sr_instance* sr,
+        struct sr_rx_frame *frame)
+{
+    struct sr_if *iface;
+
+    if (frame->meta.type != ethertype_ip){
+        return NULL;
+    }
+    if (sr->mode == 0){
+        return sr_dcache_prefetch(&(sr->dcache), frame->meta.dst);
+    }
+    iface = sr_get_interface(sr, frame->iface);
+    if (iface == NULL){
+        return NULL;
+    }
+    return sr_nat_flow_prefetch(sr, frame->buf, &(frame->meta), iface);
+}/* end sr_burst_prefetch */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handleburst(struct sr_instance* sr, struct sr_rx_frame* frames, int n)
+ * Scope:  Global
+ *
+ * Handle n received frames as sr_handlepacket would, one after the other,
+ * but first walk the whole burst so the cache lines each frame needs are
+ * in flight together rather than missed one at a time: every frame is
+ * parsed and its cache slot prefetched, then the ARP, mapping and
+ * connection entries the slots point at. Whatever the burst sends is
+ * handed to the TX thread in one go.
+ *
+ *---------------------------------------------------------------------*/
+void sr_handleburst(struct sr_instance* sr,
+        struct sr_rx_frame *frames /* lent */,
+        int n)
+{
+    const void *slots[SR_RX_BURST];
+    struct sr_rx_frame *frame;
+    int i, base, cnt;
+
+    assert(sr);
+    for (base = 0; base < n; base += cnt){
+        cnt = (n - base < SR_RX_BURST) ? n - base : SR_RX_BURST;
+        for (i = 0; i < cnt; i++){
+            frame = &(frames[base+i]);
+            if (!frame->parsed && sr_parse(frame->buf, frame->len, &(frame->meta)) != 0){
+                frame->meta.type = 0; /* malformed: skipped below */
             }
-        }else{
-            fprintf(stderr,"Unsupported Protocol!\n");
+            frame->parsed = 1;
+            slots[i] = sr_burst_prefetch(sr, frame);
         }
-        free(ether_packet);
+        for (i = 0; i < cnt; i++){
+            if (slots[i] == NULL){
+                continue;
+            } else if (sr->mode == 0){
+                sr_dcache_prefetch_next(sr, (const struct sr_dcache_entry *)slots[i]);
+            } else {
+                sr_nat_flow_prefetch_next(sr, (const struct sr_nat_flow *)slots[i]);
+            }
+        }
+        sr_tx_hold(sr);
+        for (i = 0; i < cnt; i++){
+            frame = &(frames[base+i]);
+            if (frame->meta.type == 0){
+                fprintf(stderr,"*** -> Dropped malformed packet of length %d \n",
+                        frame->len);
+            } else {
+                sr_handleparsed(sr, frame->buf, frame->len, frame->iface,
+                                &(frame->meta));
+            }
+        }
+        sr_tx_release(sr);
     }
-}/* end sr_handlepacket */
+}/* end sr_handleburst */
 
+/* Send ICMP error type/code about the frame in buf, from ip_src or the
+   egress interface's address. The error quotes the offending IP header,
+   options included, and the 8 bytes after it (RFC 792), zero padded if the
+   frame is shorter; only that much of buf is read. */
 void sr_send_icmp(struct sr_instance* sr,
         uint8_t *buf,
         unsigned int len, 
@@ -405,53 +541,78 @@ void sr_send_icmp(struct sr_instance* sr,
         uint32_t ip_src){
 	fprintf(stderr,"Send ICMP type %d code %d to\n",type, code);
 
-    uint8_t* packet = malloc(len+SIZE_ICMP);
-    memset(packet,0,len+SIZE_ICMP);
-    memcpy(packet,buf,len);
-    sr_ethernet_hdr_t* eth_header = (sr_ethernet_hdr_t*) packet;
-    sr_ip_hdr_t* ip_header = (sr_ip_hdr_t*)(packet+SIZE_ETH);
-    sr_icmp_t3_hdr_t* icmp_header = (sr_icmp_t3_hdr_t*)(packet+SIZE_ETH+SIZE_IP);
-    struct sr_rt* rt = sr_find_routing_entry_int(sr, ip_header->ip_src);
+    sr_ip_hdr_t* orig_ip = (sr_ip_hdr_t*)(buf+SIZE_ETH);
+    struct sr_rt* rt = sr_find_routing_entry_int(sr, orig_ip->ip_src);
     
     if(rt){
         fprintf(stderr,"Found route %s\n",rt->interface);
         struct sr_if* iface = sr_get_interface(sr, rt->interface);
+        uint8_t packet[SIZE_ETH+SIZE_IP+SIZE_ICMP];
+        sr_ip_hdr_t* ip_header = (sr_ip_hdr_t*)(packet+SIZE_ETH);
+        sr_icmp_t3_hdr_t* icmp_header = (sr_icmp_t3_hdr_t*)(packet+SIZE_ETH+SIZE_IP);
+        int quote_size = orig_ip->ip_hl*4 + 8;
+        int data_size;
+        int icmp_size = SIZE_ICMP - ICMP_DATA_SIZE + quote_size;
 
-        if(type !=0 || code != 0){
-            int data_size;
-            if (len < SIZE_ETH+ICMP_DATA_SIZE){
-                data_size = len-SIZE_ETH;
-            } else {
-                data_size = ICMP_DATA_SIZE;
-            }
-            fprintf(stderr,"ICMP data size = %d", data_size);
-            memcpy(icmp_header->data,buf+SIZE_ETH,data_size);
-            icmp_header->unused = 0;
-            icmp_header->next_mtu = 0;
-            len = SIZE_ETH+SIZE_IP+SIZE_ICMP;
-        }
-        icmp_header->icmp_type = type;
-        icmp_header->icmp_code = code;
-        icmp_header->icmp_sum = 0;
-        icmp_header->icmp_sum = cksum((uint8_t*)icmp_header,len-SIZE_ETH-SIZE_IP);
-        memcpy(eth_header->ether_shost,iface->addr,6);
-        eth_header->ether_type = htons(0x0800);
         if (ip_src == 0){
             ip_src = iface->ip;
         }
-        ip_header->ip_hl = 5;
-        ip_header->ip_v = 4;
-        ip_header->ip_tos = 0;
-        ip_header->ip_len = htons(len-SIZE_ETH);
-        /*ip_header->ip_id = ip_header->ip_id*/
-        ip_header->ip_off = htons(IP_DF);
-        ip_header->ip_ttl = INIT_TTL;
-        ip_header->ip_p = 1;
-        ip_header->ip_sum = 0;
-        ip_header->ip_dst = ip_header->ip_src;
+        if (len < SIZE_ETH+quote_size){
+            data_size = len-SIZE_ETH;
+        } else {
+            data_size = quote_size;
+        }
+        fprintf(stderr,"ICMP data size = %d", data_size);
+
+        /* the interface's error skeleton: quote what we have of the
+           offending datagram, then patch length, ids, addresses and type */
+        memcpy(packet, iface->tmpl.icmp_err, sizeof(packet));
+        memcpy(icmp_header->data, buf+SIZE_ETH, data_size);
+        icmp_header->icmp_type = type;
+        icmp_header->icmp_code = code;
+        icmp_header->icmp_sum = cksum((uint8_t*)icmp_header, icmp_size);
+
+        ip_header->ip_len = htons(SIZE_IP+icmp_size);
+        ip_header->ip_id = orig_ip->ip_id;
         ip_header->ip_src = ip_src;
-        ip_header->ip_sum = cksum((uint8_t*)(ip_header),SIZE_IP);
+        ip_header->ip_dst = orig_ip->ip_src;
+        ip_header->ip_sum = cksum_finish(iface->tmpl.icmp_ip_sum +
+                                         cksum_partial(&(ip_header->ip_len), 4) +
+                                         cksum_partial(&(ip_header->ip_src), 8));
       
-        sendIPPacket(sr,packet,len,rt);
+        sendIPPacket(sr,packet,SIZE_ETH+SIZE_IP+icmp_size,rt);
     }
-}/* end sr_send_icmp */
\ No newline at end of file
+}/* end sr_send_icmp */
+
+/* Turn the echo request in packet into its reply where it lies: swap the
+   addresses (which leaves the IP checksum alone), patch type, TTL and
+   flags with incremental checksum updates, and send it back */
+void sr_send_echo_reply(struct sr_instance* sr,
+        uint8_t *packet,
+        unsigned int len,
+        const struct sr_meta *meta){
+    sr_ip_hdr_t* ip_header = (sr_ip_hdr_t*)(packet+meta->l3);
+    sr_icmp_hdr_t* icmp_header = (sr_icmp_hdr_t*)(packet+meta->l4);
+    struct sr_rt* rt = sr_find_routing_entry_int(sr, ip_header->ip_src);
+    uint32_t peer = ip_header->ip_src;
+    uint16_t old, new;
+
+    if (rt == NULL){
+        return;
+    }
+    memcpy(&old, &(icmp_header->icmp_type), 2);
+    icmp_header->icmp_type = 0;
+    memcpy(&new, &(icmp_header->icmp_type), 2);
+    icmp_header->icmp_sum = cksum_update16(icmp_header->icmp_sum, old, new);
+
+    ip_header->ip_src = ip_header->ip_dst;
+    ip_header->ip_dst = peer;
+    memcpy(&old, &(ip_header->ip_ttl), 2);
+    ip_header->ip_ttl = INIT_TTL;
+    memcpy(&new, &(ip_header->ip_ttl), 2);
+    ip_header->ip_sum = cksum_update16(ip_header->ip_sum, old, new);
+    ip_header->ip_sum = cksum_update16(ip_header->ip_sum, ip_header->ip_off, htons(IP_DF));
+    ip_header->ip_off = htons(IP_DF);
+
+    sendIPPacket(sr, packet, len, rt);
+}/* end sr_send_echo_reply */
\ No newline at end of file
@@ -16,6 +16,11 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_nat.h"
+#include "sr_slowpath.h"
+#include "sr_tx.h"
+#include "sr_pipeline.h"
+#include "sr_dcache.h"
+#include "sr_parse.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -30,6 +35,8 @@
 
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
+#define SR_RX_FRAME 2048  /* frames up to this are handled in a stack copy */
+#define SR_RX_BURST 64    /* frames prefetched together by sr_handleburst */
 
 /* forward declare */
 struct sr_if;
@@ -51,14 +58,33 @@ struct sr_instance
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
+    struct sr_if* if_index[SR_IF_MAX];  /* by sr_if.index */
+    struct sr_if* if_names[SR_IF_SLOTS]; /* open addressed by name */
+    struct sr_if* if_ips[SR_IF_SLOTS];   /* open addressed by ip */
+    unsigned int nifs;
     struct sr_rt* routing_table; /* routing table */
     struct sr_arpcache cache;   /* ARP cache */
     pthread_attr_t attr;
     struct sr_nat nat;
+    struct sr_slowpath slowpath; /* deferred ICMP / ARP work */
+    struct sr_tx tx;             /* socket writer */
+    struct sr_pipeline pipeline; /* worker threads, if enabled */
+    struct sr_dcache dcache;     /* router mode destination cache */
     unsigned short mode;
     FILE* logfile;
 };
 
+/* One received frame of a burst; both buffers are lent, as for
+   sr_handlepacket. Unless parsed is set, sr_handleburst fills meta in. */
+struct sr_rx_frame
+{
+    uint8_t *buf;
+    unsigned int len;
+    char *iface;
+    int parsed;             /* meta already filled in by sr_parse */
+    struct sr_meta meta;
+};
+
 /* -- sr_main.c -- */
 int sr_verify_routing_table(struct sr_instance* sr);
 
@@ -68,13 +94,19 @@ int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
 
 /* -- sr_router.c -- */
-void sr_init(struct sr_instance* sr, 
+/* Returns 0, or -1 if a subsystem the packet path relies on (slow path,
+   destination cache, NAT tables) could not be set up */
+int sr_init(struct sr_instance* sr, 
              unsigned short mode,
              unsigned int icmp_timeout,
              unsigned int tcp_est_timeout,
-             unsigned int tcp_trans_timeout);
+             unsigned int tcp_trans_timeout,
+             unsigned int udp_timeout);
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
+void sr_handleburst(struct sr_instance* sr, struct sr_rx_frame *frames, int n);
 void sr_send_icmp(struct sr_instance* sr, uint8_t *packet, unsigned int len, uint8_t type, uint8_t code, uint32_t ip_src);
+void sr_send_echo_reply(struct sr_instance* sr, uint8_t *packet, unsigned int len,
+        const struct sr_meta *meta);
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
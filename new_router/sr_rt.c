@@ -99,6 +99,8 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     assert(if_name);
     assert(sr);
 
+    sr_dcache_invalidate(&(sr->dcache));
+
     /* -- empty list special case -- */
     if(sr->routing_table == 0)
     {
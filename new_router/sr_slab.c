@@ -0,0 +1,135 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.c
+ *
+ * Description:
+ *
+ * Fixed-size object allocator, see sr_slab.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "sr_slab.h"
+
+/* Map one arena aligned to SR_SLAB_ARENA. Returns NULL on failure. */
+static void *sr_slab_map(int huge)
+{
+    char *raw, *aligned;
+    uintptr_t off;
+
+#ifdef MAP_HUGETLB
+    if (huge) {
+        raw = mmap(NULL, SR_SLAB_ARENA, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (raw != MAP_FAILED) {
+            return raw;
+        }
+    }
+#endif
+
+    /* over-map and trim to get the alignment */
+    raw = mmap(NULL, 2 * SR_SLAB_ARENA, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    off = (uintptr_t)raw & (SR_SLAB_ARENA - 1);
+    aligned = raw + (off ? SR_SLAB_ARENA - off : 0);
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + SR_SLAB_ARENA, (raw + 2 * SR_SLAB_ARENA) - (aligned + SR_SLAB_ARENA));
+
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+        madvise(aligned, SR_SLAB_ARENA, MADV_HUGEPAGE);
+    }
+#endif
+    return aligned;
+} /* -- sr_slab_map -- */
+
+int sr_slab_init(struct sr_slab *slab, size_t size, size_t align, int huge)
+{
+    memset(slab, 0, sizeof(struct sr_slab));
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    slab->align = align;
+    slab->size = (size + align - 1) & ~(align - 1);
+    slab->huge = huge;
+    return pthread_mutex_init(&(slab->lock), NULL);
+} /* -- sr_slab_init -- */
+
+void sr_slab_destroy(struct sr_slab *slab)
+{
+    struct sr_slab_arena *arena, *next;
+
+    for (arena = slab->arenas; arena != NULL; arena = next) {
+        next = arena->next;
+        munmap(arena, SR_SLAB_ARENA);
+    }
+    slab->arenas = NULL;
+    slab->free = NULL;
+    slab->cur = slab->end = NULL;
+    pthread_mutex_destroy(&(slab->lock));
+} /* -- sr_slab_destroy -- */
+
+void *sr_slab_alloc(struct sr_slab *slab)
+{
+    struct sr_slab_arena *arena;
+    void *obj;
+    size_t hdr;
+
+    pthread_mutex_lock(&(slab->lock));
+    if (slab->free != NULL) {
+        obj = slab->free;
+        slab->free = *(void **)obj;
+    } else {
+        if (slab->cur == NULL || slab->cur + slab->size > slab->end) {
+            arena = (struct sr_slab_arena *)sr_slab_map(slab->huge);
+            if (arena == NULL) {
+                pthread_mutex_unlock(&(slab->lock));
+                fprintf(stderr, "sr_slab: out of memory\n");
+                return NULL;
+            }
+            arena->slab = slab;
+            arena->next = slab->arenas;
+            slab->arenas = arena;
+            slab->narenas++;
+            hdr = (sizeof(struct sr_slab_arena) + slab->align - 1) & ~(slab->align - 1);
+            slab->cur = (char *)arena + hdr;
+            slab->end = (char *)arena + SR_SLAB_ARENA;
+        }
+        obj = slab->cur;
+        slab->cur += slab->size;
+    }
+    slab->inuse++;
+    pthread_mutex_unlock(&(slab->lock));
+    return obj;
+} /* -- sr_slab_alloc -- */
+
+/* The object goes back on the free list, never back to the system: arenas
+   are only unmapped by sr_slab_destroy. The NAT flow cache relies on this to
+   read a stale mapping pointer, so a slab must outlive every flow-cache entry
+   that may point into it. */
+void sr_slab_free(void *obj)
+{
+    struct sr_slab_arena *arena;
+    struct sr_slab *slab;
+
+    if (obj == NULL) {
+        return;
+    }
+    arena = (struct sr_slab_arena *)((uintptr_t)obj & ~(uintptr_t)(SR_SLAB_ARENA - 1));
+    slab = arena->slab;
+
+    pthread_mutex_lock(&(slab->lock));
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    pthread_mutex_unlock(&(slab->lock));
+} /* -- sr_slab_free -- */
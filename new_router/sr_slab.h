@@ -0,0 +1,52 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.h
+ *
+ * Description:
+ *
+ * Fixed-size object allocator. Objects are carved out of 2MB arenas,
+ * aligned to the arena size, so sr_slab_free finds the owning slab from the
+ * object address alone (the arena header holds it) and can be used as an
+ * epoch retire callback. Freed objects go on a free list and are reused
+ * before the bump pointer advances; arenas are only returned on destroy.
+ * Arenas are optionally backed by huge pages (MAP_HUGETLB, falling back to
+ * transparent huge pages when none are reserved).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SLAB_H
+#define SR_SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SR_SLAB_ARENA (2UL << 20)
+
+struct sr_slab_arena {
+    struct sr_slab *slab;
+    struct sr_slab_arena *next;
+};
+
+struct sr_slab {
+    pthread_mutex_t lock;
+    size_t size;                  /* object size, a multiple of align */
+    size_t align;
+    int huge;                     /* back arenas with huge pages */
+    void *free;                   /* singly linked through the objects */
+    char *cur, *end;              /* bump region of the newest arena */
+    struct sr_slab_arena *arenas;
+
+    unsigned long narenas;
+    unsigned long inuse;          /* live objects */
+};
+
+/* size is rounded up to align (a power of two). Returns 0 on success. */
+int   sr_slab_init(struct sr_slab *slab, size_t size, size_t align, int huge);
+void  sr_slab_destroy(struct sr_slab *slab);
+
+/* Returns uninitialized memory, or NULL when out of memory */
+void *sr_slab_alloc(struct sr_slab *slab);
+
+/* obj must come from some slab's sr_slab_alloc */
+void  sr_slab_free(void *obj);
+
+#endif /* -- SR_SLAB_H -- */
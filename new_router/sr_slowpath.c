@@ -0,0 +1,132 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slowpath.c
+ *
+ * Description:
+ *
+ * Control thread that drains deferred ICMP / ARP work, see sr_slowpath.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sr_slowpath.h"
+#include "sr_router.h"
+#include "sr_arpcache.h"
+
+static void sr_slowpath_push(struct sr_instance *sr, struct sr_work *work)
+{
+    struct sr_slowpath *sp = &(sr->slowpath);
+
+    if (!sr_ring_enqueue(&(sp->ring), work)) {
+        __atomic_add_fetch(&(sp->dropped), 1, __ATOMIC_RELAXED);
+        sr_slab_free(work);
+        return;
+    }
+    sem_post(&(sp->wakeup));
+}
+
+int sr_slowpath_init(struct sr_instance *sr)
+{
+    struct sr_slowpath *sp = &(sr->slowpath);
+
+    sp->dropped = 0;
+    if (sr_ring_init(&(sp->ring), SR_SLOWPATH_SZ) != 0) {
+        return -1;
+    }
+    if (sr_slab_init(&(sp->items), SR_WORK_SIZE, sizeof(void *), 0) != 0) {
+        sr_ring_destroy(&(sp->ring));
+        return -1;
+    }
+    if (sr_icmplim_init(&(sp->limit)) != 0) {
+        sr_slab_destroy(&(sp->items));
+        sr_ring_destroy(&(sp->ring));
+        return -1;
+    }
+    if (sem_init(&(sp->wakeup), 0, 0) != 0) {
+        pthread_mutex_destroy(&(sp->limit.lock));
+        sr_slab_destroy(&(sp->items));
+        sr_ring_destroy(&(sp->ring));
+        return -1;
+    }
+    if (pthread_create(&(sp->thread), &(sr->attr), sr_slowpath_thread, sr) != 0) {
+        sem_destroy(&(sp->wakeup));
+        pthread_mutex_destroy(&(sp->limit.lock));
+        sr_slab_destroy(&(sp->items));
+        sr_ring_destroy(&(sp->ring));
+        return -1;
+    }
+    return 0;
+} /* -- sr_slowpath_init -- */
+
+void sr_slowpath_icmp(struct sr_instance *sr, uint8_t *buf, unsigned int len,
+                      uint8_t type, uint8_t code, uint32_t ip_src)
+{
+    struct sr_work *work;
+    sr_ip_hdr_t *ip_header = (sr_ip_hdr_t *)(buf+SIZE_ETH);
+
+    if (!sr_icmplim_allow(&(sr->slowpath.limit), ip_header->ip_src, type)) {
+        return;
+    }
+    /* Keep only what the error quotes: the IP header with its options and
+       the first 8 bytes after it, at most ICMP_DATA_SIZE */
+    if (len > SIZE_ETH + ip_header->ip_hl*4 + 8) {
+        len = SIZE_ETH + ip_header->ip_hl*4 + 8;
+    }
+    work = (struct sr_work *)sr_slab_alloc(&(sr->slowpath.items));
+    if (work == NULL) {
+        return;
+    }
+    work->kind = SR_WORK_ICMP;
+    work->type = type;
+    work->code = code;
+    work->ip = ip_src;
+    work->len = len;
+    work->buf = (uint8_t *)(work + 1);
+    memcpy(work->buf, buf, len);
+    sr_slowpath_push(sr, work);
+} /* -- sr_slowpath_icmp -- */
+
+void sr_slowpath_arpreq(struct sr_instance *sr, uint32_t ip, int ifindex)
+{
+    struct sr_work *work = (struct sr_work *)sr_slab_alloc(&(sr->slowpath.items));
+
+    if (work == NULL) {
+        return;
+    }
+    work->kind = SR_WORK_ARPREQ;
+    work->ip = ip;
+    work->len = 0;
+    work->buf = NULL;
+    work->ifindex = ifindex;
+    sr_slowpath_push(sr, work);
+} /* -- sr_slowpath_arpreq -- */
+
+void *sr_slowpath_thread(void *sr_ptr)
+{
+    struct sr_instance *sr = (struct sr_instance *)sr_ptr;
+    struct sr_slowpath *sp = &(sr->slowpath);
+    struct sr_work *work;
+
+    while (1) {
+        if (sem_wait(&(sp->wakeup)) != 0 && errno != EINTR) {
+            perror("sem_wait(..):sr_slowpath_thread");
+            return NULL;
+        }
+        while ((work = (struct sr_work *)sr_ring_dequeue(&(sp->ring))) != NULL) {
+            switch (work->kind) {
+                case SR_WORK_ICMP:
+                    sr_send_icmp(sr, work->buf, work->len,
+                                 work->type, work->code, work->ip);
+                    break;
+                case SR_WORK_ARPREQ:
+                    sr_send_arp_request(sr, work->ip, work->ifindex);
+                    break;
+            }
+            sr_slab_free(work);
+        }
+    }
+    return NULL;
+} /* -- sr_slowpath_thread -- */
@@ -0,0 +1,68 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slowpath.h
+ *
+ * Description:
+ *
+ * Deferred slow-path work. Timers and the forwarding path hand "send ICMP
+ * X for this header" and "send ARP request for Y" items to a control thread
+ * through a lock-free ring instead of doing route lookups, allocation and
+ * socket writes while they hold the ARP cache or NAT locks.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SLOWPATH_H
+#define SR_SLOWPATH_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "sr_protocol.h"
+#include "sr_ring.h"
+#include "sr_slab.h"
+#include "sr_icmplimit.h"
+
+#define SR_SLOWPATH_SZ 1024
+
+#define SR_WORK_ICMP   1
+#define SR_WORK_ARPREQ 2
+
+struct sr_instance;
+
+struct sr_work {
+    uint8_t kind;
+    uint8_t type;               /* ICMP type */
+    uint8_t code;               /* ICMP code */
+    uint32_t ip;                /* ICMP source override, or ARP target ip */
+    int ifindex;                  /* outgoing interface for ARP requests */
+    unsigned int len;
+    uint8_t *buf;               /* points just past the item */
+};
+
+/* Items come from a pool, each with room for the most an error quotes
+   (ICMP_DATA_SIZE, a full 60 byte IP header and 8 bytes more) */
+#define SR_WORK_SIZE (sizeof(struct sr_work) + SIZE_ETH + ICMP_DATA_SIZE)
+
+struct sr_slowpath {
+    struct sr_ring ring;
+    sem_t wakeup;
+    unsigned long dropped;      /* items lost to a full ring */
+    struct sr_slab items;       /* SR_WORK_SIZE */
+    struct sr_icmplim limit;    /* checked before an error is queued */
+    pthread_t thread;
+};
+
+/* Returns 0, or -1 with nothing left allocated or running */
+int   sr_slowpath_init(struct sr_instance *sr);
+void *sr_slowpath_thread(void *sr_ptr);
+
+/* Queue an ICMP error of type/code in response to the frame in buf, unless
+   the rate limit suppresses it. Only the part of the frame the error quotes
+   is copied, so buf stays borrowed. */
+void  sr_slowpath_icmp(struct sr_instance *sr, uint8_t *buf, unsigned int len,
+                       uint8_t type, uint8_t code, uint32_t ip_src);
+
+/* Queue an ARP request for ip out of interface ifindex. */
+void  sr_slowpath_arpreq(struct sr_instance *sr, uint32_t ip, int ifindex);
+
+#endif /* -- SR_SLOWPATH_H -- */
@@ -0,0 +1,173 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_tx.c
+ *
+ * Description:
+ *
+ * TX thread for the VNS socket, see sr_tx.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "sr_tx.h"
+#include "sr_router.h"
+#include "vnscommand.h"
+
+/* Sends queued by this thread since its outermost sr_tx_hold */
+static __thread int sr_tx_held = 0;
+static __thread unsigned int sr_tx_pending = 0;
+
+/* Write every byte described by iov, resuming after short writes. */
+static int sr_tx_writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t ret;
+
+    while (cnt > 0) {
+        ret = writev(fd, iov, cnt);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (cnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+} /* -- sr_tx_writev_all -- */
+
+int sr_tx_init(struct sr_instance *sr)
+{
+    struct sr_tx *tx = &(sr->tx);
+
+    tx->dropped = 0;
+    tx->writes = 0;
+    tx->msgs = 0;
+    if (sr_ring_init(&(tx->ring), SR_TX_SZ) != 0) {
+        return -1;
+    }
+    if (sr_slab_init(&(tx->bufs), SR_TX_BUF, SR_CACHE_LINE, 0) != 0) {
+        return -1;
+    }
+    if (sem_init(&(tx->wakeup), 0, 0) != 0) {
+        return -1;
+    }
+    if (pthread_create(&(tx->thread), &(sr->attr), sr_tx_thread, sr) != 0) {
+        return -1;
+    }
+    __atomic_store_n(&(tx->running), 1, __ATOMIC_RELEASE);
+    return 0;
+} /* -- sr_tx_init -- */
+
+void *sr_tx_alloc(struct sr_instance *sr, unsigned int len)
+{
+    struct sr_tx *tx = &(sr->tx);
+
+    if (tx->bufs.size != 0 && len <= SR_TX_BUF) {
+        return sr_slab_alloc(&(tx->bufs));
+    }
+    return malloc(len);
+} /* -- sr_tx_alloc -- */
+
+void sr_tx_free(struct sr_instance *sr, void *msg, unsigned int len)
+{
+    if (sr->tx.bufs.size != 0 && len <= SR_TX_BUF) {
+        sr_slab_free(msg);
+    } else {
+        free(msg);
+    }
+} /* -- sr_tx_free -- */
+
+int sr_tx_enqueue(struct sr_instance *sr, void *msg, unsigned int len)
+{
+    struct sr_tx *tx = &(sr->tx);
+    struct iovec iov;
+    int ret;
+
+    if (!__atomic_load_n(&(tx->running), __ATOMIC_ACQUIRE)) {
+        iov.iov_base = msg;
+        iov.iov_len = len;
+        ret = sr_tx_writev_all(sr->sockfd, &iov, 1);
+        sr_tx_free(sr, msg, len);
+        if (ret != 0) {
+            fprintf(stderr, "Error writing packet\n");
+        }
+        return ret;
+    }
+
+    if (!sr_ring_enqueue(&(tx->ring), msg)) {
+        __atomic_add_fetch(&(tx->dropped), 1, __ATOMIC_RELAXED);
+        sr_tx_free(sr, msg, len);
+        return -1;
+    }
+    if (sr_tx_held) {
+        sr_tx_pending++;
+        return 0;
+    }
+    sem_post(&(tx->wakeup));
+    return 0;
+} /* -- sr_tx_enqueue -- */
+
+void sr_tx_hold(struct sr_instance *sr)
+{
+    sr_tx_held++;
+} /* -- sr_tx_hold -- */
+
+void sr_tx_release(struct sr_instance *sr)
+{
+    if (--sr_tx_held == 0 && sr_tx_pending != 0) {
+        sr_tx_pending = 0;
+        sem_post(&(sr->tx.wakeup));
+    }
+} /* -- sr_tx_release -- */
+
+void *sr_tx_thread(void *sr_ptr)
+{
+    struct sr_instance *sr = (struct sr_instance *)sr_ptr;
+    struct sr_tx *tx = &(sr->tx);
+    struct iovec iov[SR_TX_BATCH];
+    void *msgs[SR_TX_BATCH];
+    int cnt, i;
+
+    while (1) {
+        if (sem_wait(&(tx->wakeup)) != 0 && errno != EINTR) {
+            perror("sem_wait(..):sr_tx_thread");
+            return NULL;
+        }
+
+        /* Drain everything that is queued, up to SR_TX_BATCH per writev() */
+        do {
+            for (cnt = 0; cnt < SR_TX_BATCH; cnt++) {
+                msgs[cnt] = sr_ring_dequeue(&(tx->ring));
+                if (msgs[cnt] == NULL) {
+                    break;
+                }
+                iov[cnt].iov_base = msgs[cnt];
+                iov[cnt].iov_len = ntohl(((c_packet_header *)msgs[cnt])->mLen);
+            }
+            if (cnt == 0) {
+                break;
+            }
+            if (sr_tx_writev_all(sr->sockfd, iov, cnt) != 0) {
+                perror("writev(..):sr_tx_thread");
+            }
+            tx->writes++;
+            tx->msgs += cnt;
+            for (i = 0; i < cnt; i++) {
+                sr_tx_free(sr, msgs[i], ntohl(((c_packet_header *)msgs[i])->mLen));
+            }
+        } while (cnt == SR_TX_BATCH);
+    }
+    return NULL;
+} /* -- sr_tx_thread -- */
@@ -0,0 +1,59 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_tx.h
+ *
+ * Description:
+ *
+ * Single owner of the write side of the VNS socket. Every thread that sends
+ * (the receive loop, the ARP and NAT sweepers, the slow-path thread) hands a
+ * fully framed VNS message to a lock-free queue; one TX thread drains it and
+ * writes messages back to back with writev(), so frames can never interleave
+ * on sr->sockfd and bursts go out in a single system call.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TX_H
+#define SR_TX_H
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "sr_ring.h"
+#include "sr_slab.h"
+
+#define SR_TX_SZ    4096
+#define SR_TX_BATCH 64
+#define SR_TX_BUF   2048        /* pooled message: header plus a full frame */
+
+struct sr_instance;
+
+struct sr_tx {
+    struct sr_ring ring;
+    sem_t wakeup;
+    int running;
+    unsigned long dropped;      /* messages lost to a full queue */
+    unsigned long writes;       /* writev() calls issued */
+    unsigned long msgs;         /* messages written */
+    struct sr_slab bufs;        /* SR_TX_BUF messages, size 0 until init */
+    pthread_t thread;
+};
+
+int   sr_tx_init(struct sr_instance *sr);
+void *sr_tx_thread(void *sr_ptr);
+
+/* A buffer for a message of len bytes, from the pool when it fits and
+   malloc'd otherwise; sr_tx_free tells them apart by len. */
+void *sr_tx_alloc(struct sr_instance *sr, unsigned int len);
+void  sr_tx_free(struct sr_instance *sr, void *msg, unsigned int len);
+
+/* Queue a framed VNS message of len bytes (the header's mLen). Takes
+   ownership of msg, which must come from sr_tx_alloc. Falls back to a
+   direct write if the TX thread isn't running yet. Returns 0 on success. */
+int   sr_tx_enqueue(struct sr_instance *sr, void *msg, unsigned int len);
+
+/* Between hold and release, messages this thread queues don't wake the TX
+   thread; release wakes it once, so a burst goes out in one writev().
+   Holds nest. */
+void  sr_tx_hold(struct sr_instance *sr);
+void  sr_tx_release(struct sr_instance *sr);
+
+#endif /* -- SR_TX_H -- */
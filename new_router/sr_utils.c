@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include "sr_protocol.h"
 #include "sr_utils.h"
 
@@ -20,25 +21,88 @@ uint16_t cksum (const void *_data, int len) {
 }
 
 uint16_t sr_tcp_cksum(void * packet, unsigned int len){
-   unsigned int tcp_len = len-SIZE_IP;
-   unsigned int new_len = tcp_len+SIZE_PTCP+(tcp_len+SIZE_PTCP)%2;
    sr_ip_hdr_t *ip_header = (sr_ip_hdr_t*)packet;
-   void * buf = calloc(new_len,1);
-
-   sr_tcp_pseudo_hdr_t * pseudo = (sr_tcp_pseudo_hdr_t*)buf;
-   pseudo->ip_src = ip_header->ip_src;
-   pseudo->ip_dst = ip_header->ip_dst;
-   pseudo->reserved = 0;
-   pseudo->ip_p = ip_header->ip_p;
-   pseudo->len = htons(tcp_len);
-
-   sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t*)(buf+SIZE_PTCP);   
-   memcpy(buf+SIZE_PTCP,packet+SIZE_IP,tcp_len);
-   tcp_hdr->tcp_sum = 0;
-
-   uint16_t ret = cksum(buf,new_len);
-   free(buf);
-   return ret;
+   unsigned int ihl = ip_header->ip_hl*4;
+   return sr_l4_cksum(ip_header, (uint8_t*)packet+ihl, len-ihl,
+                      offsetof(sr_tcp_hdr_t, tcp_sum));
+}
+
+uint16_t sr_l4_cksum(const void *ip, const void *l4, unsigned int l4_len,
+                     unsigned int sum_off) {
+  const sr_ip_hdr_t *ip_header = ip;
+  const uint8_t *data = l4;
+  uint8_t tail[2] = {0, 0};
+  uint16_t field;
+  uint32_t sum;
+
+  sum = cksum_partial(data, l4_len & ~1U);
+  if (l4_len & 1) {
+    tail[0] = data[l4_len-1];
+    sum += cksum_partial(tail, 2);
+  }
+  if (ip_header != NULL) {
+    /* source, destination, zero and protocol, transport length */
+    sum += cksum_partial(&(ip_header->ip_src), 8);
+    sum += htons(ip_header->ip_p);
+    sum += htons(l4_len);
+  }
+  /* take the checksum field back out: adding ~x subtracts x */
+  memcpy(&field, data+sum_off, 2);
+  sum += (uint16_t)~field;
+  return cksum_finish(sum);
+}
+
+uint16_t cksum_update16(uint16_t sum, uint16_t old, uint16_t new) {
+  uint32_t acc = (uint16_t)~sum;
+  acc += (uint16_t)~old;
+  acc += new;
+  acc = (acc >> 16) + (acc & 0xffff);
+  acc = (acc >> 16) + (acc & 0xffff);
+  sum = (uint16_t)~acc;
+  return sum ? sum : 0xffff; /* same convention as cksum() */
+}
+
+uint16_t cksum_update32(uint16_t sum, uint32_t old, uint32_t new) {
+  sum = cksum_update16(sum, (uint16_t)(old >> 16), (uint16_t)(new >> 16));
+  return cksum_update16(sum, (uint16_t)old, (uint16_t)new);
+}
+
+uint32_t cksum_delta32(uint32_t old, uint32_t new) {
+  return (uint32_t)(uint16_t)~(old >> 16) + (uint16_t)(new >> 16) +
+         (uint16_t)~old + (uint16_t)new;
+}
+
+uint16_t cksum_apply(uint16_t sum, uint32_t delta) {
+  uint32_t acc = (uint16_t)~sum;
+  acc += (delta >> 16) + (delta & 0xffff);
+  acc = (acc >> 16) + (acc & 0xffff);
+  acc = (acc >> 16) + (acc & 0xffff);
+  sum = (uint16_t)~acc;
+  return sum ? sum : 0xffff;
+}
+
+uint32_t cksum_partial(const void *_data, int len) {
+  const uint8_t *data = _data;
+  uint32_t sum = 0;
+  uint16_t word;
+
+  for (; len >= 2; data += 2, len -= 2) {
+    memcpy(&word, data, 2);
+    sum += word;
+  }
+  return sum;
+}
+
+uint16_t cksum_finish(uint32_t sum) {
+  uint16_t ret;
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum = (sum >> 16) + (sum & 0xffff);
+  ret = (uint16_t)~sum;
+  return ret ? ret : 0xffff;
+}
+
+unsigned int sr_ip_hash(uint32_t ip, unsigned int bits) {
+  return ((ip ^ (ip >> 16)) * 0x9e3779b1U) >> (32 - bits);
 }
 
 uint16_t ethertype(uint8_t *buf) {
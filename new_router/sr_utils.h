@@ -31,6 +31,32 @@
 uint16_t cksum(const void *_data, int len);
 uint16_t sr_tcp_cksum(void * packet, unsigned int len);
 
+/* Checksum for the transport segment at l4 (l4_len bytes), as if its
+   checksum field sum_off bytes in were zero; over ip's pseudo header too
+   unless ip is NULL (ICMP) */
+uint16_t sr_l4_cksum(const void *ip, const void *l4, unsigned int l4_len,
+                     unsigned int sum_off);
+
+/* Incremental checksum update (RFC 1624) after a 16 or 32 bit field of the
+   covered data changed from old to new. Everything in network byte order. */
+uint16_t cksum_update16(uint16_t sum, uint16_t old, uint16_t new);
+uint16_t cksum_update32(uint16_t sum, uint32_t old, uint32_t new);
+
+/* The same split in two, for a change applied to many packets: the delta
+   of old -> new (deltas add up), then applying a summed delta to a sum. */
+uint32_t cksum_delta32(uint32_t old, uint32_t new);
+uint16_t cksum_apply(uint16_t sum, uint32_t delta);
+
+/* Unfolded sum of the 16 bit words of data (len even) as they lie in
+   memory, to be added to and finished into a checksum later */
+uint32_t cksum_partial(const void *_data, int len);
+uint16_t cksum_finish(uint32_t sum);
+
+/* Table index of an IPv4 address (either byte order), bits wide. The
+   halves are folded before the multiply so that addresses differing only
+   in the low octets still spread. */
+unsigned int sr_ip_hash(uint32_t ip, unsigned int bits);
+
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
 
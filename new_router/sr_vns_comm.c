@@ -44,6 +44,7 @@
 #include "sha1.h"
 #include "vnscommand.h"
 #include "sr_utils.h"
+#include "sr_tx.h"
 
 static void sr_log_packet(struct sr_instance* , uint8_t* , int );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
@@ -440,11 +441,22 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                     ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
 
             /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+            if (sr->pipeline.nworkers > 0)
+            {
+                sr_pipeline_dispatch(sr,
+                        (buf+sizeof(c_packet_header)),
+                        len - sizeof(c_packet_ethernet_header) +
+                        sizeof(struct sr_ethernet_hdr),
+                        (char*)(buf + sizeof(c_base)));
+            }
+            else
+            {
+                sr_handlepacket(sr,
+                        (buf+sizeof(c_packet_header)),
+                        len - sizeof(c_packet_ethernet_header) +
+                        sizeof(struct sr_ethernet_hdr),
+                        (char*)(buf + sizeof(c_base)));
+            }
 
             break;
 
@@ -556,7 +568,8 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
  * Scope: Global
  *
  * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * to be injected onto the wire. Safe to call from any thread; the framed
+ * message is queued for the TX thread (see sr_tx.h).
  *
  *---------------------------------------------------------------------------*/
 
@@ -581,9 +594,11 @@ print_hdrs(buf,len);
     }
 
     /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
+    sr_pkt = (c_packet_header *)sr_tx_alloc(sr, total_len);
+    if ( sr_pkt == NULL ){
+        fprintf(stderr, "** Error: out of memory for packet\n");
+        return -1;
+    }
     sr_pkt->mLen  = htonl(total_len);
     sr_pkt->mType = htonl(VNSPACKET);
     strncpy(sr_pkt->mInterfaceName,iface,16);
@@ -595,19 +610,12 @@ print_hdrs(buf,len);
 
     if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
         fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
+        sr_tx_free(sr, sr_pkt, total_len);
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
-        fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
-        return -1;
-    }
-
-    free(sr_pkt);
-
-    return 0;
+    /* -- the TX thread owns the socket and frees sr_pkt -- */
+    return sr_tx_enqueue(sr, sr_pkt, total_len);
 } /* -- sr_send_packet -- */
 
 /*-----------------------------------------------------------------------------